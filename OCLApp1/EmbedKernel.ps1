@@ -0,0 +1,28 @@
+# Wraps an OpenCL source file in a C++ header that registers it with
+# RegisterEmbeddedSource, so the executable doesn't need the .cl file at runtime.
+# Usage: EmbedKernel.ps1 <input.cl> <output.h>
+param([string]$InputPath, [string]$OutputPath)
+
+$name = [System.IO.Path]::GetFileName($InputPath)
+$id = $name -replace '[^A-Za-z0-9]', '_'
+$source = [System.IO.File]::ReadAllText($InputPath) -replace "`r`n", "`n"
+
+# MSVC caps a single string literal at 16K characters, so long sources become adjacent literals
+$chunkSize = 8000
+$chunks = @()
+for ($i = 0; $i -lt $source.Length; $i += $chunkSize) {
+    $chunks += 'R"OCLSRC(' + $source.Substring($i, [Math]::Min($chunkSize, $source.Length - $i)) + ')OCLSRC"'
+}
+if ($chunks.Count -eq 0) {
+    $chunks += '""'
+}
+
+$lines = @(
+    "// Generated from $name by EmbedKernel.ps1, do not edit",
+    "#pragma once",
+    "static const bool ${id}_embedded = RegisterEmbeddedSource(`"$name`",",
+    (($chunks -join "`n") + ");")
+)
+
+New-Item -ItemType Directory -Force -Path ([System.IO.Path]::GetDirectoryName($OutputPath)) | Out-Null
+[System.IO.File]::WriteAllText($OutputPath, ($lines -join "`n") + "`n")
@@ -0,0 +1,85 @@
+// Kernels timed by the device microbenchmarks in Program.cpp. Loop counts are
+// arguments so the host knows exactly how much work each launch does.
+
+__kernel
+void Empty()
+{
+}
+
+__kernel
+void CopyFloat4(__global const float4* input,
+                __global float4* output)
+{
+	int i = get_global_id(0);
+	output[i] = input[i];
+}
+
+// Each work-item reads a column of texels, the access pattern of a vertical filter pass
+__kernel
+void ReadImage(__read_only image2d_t inputImage,
+               sampler_t sampler,
+               __global float4* output,
+               __private int reads)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	float4 sum = (float4)(0.0f);
+
+	for (int i = 0; i < reads; ++i)
+	{
+		sum += read_imagef(inputImage, sampler, (int2)(x, y + i));
+	}
+
+	output[y * get_global_size(0) + x] = sum;
+}
+
+// The local size must be a power of two, each iteration reads a neighbour's value
+__kernel
+void LocalBandwidth(__global float4* output,
+                    __local float4* scratch,
+                    __private int iterations)
+{
+	int localId = get_local_id(0);
+	int mask = get_local_size(0) - 1;
+	float4 value = (float4)(localId);
+
+	scratch[localId] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = 0; i < iterations; ++i)
+	{
+		value += scratch[(localId + i) & mask];
+	}
+
+	// Stored so the reads aren't optimised away
+	output[get_global_id(0)] = value;
+}
+
+// 16 multiply-adds per iteration on four independent chains, so the ALUs
+// aren't waiting on the previous result
+#define FLOPS_KERNEL(name, type)                                    \
+__kernel                                                            \
+void name(__global type* output,                                    \
+          __private float multiplier,                               \
+          __private int iterations)                                 \
+{                                                                   \
+	type a = (type)(get_global_id(0));                              \
+	type b = a + (type)(1.0f);                                      \
+	type c = a + (type)(2.0f);                                      \
+	type d = a + (type)(3.0f);                                      \
+	type m = (type)(multiplier);                                    \
+	type n = (type)(1.0f);                                          \
+                                                                    \
+	for (int i = 0; i < iterations; ++i)                            \
+	{                                                               \
+		a = mad(a, m, n); b = mad(b, m, n); c = mad(c, m, n); d = mad(d, m, n); \
+		a = mad(a, m, n); b = mad(b, m, n); c = mad(c, m, n); d = mad(d, m, n); \
+		a = mad(a, m, n); b = mad(b, m, n); c = mad(c, m, n); d = mad(d, m, n); \
+		a = mad(a, m, n); b = mad(b, m, n); c = mad(c, m, n); d = mad(d, m, n); \
+	}                                                               \
+                                                                    \
+	output[get_global_id(0)] = a + b + c + d;                       \
+}
+
+FLOPS_KERNEL(FlopsFloat, float)
+FLOPS_KERNEL(FlopsFloat4, float4)
@@ -0,0 +1,112 @@
+#include "Elementwise.h"
+#include "OCLUtils.h"
+
+#include <algorithm>
+
+#define ELEMENTWISE_CL_FILENAME "Program.cl"
+
+// Work-items per compute unit in a launch, enough to hide memory latency
+#define ITEMS_PER_COMPUTE_UNIT 2048
+
+unsigned GetElementwiseVectorWidth(const cl::Device& device)
+{
+	auto profile = GetDeviceProfile(device);
+
+	if (profile->preferredVectorWidthFloat >= 8)
+	{
+		return 8;
+	}
+	else if (profile->preferredVectorWidthFloat >= 4)
+	{
+		return 4;
+	}
+
+	return 1;
+}
+
+size_t GetElementwiseGlobalSize(const cl::Device& device, size_t count, unsigned width)
+{
+	size_t maxGlobalSize = std::max<size_t>(GetDeviceProfile(device)->computeUnits * ITEMS_PER_COMPUTE_UNIT, width);
+	return std::min(std::max<size_t>(count / width, width), maxGlobalSize);
+}
+
+static const char* GetOpName(ElementwiseOp op)
+{
+	switch (op)
+	{
+	case ElementwiseOp::Add:
+		return "Add";
+	case ElementwiseOp::Sub:
+		return "Sub";
+	case ElementwiseOp::Mult:
+		return "Mult";
+	case ElementwiseOp::Div:
+		return "Div";
+	default:
+		throw std::runtime_error("Unknown elementwise operation");
+	}
+}
+
+Elementwise::Elementwise(const cl::Context& context, const cl::Device& device)
+	: device(device), vectorWidth(GetElementwiseVectorWidth(device))
+{
+	std::vector<const char*> sourceFileNames;
+	sourceFileNames.push_back(ELEMENTWISE_CL_FILENAME);
+	cl::Program program = MakeAndBuildProgram(sourceFileNames, context, device);
+	std::unordered_map<std::string, cl::Kernel> kernels = MakeKernels(program);
+
+	const ElementwiseOp ops[ELEMENTWISE_OP_COUNT] = {ElementwiseOp::Add, ElementwiseOp::Sub, ElementwiseOp::Mult, ElementwiseOp::Div};
+	for (auto op : ops)
+	{
+		int index = static_cast<int>(op);
+		binaryKernels[index] = BinaryKernel(kernels, GetKernelName(op, ""));
+		inPlaceKernels[index] = InPlaceKernel(kernels, GetKernelName(op, "InPlace"));
+		scalarKernels[index] = ScalarKernel(kernels, GetKernelName(op, "Scalar"));
+	}
+}
+
+cl::Event Elementwise::Apply(const cl::CommandQueue& queue, ElementwiseOp op,
+                             const cl::Buffer& a, const cl::Buffer& b, const cl::Buffer& c, size_t count,
+                             const std::vector<cl::Event>* events)
+{
+	cl::Event event;
+	binaryKernels[static_cast<int>(op)].Enqueue(queue, cl::NDRange(GetElementwiseGlobalSize(device, count, vectorWidth)),
+	                                            cl::NullRange, events, &event, a, b, c, static_cast<cl_uint>(count));
+	return event;
+}
+
+cl::Event Elementwise::ApplyInPlace(const cl::CommandQueue& queue, ElementwiseOp op,
+                                    const cl::Buffer& a, const cl::Buffer& b, size_t count,
+                                    const std::vector<cl::Event>* events)
+{
+	cl::Event event;
+	inPlaceKernels[static_cast<int>(op)].Enqueue(queue, cl::NDRange(GetElementwiseGlobalSize(device, count, vectorWidth)),
+	                                             cl::NullRange, events, &event, a, b, static_cast<cl_uint>(count));
+	return event;
+}
+
+cl::Event Elementwise::ApplyScalar(const cl::CommandQueue& queue, ElementwiseOp op,
+                                   const cl::Buffer& a, float b, const cl::Buffer& c, size_t count,
+                                   const std::vector<cl::Event>* events)
+{
+	cl::Event event;
+	scalarKernels[static_cast<int>(op)].Enqueue(queue, cl::NDRange(GetElementwiseGlobalSize(device, count, vectorWidth)),
+	                                            cl::NullRange, events, &event, a, b, c, static_cast<cl_uint>(count));
+	return event;
+}
+
+unsigned Elementwise::GetVectorWidth() const
+{
+	return vectorWidth;
+}
+
+std::string Elementwise::GetKernelName(ElementwiseOp op, const char* form) const
+{
+	std::string name = std::string(GetOpName(op)) + form + "_float";
+	if (vectorWidth > 1)
+	{
+		name += std::to_string(vectorWidth);
+	}
+
+	return name;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#ifndef __ELEMENTWISE_H__
+#define __ELEMENTWISE_H__
+
+#include <string>
+#include <vector>
+#include <CL/cl.hpp>
+
+#include "OCLUtils.h"
+
+enum class ElementwiseOp
+{
+	Add,
+	Sub,
+	Mult,
+	Div
+};
+
+#define ELEMENTWISE_OP_COUNT 4
+
+// Preferred float vector width of the device, rounded down to 1, 4 or 8
+unsigned
+GetElementwiseVectorWidth(const cl::Device& device);
+
+// Global size for a grid-stride launch over count floats: enough work-items to
+// fill the device, and at least width - 1 for the scalar tail
+size_t
+GetElementwiseGlobalSize(const cl::Device& device, size_t count, unsigned width);
+
+// Elementwise arithmetic on float buffers, built on the kernels in Program.cl.
+// The vector width is the device's preferred float width rounded down to 1, 4
+// or 8. Counts are in floats and don't need to be a multiple of the width.
+// Launches are sized to fill the device once and the kernels stride over the
+// rest, so large arrays don't pay for millions of work-groups.
+class Elementwise
+{
+public:
+	Elementwise(const cl::Context& context, const cl::Device& device);
+
+	// c = a op b
+	cl::Event Apply(const cl::CommandQueue& queue, ElementwiseOp op,
+	                const cl::Buffer& a, const cl::Buffer& b, const cl::Buffer& c, size_t count,
+	                const std::vector<cl::Event>* events = nullptr);
+
+	// a = a op b
+	cl::Event ApplyInPlace(const cl::CommandQueue& queue, ElementwiseOp op,
+	                       const cl::Buffer& a, const cl::Buffer& b, size_t count,
+	                       const std::vector<cl::Event>* events = nullptr);
+
+	// c = a op b for every element of a
+	cl::Event ApplyScalar(const cl::CommandQueue& queue, ElementwiseOp op,
+	                      const cl::Buffer& a, float b, const cl::Buffer& c, size_t count,
+	                      const std::vector<cl::Event>* events = nullptr);
+
+	unsigned GetVectorWidth() const;
+
+private:
+	// a, b, c, count
+	typedef KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_uint> BinaryKernel;
+	// a, b, count
+	typedef KernelFunctor<cl::Buffer, cl::Buffer, cl_uint> InPlaceKernel;
+	// a, b, c, count
+	typedef KernelFunctor<cl::Buffer, float, cl::Buffer, cl_uint> ScalarKernel;
+
+	std::string GetKernelName(ElementwiseOp op, const char* form) const;
+
+	cl::Device device;
+	unsigned vectorWidth;
+
+	// Resolved once per operation, indexed by ElementwiseOp, so launches only set changed arguments
+	BinaryKernel binaryKernels[ELEMENTWISE_OP_COUNT];
+	InPlaceKernel inPlaceKernels[ELEMENTWISE_OP_COUNT];
+	ScalarKernel scalarKernels[ELEMENTWISE_OP_COUNT];
+};
+
+#endif // __ELEMENTWISE_H__
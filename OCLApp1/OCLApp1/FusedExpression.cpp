@@ -0,0 +1,146 @@
+#include "FusedExpression.h"
+#include "OCLUtils.h"
+
+#include <sstream>
+
+#define FUSED_KERNEL "Fused"
+
+std::string ExpressionArguments::AddBuffer(const cl::Buffer& buffer)
+{
+	for (size_t i = 0; i < buffers.size(); ++i)
+	{
+		if (buffers[i]() == buffer())
+		{
+			return "x" + std::to_string(i);
+		}
+	}
+
+	buffers.push_back(buffer);
+	return "x" + std::to_string(buffers.size() - 1);
+}
+
+std::string ExpressionArguments::AddConstant(float value)
+{
+	constants.push_back(value);
+	return "c" + std::to_string(constants.size() - 1);
+}
+
+const std::vector<cl::Buffer>& ExpressionArguments::GetBuffers() const
+{
+	return buffers;
+}
+
+const std::vector<float>& ExpressionArguments::GetConstants() const
+{
+	return constants;
+}
+
+FusedElementwise::FusedElementwise(const cl::Context& context, const cl::Device& device)
+	: context(context), device(device), vectorWidth(GetElementwiseVectorWidth(device))
+{
+}
+
+size_t FusedElementwise::GetKernelCount() const
+{
+	return kernels.size();
+}
+
+// Same layout as the kernels in Program.cl: a grid-stride loop over whole
+// vectors, then one scalar element each for the first n % width work-items.
+// The expression text is shared by both, only the variable types differ.
+std::string FusedElementwise::MakeSource(const std::string& text, const ExpressionArguments& arguments) const
+{
+	std::string type = vectorWidth > 1 ? "float" + std::to_string(vectorWidth) : "float";
+	size_t bufferCount = arguments.GetBuffers().size();
+	size_t constantCount = arguments.GetConstants().size();
+	std::ostringstream source;
+
+	source << "__kernel\nvoid " << FUSED_KERNEL << "(";
+	for (size_t i = 0; i < bufferCount; ++i)
+	{
+		source << "__global const float* in" << i << ", ";
+	}
+	for (size_t i = 0; i < constantCount; ++i)
+	{
+		source << "float k" << i << ", ";
+	}
+	source << "__global float* out, uint n)\n{\n";
+	source << "\tuint vectors = n / " << vectorWidth << ";\n";
+	source << "\tuint tail = vectors * " << vectorWidth << ";\n\n";
+
+	source << "\tfor (uint i = get_global_id(0); i < vectors; i += get_global_size(0))\n\t{\n";
+	for (size_t i = 0; i < bufferCount; ++i)
+	{
+		source << "\t\t" << type << " x" << i << " = ";
+		if (vectorWidth > 1)
+		{
+			source << "vload" << vectorWidth << "(i, in" << i << ");\n";
+		}
+		else
+		{
+			source << "in" << i << "[i];\n";
+		}
+	}
+	for (size_t i = 0; i < constantCount; ++i)
+	{
+		source << "\t\t" << type << " c" << i << " = (" << type << ")(k" << i << ");\n";
+	}
+	if (vectorWidth > 1)
+	{
+		source << "\t\tvstore" << vectorWidth << "(" << text << ", i, out);\n\t}\n\n";
+	}
+	else
+	{
+		source << "\t\tout[i] = " << text << ";\n\t}\n\n";
+	}
+
+	source << "\tif (tail + get_global_id(0) < n)\n\t{\n";
+	source << "\t\tuint i = tail + get_global_id(0);\n";
+	for (size_t i = 0; i < bufferCount; ++i)
+	{
+		source << "\t\tfloat x" << i << " = in" << i << "[i];\n";
+	}
+	for (size_t i = 0; i < constantCount; ++i)
+	{
+		source << "\t\tfloat c" << i << " = k" << i << ";\n";
+	}
+	source << "\t\tout[i] = " << text << ";\n\t}\n}\n";
+
+	return source.str();
+}
+
+cl::Event FusedElementwise::Enqueue(const cl::CommandQueue& queue, const cl::Buffer& output, const std::string& text,
+                                    const ExpressionArguments& arguments, size_t count, const std::vector<cl::Event>* events)
+{
+	cl_int err;
+	cl::Event event;
+
+	// The text names every input, so it identifies the kernel's shape
+	auto cached = kernels.find(text);
+	if (cached == kernels.end())
+	{
+		cl::Program program = MakeAndBuildProgramFromSource(MakeSource(text, arguments), context, device);
+		cl::Kernel kernel(program, FUSED_KERNEL, &err);
+		CheckErrorCode(err, "Unable to create fused kernel for " + text);
+		cached = kernels.insert(std::make_pair(text, kernel)).first;
+	}
+
+	cl::Kernel& kernel = cached->second;
+	cl_uint argument = 0;
+	for (auto& buffer : arguments.GetBuffers())
+	{
+		kernel.setArg(argument++, buffer);
+	}
+	for (auto constant : arguments.GetConstants())
+	{
+		kernel.setArg(argument++, constant);
+	}
+	kernel.setArg(argument++, output);
+	kernel.setArg(argument++, static_cast<cl_uint>(count));
+
+	size_t globalSize = GetElementwiseGlobalSize(device, count, vectorWidth);
+	err = queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(globalSize), cl::NullRange, events, &event);
+	CheckErrorCode(err, "Unable to enqueue fused kernel");
+
+	return event;
+}
@@ -0,0 +1,159 @@
+#pragma once
+#ifndef __FUSED_EXPRESSION_H__
+#define __FUSED_EXPRESSION_H__
+
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <CL/cl.hpp>
+
+#include "Elementwise.h"
+
+// Inputs of an expression in the order the generated kernel takes them.
+// A buffer used twice is read once.
+class ExpressionArguments
+{
+public:
+	// Name of the kernel variable holding the buffer's element
+	std::string AddBuffer(const cl::Buffer& buffer);
+
+	// Constants are kernel arguments, so the same shape with other values reuses the kernel
+	std::string AddConstant(float value);
+
+	const std::vector<cl::Buffer>& GetBuffers() const;
+	const std::vector<float>& GetConstants() const;
+
+private:
+	std::vector<cl::Buffer> buffers;
+	std::vector<float> constants;
+};
+
+// Leaf reading a float buffer
+class ExpressionBuffer
+{
+public:
+	explicit ExpressionBuffer(const cl::Buffer& buffer) : buffer(buffer) {}
+
+	std::string Emit(ExpressionArguments& arguments) const
+	{
+		return arguments.AddBuffer(buffer);
+	}
+
+private:
+	cl::Buffer buffer;
+};
+
+// Leaf for a float broadcast to every element
+class ExpressionConstant
+{
+public:
+	explicit ExpressionConstant(float value) : value(value) {}
+
+	std::string Emit(ExpressionArguments& arguments) const
+	{
+		return arguments.AddConstant(value);
+	}
+
+private:
+	float value;
+};
+
+template <typename Left, typename Right>
+class ExpressionBinary
+{
+public:
+	ExpressionBinary(ElementwiseOp op, const Left& left, const Right& right) : op(op), left(left), right(right) {}
+
+	std::string Emit(ExpressionArguments& arguments) const
+	{
+		static const char* symbols[4] = {" + ", " - ", " * ", " / "};
+		std::string leftText = left.Emit(arguments);
+		std::string rightText = right.Emit(arguments);
+		return "(" + leftText + symbols[static_cast<int>(op)] + rightText + ")";
+	}
+
+private:
+	ElementwiseOp op;
+	Left left;
+	Right right;
+};
+
+template <typename T> struct IsExpression : std::false_type {};
+template <> struct IsExpression<ExpressionBuffer> : std::true_type {};
+template <> struct IsExpression<ExpressionConstant> : std::true_type {};
+template <typename Left, typename Right> struct IsExpression<ExpressionBinary<Left, Right> > : std::true_type {};
+
+// Node type an operand becomes, buffers and numbers are wrapped in leaves,
+// so expr * 2 and expr * 0.5 work as well as expr * 0.5f
+template <typename T, typename Enable = void> struct ExpressionOf { typedef T type; };
+template <> struct ExpressionOf<cl::Buffer> { typedef ExpressionBuffer type; };
+template <typename T>
+struct ExpressionOf<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> { typedef ExpressionConstant type; };
+
+// Starts an expression from a buffer, e.g. (Lazy(a) + b) * c / d
+inline ExpressionBuffer Lazy(const cl::Buffer& buffer) { return ExpressionBuffer(buffer); }
+
+// Operators apply when either side is already an expression, so plain
+// cl::Buffer and arithmetic operands are wrapped on the way in
+#define EXPRESSION_OPERATOR(symbol, op)                                                                      \
+template <typename Left, typename Right>                                                                     \
+typename std::enable_if<IsExpression<Left>::value || IsExpression<Right>::value,                             \
+                        ExpressionBinary<typename ExpressionOf<Left>::type,                                  \
+                                         typename ExpressionOf<Right>::type> >::type                         \
+operator symbol(const Left& left, const Right& right)                                                        \
+{                                                                                                            \
+	return ExpressionBinary<typename ExpressionOf<Left>::type, typename ExpressionOf<Right>::type>(          \
+		op, typename ExpressionOf<Left>::type(left), typename ExpressionOf<Right>::type(right));             \
+}
+
+EXPRESSION_OPERATOR(+, ElementwiseOp::Add)
+EXPRESSION_OPERATOR(-, ElementwiseOp::Sub)
+EXPRESSION_OPERATOR(*, ElementwiseOp::Mult)
+EXPRESSION_OPERATOR(/, ElementwiseOp::Div)
+
+#undef EXPRESSION_OPERATOR
+
+// Evaluates elementwise expressions with one generated kernel each, so a chain
+// of operators reads every input once and writes the output once instead of
+// making a memory pass per operator. Kernels are generated in the device's
+// preferred vector width, built through MakeAndBuildProgramFromSource and
+// so the program cache, and kept per expression shape for reuse.
+class FusedElementwise
+{
+public:
+	FusedElementwise(const cl::Context& context, const cl::Device& device);
+
+	// output = expression over count floats
+	template <typename Expression>
+	cl::Event Evaluate(const cl::CommandQueue& queue, const cl::Buffer& output, const Expression& expression,
+	                   size_t count, const std::vector<cl::Event>* events = nullptr)
+	{
+		ExpressionArguments arguments;
+		std::string text = expression.Emit(arguments);
+		return Enqueue(queue, output, text, arguments, count, events);
+	}
+
+	// Source of the kernel that evaluates an expression, for inspection
+	template <typename Expression>
+	std::string GetSource(const Expression& expression) const
+	{
+		ExpressionArguments arguments;
+		std::string text = expression.Emit(arguments);
+		return MakeSource(text, arguments);
+	}
+
+	size_t GetKernelCount() const;
+
+private:
+	std::string MakeSource(const std::string& text, const ExpressionArguments& arguments) const;
+	cl::Event Enqueue(const cl::CommandQueue& queue, const cl::Buffer& output, const std::string& text,
+	                  const ExpressionArguments& arguments, size_t count, const std::vector<cl::Event>* events);
+
+	cl::Context context;
+	cl::Device device;
+	unsigned vectorWidth;
+	std::unordered_map<std::string, cl::Kernel> kernels;
+};
+
+#endif // __FUSED_EXPRESSION_H__
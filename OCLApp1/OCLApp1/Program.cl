@@ -1,35 +1,86 @@
-__kernel
-void Add(__global float *a,
-         __global float *b,
-         __global float *c)
-{
+// Elementwise float arithmetic, used through the Elementwise class in Elementwise.h.
+// Every operation comes in float, float4 and float8 widths. Arrays are plain float
+// arrays of n elements, so the same buffers work with any width. Work-items stride
+// over the array by the global size, so any launch size covers any length, and the
+// first few work-items pick up the n % width elements that don't fill a vector.
 
-   *c = *a + *b;
-}
-
-__kernel
-void Sub(__global float *a,
-         __global float *b,
-         __global float *c)
-{
-
-   *c = *a - *b;
-}
-
-__kernel 
-void Mult(__global float *a,
-          __global float *b,
-          __global float *c)
-{
+#define LOAD_1(i, p) (p)[i]
+#define LOAD_4(i, p) vload4(i, p)
+#define LOAD_8(i, p) vload8(i, p)
+#define STORE_1(v, i, p) (p)[i] = (v)
+#define STORE_4(v, i, p) vstore4(v, i, p)
+#define STORE_8(v, i, p) vstore8(v, i, p)
 
-   *c = *a * *b;
+#define BINARY_KERNELS(name, op, type, width)                                \
+__kernel                                                                     \
+void name##_##type(__global const float* a,                                  \
+                   __global const float* b,                                  \
+                   __global float* c,                                        \
+                   __private uint n)                                         \
+{                                                                            \
+	uint vectors = n / width;                                                \
+	uint tail = vectors * width;                                             \
+                                                                             \
+	for (uint i = get_global_id(0); i < vectors; i += get_global_size(0))    \
+	{                                                                        \
+		STORE_##width(LOAD_##width(i, a) op LOAD_##width(i, b), i, c);       \
+	}                                                                        \
+                                                                             \
+	if (tail + get_global_id(0) < n)                                         \
+	{                                                                        \
+		uint i = tail + get_global_id(0);                                    \
+		c[i] = a[i] op b[i];                                                 \
+	}                                                                        \
+}                                                                            \
+                                                                             \
+__kernel                                                                     \
+void name##InPlace_##type(__global float* a,                                 \
+                          __global const float* b,                           \
+                          __private uint n)                                  \
+{                                                                            \
+	uint vectors = n / width;                                                \
+	uint tail = vectors * width;                                             \
+                                                                             \
+	for (uint i = get_global_id(0); i < vectors; i += get_global_size(0))    \
+	{                                                                        \
+		STORE_##width(LOAD_##width(i, a) op LOAD_##width(i, b), i, a);       \
+	}                                                                        \
+                                                                             \
+	if (tail + get_global_id(0) < n)                                         \
+	{                                                                        \
+		uint i = tail + get_global_id(0);                                    \
+		a[i] = a[i] op b[i];                                                 \
+	}                                                                        \
+}                                                                            \
+                                                                             \
+__kernel                                                                     \
+void name##Scalar_##type(__global const float* a,                            \
+                         __private float b,                                  \
+                         __global float* c,                                  \
+                         __private uint n)                                   \
+{                                                                            \
+	uint vectors = n / width;                                                \
+	uint tail = vectors * width;                                             \
+	type scalar = (type)(b);                                                 \
+                                                                             \
+	for (uint i = get_global_id(0); i < vectors; i += get_global_size(0))    \
+	{                                                                        \
+		STORE_##width(LOAD_##width(i, a) op scalar, i, c);                   \
+	}                                                                        \
+                                                                             \
+	if (tail + get_global_id(0) < n)                                         \
+	{                                                                        \
+		uint i = tail + get_global_id(0);                                    \
+		c[i] = a[i] op b;                                                    \
+	}                                                                        \
 }
 
-__kernel
-void Div(__global float *a,
-         __global float *b,
-         __global float *c)
-{
+#define ALL_WIDTHS(name, op)              \
+	BINARY_KERNELS(name, op, float, 1)    \
+	BINARY_KERNELS(name, op, float4, 4)   \
+	BINARY_KERNELS(name, op, float8, 8)
 
-   *c = *a / *b;
-}
+ALL_WIDTHS(Add, +)
+ALL_WIDTHS(Sub, -)
+ALL_WIDTHS(Mult, *)
+ALL_WIDTHS(Div, /)
@@ -2,13 +2,48 @@
 #include <fstream>
 #include <sstream>
 #include <memory>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
 
 #include <CL/cl.hpp>
 
-bool BuildProgram(const std::string& filename,
-                  const cl::Context& context,
-                  const cl::Device& device,
-                  cl::Program* program);
+#include "OCLUtils.h"
+#include "Elementwise.h"
+#include "FusedExpression.h"
+
+// Kernel sources embedded at build time by EmbedKernel.ps1
+#include "Program.cl.h"
+#include "Benchmark.cl.h"
+
+#define BENCHMARK_CL_FILENAME "Benchmark.cl"
+#define BENCHMARK_PROFILE_FILENAME "DeviceBenchmark.txt"
+
+#define EMPTY_KERNEL "Empty"
+#define COPY_FLOAT4_KERNEL "CopyFloat4"
+#define READ_IMAGE_KERNEL "ReadImage"
+#define LOCAL_BANDWIDTH_KERNEL "LocalBandwidth"
+#define FLOPS_FLOAT_KERNEL "FlopsFloat"
+#define FLOPS_FLOAT4_KERNEL "FlopsFloat4"
+
+#define BENCHMARK_RUNS 5
+#define TRANSFER_SIZE (64 * 1024 * 1024)
+#define COPY_ELEMENTS (4 * 1024 * 1024)
+#define IMAGE_SIZE 2048
+#define IMAGE_READS 16
+#define LOCAL_SIZE 256
+#define LOCAL_ITERATIONS 256
+#define LAUNCH_COUNT 1000
+#define FLOPS_ITEMS (1024 * 1024)
+#define FLOPS_ITERATIONS 256
+#define MADS_PER_ITERATION 16
+
+// Not a multiple of any vector width, so the tail path gets checked too
+#define ELEMENTWISE_CHECK_COUNT (1024 * 1024 + 7)
+#define ELEMENTWISE_TOLERANCE 1e-5f
+
+void CheckElementwise(const cl::Context& context, const cl::Device& device);
+void RunBenchmarks(const cl::Context& context, const cl::Device& device);
 
 int main()
 {
@@ -148,81 +183,414 @@ int main()
 	std::cout << std::endl;
 
 	/*
-		Build program from source
+		Elementwise arithmetic against the host
 	*/
-	cl::Program program;
+	CheckElementwise(*context, defaultDevice);
 
-	if (!BuildProgram("Program.cl", *context, contextDevices[0], &program))
+	/*
+		Measure what the device actually delivers
+	*/
+	RunBenchmarks(*context, defaultDevice);
+
+	return 0;
+}
+
+void CheckElementwise(const cl::Context& context, const cl::Device& device)
+{
+	cl_int err;
+	cl::CommandQueue queue = MakeCommandQueue(context, device, 0);
+	Elementwise elementwise(context, device);
+
+	std::vector<float> a(ELEMENTWISE_CHECK_COUNT);
+	std::vector<float> b(ELEMENTWISE_CHECK_COUNT);
+	std::vector<float> c(ELEMENTWISE_CHECK_COUNT);
+	for (size_t i = 0; i < a.size(); ++i)
 	{
-		std::cerr << "Unable to build program" << std::endl;
-		return err;
+		a[i] = static_cast<float>(i % 1000) + 1.0f;
+		b[i] = static_cast<float>(i % 7) + 0.5f;
 	}
 
-	std::cout << "Successfully built program" << std::endl;
+	size_t size = sizeof(float) * a.size();
+	cl::Buffer aBuffer = MakeBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, &a[0]);
+	cl::Buffer bBuffer = MakeBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, &b[0]);
+	cl::Buffer cBuffer = MakeBuffer(context, CL_MEM_WRITE_ONLY, size);
+
+	std::cout << "Elementwise arithmetic with float" << elementwise.GetVectorWidth() << " on "
+	          << ELEMENTWISE_CHECK_COUNT << " floats" << std::endl;
+
+	const ElementwiseOp ops[4] = {ElementwiseOp::Add, ElementwiseOp::Sub, ElementwiseOp::Mult, ElementwiseOp::Div};
+	const char* opNames[4] = {"Add", "Sub", "Mult", "Div"};
+	const float scalar = 3.0f;
 
-	for (auto d : program.getInfo<CL_PROGRAM_DEVICES>())
+	for (auto i = 0; i < 4; ++i)
 	{
-		std::cout << d.getInfo<CL_DEVICE_NAME>() << std::endl;
+		auto apply = [&](float x, float y)
+		{
+			switch (ops[i])
+			{
+			case ElementwiseOp::Add: return x + y;
+			case ElementwiseOp::Sub: return x - y;
+			case ElementwiseOp::Mult: return x * y;
+			default: return x / y;
+			}
+		};
+
+		// Buffer operand, then scalar operand
+		for (auto form = 0; form < 2; ++form)
+		{
+			if (form == 0)
+			{
+				elementwise.Apply(queue, ops[i], aBuffer, bBuffer, cBuffer, a.size());
+			}
+			else
+			{
+				elementwise.ApplyScalar(queue, ops[i], aBuffer, scalar, cBuffer, a.size());
+			}
+
+			err = queue.enqueueReadBuffer(cBuffer, CL_TRUE, 0, size, &c[0]);
+			CheckErrorCode(err, "Unable to read elementwise result");
+
+			size_t mismatches = 0;
+			for (size_t j = 0; j < a.size(); ++j)
+			{
+				float expected = apply(a[j], form == 0 ? b[j] : scalar);
+				if (std::abs(c[j] - expected) > ELEMENTWISE_TOLERANCE * std::max(1.0f, std::abs(expected)))
+				{
+					++mismatches;
+				}
+			}
+
+			std::cout << "  " << opNames[i] << (form == 0 ? "" : "Scalar") << ": "
+			          << (mismatches == 0 ? "OK" : std::to_string(mismatches) + " mismatches") << std::endl;
+		}
 	}
 
-	std::cout << program.getInfo<CL_PROGRAM_SOURCE>() << std::endl;
+	// A fused chain with a repeated input and a constant
+	FusedElementwise fused(context, device);
+	fused.Evaluate(queue, cBuffer, (Lazy(aBuffer) + bBuffer) * 2.0f / bBuffer - aBuffer, a.size());
+	err = queue.enqueueReadBuffer(cBuffer, CL_TRUE, 0, size, &c[0]);
+	CheckErrorCode(err, "Unable to read fused result");
 
-	/*
-		Create kernel objects
-	*/
-	std::vector<cl::Kernel> kernels;
+	size_t fusedMismatches = 0;
+	for (size_t j = 0; j < a.size(); ++j)
+	{
+		float expected = (a[j] + b[j]) * 2.0f / b[j] - a[j];
+		if (std::abs(c[j] - expected) > ELEMENTWISE_TOLERANCE * std::max(1.0f, std::abs(expected)))
+		{
+			++fusedMismatches;
+		}
+	}
+
+	std::cout << "  Fused (a + b) * 2 / b - a: "
+	          << (fusedMismatches == 0 ? "OK" : std::to_string(fusedMismatches) + " mismatches") << std::endl;
 
-	if (program.createKernels(&kernels) != CL_SUCCESS)
+	// In place last, since it overwrites a
+	elementwise.ApplyInPlace(queue, ElementwiseOp::Add, aBuffer, bBuffer, a.size());
+	err = queue.enqueueReadBuffer(aBuffer, CL_TRUE, 0, size, &c[0]);
+	CheckErrorCode(err, "Unable to read elementwise result");
+
+	size_t mismatches = 0;
+	for (size_t j = 0; j < a.size(); ++j)
 	{
-		std::cerr << "Unable to create kernels from program" << std::endl;
-		return err;
+		if (c[j] != a[j] + b[j])
+		{
+			++mismatches;
+		}
 	}
 
-	std::cout << "Successfully created kernels from the program" << std::endl;
-	std::cout << "Number of kernels: " << kernels.size() << std::endl;
+	std::cout << "  AddInPlace: " << (mismatches == 0 ? "OK" : std::to_string(mismatches) + " mismatches") << std::endl;
+	std::cout << std::endl;
+}
+
+// Device time of a profiled command in seconds
+double GetEventSeconds(const cl::Event& event)
+{
+	return (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+	        event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) / 1e9;
+}
+
+// Shortest device time of BENCHMARK_RUNS launches, after one launch that
+// pays for lazy allocation and compilation
+double TimeKernel(const cl::CommandQueue& queue, const cl::Kernel& kernel,
+                  const cl::NDRange& global, const cl::NDRange& local)
+{
+	cl_int err;
+	double best = 0.0;
 
-	for (size_t i = 0; i < kernels.size(); ++i)
+	for (auto i = 0; i <= BENCHMARK_RUNS; ++i)
 	{
-		std::cout << "CL_KERNEL_FUNCTION_NAME[" << i << "]: " << kernels[i].getInfo<CL_KERNEL_FUNCTION_NAME>() << std::endl;
+		cl::Event event;
+		err = queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, nullptr, &event);
+		CheckErrorCode(err, "Unable to enqueue benchmark kernel");
+		err = event.wait();
+		CheckErrorCode(err, "Unable to wait for benchmark kernel");
+
+		double seconds = GetEventSeconds(event);
+		if (i > 0 && (best == 0.0 || seconds < best))
+		{
+			best = seconds;
+		}
 	}
 
-	return 0;
+	return best;
 }
 
-bool BuildProgram(const std::string& filename,
-                  const cl::Context& context,
-                  const cl::Device& device,
-                  cl::Program* program)
+// Highest bandwidth of BENCHMARK_RUNS blocking transfers in GB/s
+double MeasureTransfer(const cl::CommandQueue& queue, const cl::Buffer& buffer,
+                       void* hostPtr, size_t size, bool toDevice)
 {
-	std::ifstream infile;
-	std::stringstream stream;
-	std::string buffer;
-	cl::Program::Sources sources;
 	cl_int err;
+	double best = 0.0;
 
-	infile.open(filename.c_str());
-	if (infile.is_open() && infile.good())
+	for (auto i = 0; i < BENCHMARK_RUNS; ++i)
 	{
-		stream << infile.rdbuf();
+		cl::Event event;
+		if (toDevice)
+		{
+			err = queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, size, hostPtr, nullptr, &event);
+		}
+		else
+		{
+			err = queue.enqueueReadBuffer(buffer, CL_TRUE, 0, size, hostPtr, nullptr, &event);
+		}
+		CheckErrorCode(err, "Unable to transfer benchmark buffer");
+
+		best = std::max(best, size / GetEventSeconds(event) / 1e9);
 	}
-	infile.close();
 
-	buffer = stream.str();
-	sources.push_back(std::make_pair(buffer.c_str(), buffer.length()));
+	return best;
+}
 
-	*program = cl::Program(context, sources, &err);
-	if (err != CL_SUCCESS)
+void RunBenchmarks(const cl::Context& context, const cl::Device& device)
+{
+	cl_int err;
+	auto profile = GetDeviceProfile(device);
+	cl::CommandQueue queue = MakeCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+
+	std::vector<const char*> sourceFileNames;
+	sourceFileNames.push_back(BENCHMARK_CL_FILENAME);
+	cl::Program program = MakeAndBuildProgram(sourceFileNames, context, device);
+	std::unordered_map<std::string, cl::Kernel> kernels = MakeKernels(program);
+
+	// Results of the last run saved for this device, so the report shows what changed
+	std::map<std::string, double> previousResults;
+	std::ifstream infile(BENCHMARK_PROFILE_FILENAME);
+	if (infile.is_open())
+	{
+		try
+		{
+			DeviceProfile previous = DeviceProfile::Read(infile);
+			if (previous.name == profile->name)
+			{
+				previousResults = previous.benchmarks;
+			}
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << "Ignoring " << BENCHMARK_PROFILE_FILENAME << ": " << e.what() << std::endl;
+		}
+		infile.close();
+	}
+
+	// Name, value and unit of every measurement, in the order they run
+	std::vector<std::tuple<std::string, double, std::string> > results;
+
+	/*
+		Host <-> device bandwidth, pageable and pinned host memory
+	*/
+	size_t transferSize = std::min<size_t>(TRANSFER_SIZE, profile->maxMemAllocSize);
+	cl::Buffer deviceBuffer = MakeBuffer(context, CL_MEM_READ_WRITE, transferSize);
+	{
+		std::vector<unsigned char> pageable(transferSize);
+		results.push_back(std::make_tuple("hostToDevicePageable",
+		                  MeasureTransfer(queue, deviceBuffer, &pageable[0], transferSize, true), "GB/s"));
+		results.push_back(std::make_tuple("deviceToHostPageable",
+		                  MeasureTransfer(queue, deviceBuffer, &pageable[0], transferSize, false), "GB/s"));
+	}
+	{
+		// Mapping an ALLOC_HOST_PTR buffer is the portable way to get page-locked host memory
+		cl::Buffer pinnedBuffer = MakeBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, transferSize);
+		MappedMemory pinned(queue, pinnedBuffer, CL_MAP_READ | CL_MAP_WRITE, transferSize);
+		results.push_back(std::make_tuple("hostToDevicePinned",
+		                  MeasureTransfer(queue, deviceBuffer, pinned.GetData(), transferSize, true), "GB/s"));
+		results.push_back(std::make_tuple("deviceToHostPinned",
+		                  MeasureTransfer(queue, deviceBuffer, pinned.GetData(), transferSize, false), "GB/s"));
+	}
+
+	/*
+		Global memory bandwidth, every float4 read once and written once
+	*/
+	size_t copyElements = std::min<size_t>(COPY_ELEMENTS, profile->maxMemAllocSize / (sizeof(float) * 4));
+	cl::Buffer copyInput = MakeBuffer(context, CL_MEM_READ_ONLY, sizeof(float) * 4 * copyElements);
+	// Read and written, the elementwise benchmarks below take it as an input
+	cl::Buffer copyOutput = MakeBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * 4 * copyElements);
+	err = queue.enqueueFillBuffer(copyInput, 1.5f, 0, sizeof(float) * 4 * copyElements);
+	CheckErrorCode(err, "Unable to fill benchmark buffer");
+	cl::Kernel& copyKernel = kernels[COPY_FLOAT4_KERNEL];
+	copyKernel.setArg(0, copyInput);
+	copyKernel.setArg(1, copyOutput);
+	double copySeconds = TimeKernel(queue, copyKernel, cl::NDRange(copyElements), cl::NullRange);
+	results.push_back(std::make_tuple("globalMemoryBandwidth",
+	                  2.0 * sizeof(float) * 4 * copyElements / copySeconds / 1e9, "GB/s"));
+
+	/*
+		Elementwise add bandwidth, two arrays read and one written
+	*/
+	{
+		Elementwise elementwise(context, device);
+		cl::Buffer addOutput = MakeBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * 4 * copyElements);
+		// Refilled after the copy benchmark overwrote it, nonzero since the fused chain divides by it
+		err = queue.enqueueFillBuffer(copyOutput, 2.0f, 0, sizeof(float) * 4 * copyElements);
+		CheckErrorCode(err, "Unable to fill benchmark buffer");
+		double addSeconds = 0.0;
+		for (auto i = 0; i <= BENCHMARK_RUNS; ++i)
+		{
+			cl::Event event = elementwise.Apply(queue, ElementwiseOp::Add, copyInput, copyOutput, addOutput, 4 * copyElements);
+			err = event.wait();
+			CheckErrorCode(err, "Unable to wait for elementwise kernel");
+
+			double seconds = GetEventSeconds(event);
+			if (i > 0 && (addSeconds == 0.0 || seconds < addSeconds))
+			{
+				addSeconds = seconds;
+			}
+		}
+		results.push_back(std::make_tuple("elementwiseAddBandwidth",
+		                  3.0 * sizeof(float) * 4 * copyElements / addSeconds / 1e9, "GB/s"));
+
+		// (a + b) * a / b as three launches and as one fused kernel
+		FusedElementwise fused(context, device);
+		double unfusedSeconds = 0.0;
+		double fusedSeconds = 0.0;
+		for (auto i = 0; i <= BENCHMARK_RUNS; ++i)
+		{
+			std::vector<cl::Event> chain;
+			chain.push_back(elementwise.Apply(queue, ElementwiseOp::Add, copyInput, copyOutput, addOutput, 4 * copyElements));
+			chain.push_back(elementwise.ApplyInPlace(queue, ElementwiseOp::Mult, addOutput, copyInput, 4 * copyElements));
+			chain.push_back(elementwise.ApplyInPlace(queue, ElementwiseOp::Div, addOutput, copyOutput, 4 * copyElements));
+			cl::Event fusedEvent = fused.Evaluate(queue, addOutput, (Lazy(copyInput) + copyOutput) * copyInput / copyOutput,
+			                                      4 * copyElements);
+			err = fusedEvent.wait();
+			CheckErrorCode(err, "Unable to wait for fused kernel");
+
+			double seconds = 0.0;
+			for (auto& event : chain)
+			{
+				seconds += GetEventSeconds(event);
+			}
+			if (i > 0 && (unfusedSeconds == 0.0 || seconds < unfusedSeconds))
+			{
+				unfusedSeconds = seconds;
+			}
+
+			seconds = GetEventSeconds(fusedEvent);
+			if (i > 0 && (fusedSeconds == 0.0 || seconds < fusedSeconds))
+			{
+				fusedSeconds = seconds;
+			}
+		}
+		results.push_back(std::make_tuple("unfusedChainTime", unfusedSeconds * 1e3, "ms"));
+		results.push_back(std::make_tuple("fusedChainTime", fusedSeconds * 1e3, "ms"));
+	}
+
+	/*
+		Image read throughput
+	*/
+	if (profile->imageSupport)
+	{
+		std::vector<unsigned char> pixels(IMAGE_SIZE * IMAGE_SIZE * 4, 128);
+		cl::Image2D image = MakeImage2D(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		                                cl::ImageFormat(CL_RGBA, CL_UNORM_INT8), IMAGE_SIZE, IMAGE_SIZE, 0, &pixels[0]);
+		cl::Sampler sampler = MakeSampler(context, CL_FALSE, CL_ADDRESS_CLAMP_TO_EDGE, CL_FILTER_NEAREST);
+		cl::Buffer imageOutput = MakeBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * 4 * IMAGE_SIZE * IMAGE_SIZE);
+		cl::Kernel& imageKernel = kernels[READ_IMAGE_KERNEL];
+		imageKernel.setArg(0, image);
+		imageKernel.setArg(1, sampler);
+		imageKernel.setArg(2, imageOutput);
+		imageKernel.setArg(3, IMAGE_READS);
+		double imageSeconds = TimeKernel(queue, imageKernel, cl::NDRange(IMAGE_SIZE, IMAGE_SIZE), cl::NullRange);
+		results.push_back(std::make_tuple("imageReadThroughput",
+		                  1.0 * IMAGE_SIZE * IMAGE_SIZE * IMAGE_READS / imageSeconds / 1e9, "GTexels/s"));
+	}
+
+	/*
+		Local memory bandwidth
+	*/
+	size_t localSize = LOCAL_SIZE;
+	while (localSize > profile->maxWorkGroupSize)
+	{
+		localSize /= 2;
+	}
+	cl::Buffer localOutput = MakeBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * 4 * FLOPS_ITEMS);
+	cl::Kernel& localKernel = kernels[LOCAL_BANDWIDTH_KERNEL];
+	localKernel.setArg(0, localOutput);
+	localKernel.setArg(1, cl::Local(sizeof(float) * 4 * localSize));
+	localKernel.setArg(2, LOCAL_ITERATIONS);
+	double localSeconds = TimeKernel(queue, localKernel, cl::NDRange(FLOPS_ITEMS), cl::NDRange(localSize));
+	results.push_back(std::make_tuple("localMemoryBandwidth",
+	                  1.0 * sizeof(float) * 4 * FLOPS_ITEMS * LOCAL_ITERATIONS / localSeconds / 1e9, "GB/s"));
+
+	/*
+		Kernel launch latency: the host's round trip and the time a launch waits on the device
+	*/
+	cl::Kernel& emptyKernel = kernels[EMPTY_KERNEL];
+	double waitSeconds = 0.0;
+	auto startTime = std::chrono::steady_clock::now();
+	for (auto i = 0; i < LAUNCH_COUNT; ++i)
 	{
-		std::cerr << "Unable to create program object" << std::endl;
-		return false;
+		cl::Event event;
+		err = queue.enqueueNDRangeKernel(emptyKernel, cl::NullRange, cl::NDRange(1), cl::NullRange, nullptr, &event);
+		CheckErrorCode(err, "Unable to enqueue empty kernel");
+		err = event.wait();
+		CheckErrorCode(err, "Unable to wait for empty kernel");
+
+		waitSeconds += (event.getProfilingInfo<CL_PROFILING_COMMAND_START>() -
+		                event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()) / 1e9;
 	}
+	double roundTripSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	results.push_back(std::make_tuple("launchRoundTrip", roundTripSeconds / LAUNCH_COUNT * 1e6, "us"));
+	results.push_back(std::make_tuple("launchQueuedToStart", waitSeconds / LAUNCH_COUNT * 1e6, "us"));
 
-	if (program->build() != CL_SUCCESS)
+	/*
+		Peak single precision throughput, scalar and float4
+	*/
+	cl::Buffer flopsOutput = MakeBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * 4 * FLOPS_ITEMS);
+	const char* flopsKernels[2] = {FLOPS_FLOAT_KERNEL, FLOPS_FLOAT4_KERNEL};
+	int flopsWidths[2] = {1, 4};
+	for (auto i = 0; i < 2; ++i)
 	{
-		std::cerr << program->getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
-		return false;
+		cl::Kernel& flopsKernel = kernels[flopsKernels[i]];
+		flopsKernel.setArg(0, flopsOutput);
+		flopsKernel.setArg(1, 0.999f);
+		flopsKernel.setArg(2, FLOPS_ITERATIONS);
+		double flopsSeconds = TimeKernel(queue, flopsKernel, cl::NDRange(FLOPS_ITEMS), cl::NullRange);
+
+		// A multiply-add counts as two operations
+		double flops = 2.0 * MADS_PER_ITERATION * FLOPS_ITERATIONS * flopsWidths[i] * FLOPS_ITEMS;
+		results.push_back(std::make_tuple(i == 0 ? "peakFlopsFloat" : "peakFlopsFloat4", flops / flopsSeconds / 1e9, "GFLOPS"));
+	}
+
+	/*
+		Report and save next to the static properties
+	*/
+	DeviceProfile measured = *profile;
+
+	std::cout << "Benchmarks for " << profile->name << ":" << std::endl;
+	for (auto& result : results)
+	{
+		std::cout << "  " << std::get<0>(result) << ": " << std::get<1>(result) << " " << std::get<2>(result);
+		auto previous = previousResults.find(std::get<0>(result));
+		if (previous != previousResults.end() && previous->second != 0.0)
+		{
+			std::cout << " (was " << previous->second << ", "
+			          << (std::get<1>(result) / previous->second - 1.0) * 100.0 << "%)";
+		}
+		std::cout << std::endl;
+		measured.benchmarks[std::get<0>(result)] = std::get<1>(result);
 	}
 
-	std::cout << program->getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
-	return true;
+	std::ofstream outfile(BENCHMARK_PROFILE_FILENAME);
+	measured.Write(outfile);
+	outfile.close();
+	std::cout << "Wrote " << BENCHMARK_PROFILE_FILENAME << std::endl;
 }
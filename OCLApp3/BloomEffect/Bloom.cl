@@ -16,6 +16,26 @@ void DiscardPixels(__read_only image2d_t inputImage,
 	write_imagef(outputImage, coord, pixel);
 }
 
+// Same as DiscardPixels, with the threshold taken from a reduced luminance sum so no host round trip is needed
+__kernel
+void DiscardPixelsBySum(__read_only image2d_t inputImage,
+                        __write_only image2d_t outputImage,
+                        sampler_t sampler,
+                        __global const float* luminanceSum)
+{
+	int2 coord = (int2)(get_global_id(0), get_global_id(1));
+	float4 pixel = read_imagef(inputImage, sampler, coord);
+	float luminance = 0.299f * (pixel.x * 255) + 0.587f * (pixel.y * 255) + 0.114f * (pixel.z * 255);
+	float luminanceAverage = luminanceSum[0] / (float)(get_global_size(0) * get_global_size(1));
+
+	if (luminance < luminanceAverage)
+	{
+		pixel.xyz = 0.0f;
+	}
+
+	write_imagef(outputImage, coord, pixel);
+}
+
 __kernel
 void MergeImages(__read_only image2d_t inputImageA,
                  __read_only image2d_t inputImageB,
@@ -2,6 +2,12 @@
 #ifndef __FILTERS_H__
 #define __FILTERS_H__
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
 static const float GaussianFilter3x3[9] = {
 	0.077847f, 0.123317f, 0.077847f,
 	0.123317f, 0.195346f, 0.123317f,
@@ -38,4 +44,113 @@ static const float GaussianFilter7[7] = {
 	0.00598f, 0.060626f, 0.241843f, 0.383103f, 0.241843f, 0.060626f, 0.00598f
 };
 
+// Range of sigma the generated filters below are meant for
+#define MIN_GAUSSIAN_SIGMA 0.5f
+#define MAX_GAUSSIAN_SIGMA 50.0f
+
+// Filters up to this size are baked into the kernels as constants. Wider ones
+// stay in the filter buffer and only their size is compiled in, so one build
+// per radius serves every sigma.
+#define MAX_BAKED_FILTER_SIZE 15
+
+// Rounding step for radii of filters that aren't baked
+#define GAUSSIAN_RADIUS_STEP 4
+
+// Blurs with a radius above this use the recursive Gaussian instead of the
+// convolution kernels. Define it in the project settings to move the switch,
+// or set OCL_RECURSIVE_GAUSSIAN_RADIUS to move it without a rebuild.
+#ifndef RECURSIVE_GAUSSIAN_RADIUS
+#define RECURSIVE_GAUSSIAN_RADIUS 12
+#endif
+
+#define RECURSIVE_GAUSSIAN_RADIUS_ENV "OCL_RECURSIVE_GAUSSIAN_RADIUS"
+
+// Radius covering three standard deviations, past which the weights add up to
+// under 0.3%. Radii of filters that aren't baked are rounded up to a multiple
+// of GAUSSIAN_RADIUS_STEP, so nearby sigmas share one kernel build.
+inline int GetGaussianRadius(float sigma)
+{
+	int radius = std::max(1, static_cast<int>(std::ceil(3.0f * sigma)));
+	if (2 * radius + 1 > MAX_BAKED_FILTER_SIZE)
+	{
+		radius = (radius + GAUSSIAN_RADIUS_STEP - 1) / GAUSSIAN_RADIUS_STEP * GAUSSIAN_RADIUS_STEP;
+	}
+
+	return radius;
+}
+
+// Normalised 1D Gaussian weights, 2 * radius + 1 of them
+inline std::vector<float> MakeGaussianFilter(float sigma, int radius)
+{
+	std::vector<float> filter(2 * radius + 1);
+	float total = 0.0f;
+
+	for (int i = -radius; i <= radius; ++i)
+	{
+		filter[i + radius] = std::exp(-(i * i) / (2.0f * sigma * sigma));
+		total += filter[i + radius];
+	}
+
+	for (auto& weight : filter)
+	{
+		weight /= total;
+	}
+
+	return filter;
+}
+
+// Normalised 2D Gaussian weights row after row, the outer product of the 1D weights
+inline std::vector<float> MakeGaussianFilter2D(float sigma, int radius)
+{
+	std::vector<float> filter1D = MakeGaussianFilter(sigma, radius);
+	std::vector<float> filter(filter1D.size() * filter1D.size());
+
+	for (size_t y = 0; y < filter1D.size(); ++y)
+	{
+		for (size_t x = 0; x < filter1D.size(); ++x)
+		{
+			filter[y * filter1D.size() + x] = filter1D[y] * filter1D[x];
+		}
+	}
+
+	return filter;
+}
+
+// Young and van Vliet's recursive Gaussian, "Recursive implementation of the
+// Gaussian filter" (1995). Each pass runs forwards then backwards along a line as
+// y[n] = b * x[n] + a1 * y[n - 1] + a2 * y[n - 2] + a3 * y[n - 3], so the cost per
+// pixel is the same for every sigma. Returns b, a1, a2 and a3.
+inline std::vector<float> MakeRecursiveGaussianCoefficients(float sigma)
+{
+	float q = sigma >= 2.5f ? 0.98711f * sigma - 0.96330f : 3.97156f - 4.14554f * std::sqrt(1.0f - 0.26891f * sigma);
+	float q2 = q * q;
+	float q3 = q2 * q;
+
+	float b0 = 1.57825f + 2.44413f * q + 1.4281f * q2 + 0.422205f * q3;
+	float b1 = 2.44413f * q + 2.85619f * q2 + 1.26661f * q3;
+	float b2 = -(1.4281f * q2 + 1.26661f * q3);
+	float b3 = 0.422205f * q3;
+
+	std::vector<float> coefficients(4);
+	coefficients[0] = 1.0f - (b1 + b2 + b3) / b0;
+	coefficients[1] = b1 / b0;
+	coefficients[2] = b2 / b0;
+	coefficients[3] = b3 / b0;
+	return coefficients;
+}
+
+// Largest radius still convolved: OCL_RECURSIVE_GAUSSIAN_RADIUS, or RECURSIVE_GAUSSIAN_RADIUS when unset
+inline int GetRecursiveGaussianRadius()
+{
+	const char* radius = getenv(RECURSIVE_GAUSSIAN_RADIUS_ENV);
+	return (radius == nullptr || *radius == '\0') ? RECURSIVE_GAUSSIAN_RADIUS : std::stoi(radius);
+}
+
+// Whether a blur is cheaper through the recursive Gaussian than the convolution kernels,
+// maxRadius being the largest radius still convolved
+inline bool UseRecursiveGaussian(float sigma, int maxRadius = GetRecursiveGaussianRadius())
+{
+	return GetGaussianRadius(sigma) > maxRadius;
+}
+
 #endif // __FILTERS_H__
@@ -2,6 +2,47 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <regex>
+#include <mutex>
+#include <thread>
+
+#ifdef WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <direct.h>
+#include <io.h>
+#include <malloc.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+#define PLATFORM_ENV "OCL_PLATFORM"
+#define DEVICE_TYPE_ENV "OCL_DEVICE_TYPE"
+#define DEVICE_NAME_ENV "OCL_DEVICE_NAME"
+
+#define MULTI_DEVICE_ENV "OCL_MULTI_DEVICE"
+
+#define ZERO_COPY_ENV "OCL_ZERO_COPY"
+
+#define TUNING_DB_ENV "OCL_TUNING_DB"
+#define TUNING_DB_DEFAULT_FILENAME "WorkGroupTuning.txt"
+#define TUNING_RUNS 5
+
+#define MEMORY_BUDGET_ENV "OCL_MEMORY_BUDGET"
+#define MEMORY_BUDGET_FRACTION 0.9
+#define MEMORY_UNTAGGED "Other"
+
+#define PROGRAM_CACHE_DIR_ENV "OCL_PROGRAM_CACHE_DIR"
+#define PROGRAM_CACHE_DEFAULT_DIR "ProgramCache"
+#define PROGRAM_CACHE_MAGIC "OCLProgramCache 1"
 
 void CheckErrorCode(const cl_int& err, const std::string& errMsg)
 {
@@ -12,45 +53,334 @@ void CheckErrorCode(const cl_int& err, const std::string& errMsg)
 	}
 }
 
-cl::Device GetDevice(const std::string& vendorName)
+static std::string GetEnvironment(const char* name)
+{
+	const char* value = getenv(name);
+	return value == nullptr ? "" : value;
+}
+
+static std::string ToLower(std::string text)
+{
+	std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+	return text;
+}
+
+static std::string GetDeviceTypeName(cl_device_type deviceType)
+{
+	if (deviceType & CL_DEVICE_TYPE_GPU) return "GPU";
+	if (deviceType & CL_DEVICE_TYPE_CPU) return "CPU";
+	if (deviceType & CL_DEVICE_TYPE_ACCELERATOR) return "Accelerator";
+	return "Default";
+}
+
+static cl_device_type ParseDeviceType(const std::string& name)
+{
+	std::string type = ToLower(name);
+	if (type == "gpu") return CL_DEVICE_TYPE_GPU;
+	if (type == "cpu") return CL_DEVICE_TYPE_CPU;
+	if (type == "accelerator") return CL_DEVICE_TYPE_ACCELERATOR;
+	if (type.empty() || type == "all" || type == "any") return CL_DEVICE_TYPE_ALL;
+
+	throw std::runtime_error("Unknown " DEVICE_TYPE_ENV " value: " + name);
+}
+
+bool DeviceProfile::HasExtension(const std::string& extension) const
+{
+	return (" " + extensions + " ").find(" " + extension + " ") != std::string::npos;
+}
+
+void DeviceProfile::Write(std::ostream& out) const
+{
+	out << "name=" << name << "\n"
+		<< "vendor=" << vendor << "\n"
+		<< "driverVersion=" << driverVersion << "\n"
+		<< "platformName=" << platformName << "\n"
+		<< "platformVendor=" << platformVendor << "\n"
+		<< "platformVersion=" << platformVersion << "\n"
+		<< "type=" << type << "\n"
+		<< "computeUnits=" << computeUnits << "\n"
+		<< "clockFrequency=" << clockFrequency << "\n"
+		<< "globalMemSize=" << globalMemSize << "\n"
+		<< "maxMemAllocSize=" << maxMemAllocSize << "\n"
+		<< "localMemSize=" << localMemSize << "\n"
+		<< "maxConstantBufferSize=" << maxConstantBufferSize << "\n"
+		<< "maxWorkGroupSize=" << maxWorkGroupSize << "\n"
+		<< "maxWorkItemSizes=";
+	for (size_t i = 0; i < maxWorkItemSizes.size(); ++i)
+	{
+		out << (i == 0 ? "" : " ") << maxWorkItemSizes[i];
+	}
+	out << "\n"
+		<< "imageSupport=" << imageSupport << "\n"
+		<< "image2DMaxWidth=" << image2DMaxWidth << "\n"
+		<< "image2DMaxHeight=" << image2DMaxHeight << "\n"
+		<< "hostUnifiedMemory=" << hostUnifiedMemory << "\n"
+		<< "queueProperties=" << queueProperties << "\n"
+		<< "preferredVectorWidthChar=" << preferredVectorWidthChar << "\n"
+		<< "preferredVectorWidthShort=" << preferredVectorWidthShort << "\n"
+		<< "preferredVectorWidthInt=" << preferredVectorWidthInt << "\n"
+		<< "preferredVectorWidthLong=" << preferredVectorWidthLong << "\n"
+		<< "preferredVectorWidthFloat=" << preferredVectorWidthFloat << "\n"
+		<< "preferredVectorWidthDouble=" << preferredVectorWidthDouble << "\n"
+		<< "extensions=" << extensions << "\n";
+	for (auto& benchmark : benchmarks)
+	{
+		out << "benchmark." << benchmark.first << "=" << benchmark.second << "\n";
+	}
+}
+
+DeviceProfile DeviceProfile::Read(std::istream& in)
+{
+	std::unordered_map<std::string, std::string> values;
+	std::string line;
+
+	while (std::getline(in, line))
+	{
+		size_t separator = line.find('=');
+		if (separator != std::string::npos)
+		{
+			values[line.substr(0, separator)] = line.substr(separator + 1);
+		}
+	}
+
+	auto text = [&](const std::string& field) -> const std::string&
+	{
+		auto entry = values.find(field);
+		if (entry == values.end())
+		{
+			throw std::runtime_error("Device profile has no " + field + " field");
+		}
+		return entry->second;
+	};
+	auto number = [&](const std::string& field)
+	{
+		return static_cast<cl_ulong>(std::stoull(text(field)));
+	};
+
+	DeviceProfile profile;
+	profile.name = text("name");
+	profile.vendor = text("vendor");
+	profile.driverVersion = text("driverVersion");
+	profile.platformName = text("platformName");
+	profile.platformVendor = text("platformVendor");
+	profile.platformVersion = text("platformVersion");
+	profile.type = static_cast<cl_device_type>(number("type"));
+	profile.computeUnits = static_cast<cl_uint>(number("computeUnits"));
+	profile.clockFrequency = static_cast<cl_uint>(number("clockFrequency"));
+	profile.globalMemSize = number("globalMemSize");
+	profile.maxMemAllocSize = number("maxMemAllocSize");
+	profile.localMemSize = number("localMemSize");
+	profile.maxConstantBufferSize = number("maxConstantBufferSize");
+	profile.maxWorkGroupSize = static_cast<size_t>(number("maxWorkGroupSize"));
+
+	std::istringstream sizes(text("maxWorkItemSizes"));
+	size_t size;
+	while (sizes >> size)
+	{
+		profile.maxWorkItemSizes.push_back(size);
+	}
+
+	profile.imageSupport = number("imageSupport") != 0;
+	profile.image2DMaxWidth = static_cast<size_t>(number("image2DMaxWidth"));
+	profile.image2DMaxHeight = static_cast<size_t>(number("image2DMaxHeight"));
+	profile.hostUnifiedMemory = number("hostUnifiedMemory") != 0;
+	profile.queueProperties = static_cast<cl_command_queue_properties>(number("queueProperties"));
+	profile.preferredVectorWidthChar = static_cast<cl_uint>(number("preferredVectorWidthChar"));
+	profile.preferredVectorWidthShort = static_cast<cl_uint>(number("preferredVectorWidthShort"));
+	profile.preferredVectorWidthInt = static_cast<cl_uint>(number("preferredVectorWidthInt"));
+	profile.preferredVectorWidthLong = static_cast<cl_uint>(number("preferredVectorWidthLong"));
+	profile.preferredVectorWidthFloat = static_cast<cl_uint>(number("preferredVectorWidthFloat"));
+	profile.preferredVectorWidthDouble = static_cast<cl_uint>(number("preferredVectorWidthDouble"));
+	profile.extensions = text("extensions");
+
+	for (auto& value : values)
+	{
+		if (value.first.compare(0, 10, "benchmark.") == 0)
+		{
+			profile.benchmarks[value.first.substr(10)] = std::stod(value.second);
+		}
+	}
+
+	return profile;
+}
+
+std::shared_ptr<const DeviceProfile> GetDeviceProfile(const cl::Device& device)
+{
+	static std::mutex mutex;
+	static std::unordered_map<cl_device_id, std::shared_ptr<const DeviceProfile> > profiles;
+
+	// Program builds on background threads ask for profiles too
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto entry = profiles.find(device());
+	if (entry != profiles.end())
+	{
+		return entry->second;
+	}
+
+	std::shared_ptr<DeviceProfile> profile(new DeviceProfile);
+	cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+
+	profile->name = device.getInfo<CL_DEVICE_NAME>();
+	profile->vendor = device.getInfo<CL_DEVICE_VENDOR>();
+	profile->driverVersion = device.getInfo<CL_DRIVER_VERSION>();
+	profile->platformName = platform.getInfo<CL_PLATFORM_NAME>();
+	profile->platformVendor = platform.getInfo<CL_PLATFORM_VENDOR>();
+	profile->platformVersion = platform.getInfo<CL_PLATFORM_VERSION>();
+	profile->type = device.getInfo<CL_DEVICE_TYPE>();
+	profile->computeUnits = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+	profile->clockFrequency = device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+	profile->globalMemSize = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+	profile->maxMemAllocSize = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	profile->localMemSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	profile->maxConstantBufferSize = device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>();
+	profile->maxWorkGroupSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+	profile->maxWorkItemSizes = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+	profile->imageSupport = device.getInfo<CL_DEVICE_IMAGE_SUPPORT>() == CL_TRUE;
+	profile->image2DMaxWidth = device.getInfo<CL_DEVICE_IMAGE2D_MAX_WIDTH>();
+	profile->image2DMaxHeight = device.getInfo<CL_DEVICE_IMAGE2D_MAX_HEIGHT>();
+	profile->hostUnifiedMemory = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
+	profile->queueProperties = device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>();
+	profile->preferredVectorWidthChar = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR>();
+	profile->preferredVectorWidthShort = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT>();
+	profile->preferredVectorWidthInt = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT>();
+	profile->preferredVectorWidthLong = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG>();
+	profile->preferredVectorWidthFloat = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT>();
+	profile->preferredVectorWidthDouble = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE>();
+	profile->extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+
+	profiles.insert(std::make_pair(device(), profile));
+	return profile;
+}
+
+double ScoreDevice(const cl::Device& device)
+{
+	auto profile = GetDeviceProfile(device);
+	auto deviceType = profile->type;
+	auto computeUnits = profile->computeUnits;
+	auto clockFrequency = profile->clockFrequency;
+	auto globalMemSize = profile->globalMemSize;
+	auto localMemSize = profile->localMemSize;
+	auto imageSupport = profile->imageSupport;
+
+	// A GPU compute unit runs many more lanes than a CPU core
+	double lanesPerUnit = 1.0;
+	if (deviceType & CL_DEVICE_TYPE_GPU)
+	{
+		lanesPerUnit = 16.0;
+	}
+	else if (deviceType & CL_DEVICE_TYPE_ACCELERATOR)
+	{
+		lanesPerUnit = 8.0;
+	}
+
+	double score = computeUnits * std::max<cl_uint>(clockFrequency, 1) * lanesPerUnit;
+
+	// Mild preference for more memory, strong penalty for devices the image kernels cannot run on
+	score *= 1.0 + 0.05 * (globalMemSize / (1024.0 * 1024.0 * 1024.0));
+	score *= localMemSize >= 32 * 1024 ? 1.0 : 0.5;
+	score *= imageSupport ? 1.0 : 0.1;
+
+	return score;
+}
+
+std::vector<DeviceScore> RankDevices(cl_device_type deviceType)
 {
 	cl_int err;
 	std::vector<cl::Platform> platforms;
-	std::vector<cl::Device> devices;
-	cl::Platform platform;
-	cl::Device device;
+	std::vector<DeviceScore> ranking;
 
-	// Get all platforms
 	err = cl::Platform::get(&platforms);
 	CheckErrorCode(err, "Unable to get OpenCL platforms");
-	std::cout << "Found " << platforms.size() << " platform(s)" << std::endl;
 
-	// Get specified vendor platform
-	if (vendorName.empty())
+	for (auto platform : platforms)
+	{
+		std::vector<cl::Device> devices;
+
+		// A platform without devices of this type is not an error
+		if (platform.getDevices(deviceType, &devices) != CL_SUCCESS)
+		{
+			continue;
+		}
+
+		for (auto device : devices)
+		{
+			if (device.getInfo<CL_DEVICE_AVAILABLE>())
+			{
+				DeviceScore entry;
+				entry.device = device;
+				entry.score = ScoreDevice(device);
+				ranking.push_back(entry);
+			}
+		}
+	}
+
+	std::stable_sort(ranking.begin(), ranking.end(), [](const DeviceScore& a, const DeviceScore& b)
 	{
-		platform = platforms[0];
+		return a.score > b.score;
+	});
+
+	return ranking;
+}
+
+cl::Device GetDevice(const std::string& vendorName)
+{
+	std::string platformName = GetEnvironment(PLATFORM_ENV);
+	std::string deviceName = ToLower(GetEnvironment(DEVICE_NAME_ENV));
+	cl_device_type deviceType = ParseDeviceType(GetEnvironment(DEVICE_TYPE_ENV));
+
+	if (platformName.empty())
+	{
+		platformName = vendorName;
 	}
-	else
+	platformName = ToLower(platformName);
+
+	std::vector<DeviceScore> ranking = RankDevices(deviceType);
+	std::vector<DeviceScore> candidates;
+
+	std::cout << "Found " << ranking.size() << " device(s)" << std::endl;
+	for (auto entry : ranking)
+	{
+		auto profile = GetDeviceProfile(entry.device);
+		const std::string& platformVendor = profile->platformVendor;
+		const std::string& platformTitle = profile->platformName;
+		const std::string& name = profile->name;
+
+		std::cout << "  [" << GetDeviceTypeName(profile->type) << "] "
+			<< name << " (" << platformTitle << "), score " << entry.score << std::endl;
+
+		bool platformMatches = ToLower(platformVendor).find(platformName) != std::string::npos ||
+			ToLower(platformTitle).find(platformName) != std::string::npos;
+		bool nameMatches = ToLower(name).find(deviceName) != std::string::npos;
+
+		if (platformMatches && nameMatches)
+		{
+			candidates.push_back(entry);
+		}
+	}
+
+	// The vendor is only a preference, fall back to any device (e.g. a CPU runtime such as POCL)
+	if (candidates.empty() && !platformName.empty())
 	{
-		for (auto p : platforms)
+		std::cout << "No device on a platform matching \"" << platformName << "\", considering all platforms" << std::endl;
+		for (auto entry : ranking)
 		{
-			if (p.getInfo<CL_PLATFORM_VENDOR>().find(vendorName) != std::string::npos)
+			if (ToLower(GetDeviceProfile(entry.device)->name).find(deviceName) != std::string::npos)
 			{
-				platform = p;
-				break;
+				candidates.push_back(entry);
 			}
 		}
 	}
-	std::cout << "Selected platform: " << platform.getInfo<CL_PLATFORM_NAME>() << std::endl;
 
-	// Get GPU devices
-	err = platform.getDevices(CL_DEVICE_TYPE_GPU, &devices);
-	CheckErrorCode(err, "Unable to get devices");
-	std::cout << "Found " << devices.size() << " device(s)" << std::endl;
+	if (candidates.empty())
+	{
+		CheckErrorCode(CL_DEVICE_NOT_FOUND, "Unable to find a matching OpenCL device");
+	}
 
-	// Use first GPU device
-	device = devices[0];
-	std::cout << "Selected device: " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+	cl::Device device = candidates[0].device;
+	auto profile = GetDeviceProfile(device);
+	std::cout << "Selected platform: " << profile->platformName << std::endl;
+	std::cout << "Selected device: " << profile->name << std::endl;
 
 	return device;
 }
@@ -65,6 +395,156 @@ cl::Context MakeContext(const cl::Device& device)
 	return context;
 }
 
+cl::Context MakeContext(const std::vector<cl::Device>& devices)
+{
+	cl_int err;
+
+	cl::Context context(devices, nullptr, nullptr, nullptr, &err);
+	CheckErrorCode(err, "Unable to create context for " + std::to_string(devices.size()) + " device(s)");
+
+	return context;
+}
+
+std::vector<cl::Device> MakeSubDevices(const cl::Device& device, cl_device_affinity_domain domain)
+{
+	std::vector<cl::Device> subDevices;
+	cl::Device parent = device;
+
+	if (device.getInfo<CL_DEVICE_PARTITION_MAX_SUB_DEVICES>() > 1)
+	{
+		auto partitions = device.getInfo<CL_DEVICE_PARTITION_PROPERTIES>();
+		if (std::find(partitions.begin(), partitions.end(), CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN) != partitions.end())
+		{
+			cl_device_partition_property properties[] = {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+			                                             static_cast<cl_device_partition_property>(domain), 0};
+
+			// A single-socket machine has one NUMA node and nothing to partition there
+			if (parent.createSubDevices(properties, &subDevices) != CL_SUCCESS || subDevices.size() < 2)
+			{
+				subDevices.clear();
+				properties[1] = CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE;
+				if (parent.createSubDevices(properties, &subDevices) != CL_SUCCESS)
+				{
+					subDevices.clear();
+				}
+			}
+		}
+	}
+
+	if (subDevices.empty())
+	{
+		std::cout << GetDeviceProfile(device)->name << " cannot be partitioned by affinity domain" << std::endl;
+		subDevices.push_back(device);
+	}
+
+	return subDevices;
+}
+
+std::vector<cl::Device> GetDevices(const cl::Device& device)
+{
+	cl_int err;
+	std::string mode = ToLower(GetEnvironment(MULTI_DEVICE_ENV));
+	std::vector<cl::Device> devices;
+
+	if (mode == "subdevices")
+	{
+		devices = MakeSubDevices(device);
+	}
+	else if (mode == "platform")
+	{
+		cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+		std::vector<cl::Device> platformDevices;
+
+		err = platform.getDevices(CL_DEVICE_TYPE_ALL, &platformDevices);
+		CheckErrorCode(err, "Unable to get platform devices");
+
+		for (auto& platformDevice : platformDevices)
+		{
+			if (platformDevice.getInfo<CL_DEVICE_AVAILABLE>())
+			{
+				devices.push_back(platformDevice);
+			}
+		}
+	}
+	else
+	{
+		devices.push_back(device);
+	}
+
+	if (devices.size() > 1)
+	{
+		std::cout << "Spreading work over " << devices.size() << " devices:" << std::endl;
+		for (auto& entry : devices)
+		{
+			auto profile = GetDeviceProfile(entry);
+			std::cout << "  " << profile->name << ", " << profile->computeUnits << " compute unit(s)" << std::endl;
+		}
+	}
+
+	return devices;
+}
+
+WorkSplitter::WorkSplitter(const std::vector<cl::Device>& devices)
+	: rates(devices.size(), 0.0)
+{
+	for (auto& device : devices)
+	{
+		scores.push_back(std::max(ScoreDevice(device), 1.0));
+	}
+}
+
+std::vector<std::pair<size_t, size_t> > WorkSplitter::Split(size_t total, size_t granularity) const
+{
+	std::vector<std::pair<size_t, size_t> > ranges;
+	double sum = 0.0;
+
+	for (size_t i = 0; i < scores.size(); ++i)
+	{
+		sum += GetThroughput(i);
+	}
+
+	// Boundaries come from the running sum so rounding never loses or repeats items
+	double accumulated = 0.0;
+	size_t begin = 0;
+	for (size_t i = 0; i < scores.size(); ++i)
+	{
+		accumulated += GetThroughput(i);
+		size_t end = total;
+		if (i + 1 < scores.size())
+		{
+			end = static_cast<size_t>(total * (accumulated / sum)) / granularity * granularity;
+			end = std::min(std::max(end, begin), total);
+		}
+
+		ranges.push_back(std::make_pair(begin, end));
+		begin = end;
+	}
+
+	return ranges;
+}
+
+void WorkSplitter::Record(size_t index, size_t items, double seconds)
+{
+	if (items == 0 || seconds <= 0.0)
+	{
+		return;
+	}
+
+	// Smoothed, so one noisy run doesn't swing the next split
+	double rate = items / seconds;
+	rates[index] = rates[index] == 0.0 ? rate : 0.5 * rates[index] + 0.5 * rate;
+}
+
+double WorkSplitter::GetThroughput(size_t index) const
+{
+	return IsMeasured() ? rates[index] : scores[index];
+}
+
+bool WorkSplitter::IsMeasured() const
+{
+	return std::find(rates.begin(), rates.end(), 0.0) == rates.end();
+}
+
 cl::CommandQueue MakeCommandQueue(const cl::Context& context, const cl::Device& device, cl_command_queue_properties properties)
 {
 	cl_int err;
@@ -75,86 +555,1978 @@ cl::CommandQueue MakeCommandQueue(const cl::Context& context, const cl::Device&
 	return queue;
 }
 
-cl::Program MakeAndBuildProgram(const std::vector<const char*>& sourceFileNames, const cl::Context& context, const cl::Device& device)
+static void CL_CALLBACK OnEventComplete(cl_event, cl_int status, void* userData)
+{
+	std::unique_ptr<std::promise<void> > promise(static_cast<std::promise<void>*>(userData));
+
+	if (status == CL_COMPLETE)
+	{
+		promise->set_value();
+	}
+	else
+	{
+		promise->set_exception(std::make_exception_ptr(std::runtime_error(
+			"Error " + std::to_string(status) + ": Command terminated abnormally")));
+	}
+}
+
+std::shared_future<void> MakeEventFuture(const cl::Event& event)
 {
 	cl_int err;
-	std::ifstream infile;
-	std::stringstream stream;
-	std::string buffer;
-	cl::Program program;
-	cl::Program::Sources sources;
+	std::unique_ptr<std::promise<void> > promise(new std::promise<void>);
+	std::shared_future<void> future = promise->get_future().share();
 
-	for (auto fileName : sourceFileNames)
+	err = clSetEventCallback(event(), CL_COMPLETE, OnEventComplete, promise.get());
+	CheckErrorCode(err, "Unable to set event callback");
+	promise.release();
+
+	// The callback never fires for a command the runtime hasn't submitted yet
+	cl::CommandQueue queue = event.getInfo<CL_EVENT_COMMAND_QUEUE>();
+	if (queue() != nullptr)
 	{
-		infile.open(fileName);
-		if (infile.is_open() && infile.good())
-		{
-			stream << infile.rdbuf();
-		}
-		infile.close();
+		err = queue.flush();
+		CheckErrorCode(err, "Unable to flush queue");
 	}
 
-	buffer = stream.str();
-	sources.push_back(std::make_pair(buffer.c_str(), buffer.length()));
+	return future;
+}
 
-	// Create program object
-	program = cl::Program(context, sources, &err);
-	CheckErrorCode(err, "Unable to create program object");
+std::shared_future<void> EnqueueReadBufferAsync(const cl::CommandQueue& queue, const cl::Buffer& buffer,
+                                                size_t offset, size_t size, void* ptr,
+                                                const std::vector<cl::Event>* events, cl::Event* event)
+{
+	cl::Event readEvent;
 
-	// Build program
-	err = program.build();
-	std::cout << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
-	CheckErrorCode(err, "Unable to build program");
-	std::cout << "Build successful" << std::endl;
+	cl_int err = queue.enqueueReadBuffer(buffer, CL_FALSE, offset, size, ptr, events, &readEvent);
+	CheckErrorCode(err, "Unable to read buffer");
 
-	return program;
+	if (event != nullptr)
+	{
+		*event = readEvent;
+	}
+
+	return MakeEventFuture(readEvent);
 }
 
-std::unordered_map<std::string, cl::Kernel> MakeKernels(cl::Program& program)
+std::shared_future<void> EnqueueReadImageAsync(const cl::CommandQueue& queue, const cl::Image2D& image,
+                                               size_t w, size_t h, void* ptr,
+                                               const std::vector<cl::Event>* events, cl::Event* event)
 {
-	cl_int err;
-	std::vector<cl::Kernel> tempKernels;
-	std::unordered_map<std::string, cl::Kernel> kernels;
+	cl::Event readEvent;
+	cl::size_t<3> origin;
+	cl::size_t<3> region;
+	region[0] = w;
+	region[1] = h;
+	region[2] = 1;
 
-	err = program.createKernels(&tempKernels);
-	CheckErrorCode(err, "Unable to create kernels");
-	std::cout << tempKernels.size() << " Kernels created" << std::endl;
+	cl_int err = queue.enqueueReadImage(image, CL_FALSE, origin, region, 0, 0, ptr, events, &readEvent);
+	CheckErrorCode(err, "Unable to read image");
 
-	for (auto k : tempKernels)
+	if (event != nullptr)
 	{
-		std::cout << k.getInfo<CL_KERNEL_FUNCTION_NAME>() << " kernel created" << std::endl;
-		kernels.insert(std::make_pair(k.getInfo<CL_KERNEL_FUNCTION_NAME>(), k));
+		*event = readEvent;
 	}
 
-	return kernels;
+	return MakeEventFuture(readEvent);
 }
 
-cl::Image2D MakeImage2D(const cl::Context& context, cl_mem_flags flags, cl::ImageFormat imageFormat, size_t w, size_t h, size_t rowPitch, void* hostPtr)
+CommandScheduler::CommandScheduler(const cl::Context& context, const cl::Device& device, cl_command_queue_properties properties)
 {
-	cl_int err;
+	cl_command_queue_properties supported = GetDeviceProfile(device)->queueProperties;
+	outOfOrder = (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
 
-	cl::Image2D image2D(context, flags, imageFormat, w, h, rowPitch, hostPtr, &err);
-	CheckErrorCode(err, "Unable to create image2D object");
+	if (outOfOrder)
+	{
+		properties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+	}
+	else
+	{
+		std::cout << "Out-of-order execution not supported, using an in-order queue" << std::endl;
+	}
 
-	return image2D;
+	queue = MakeCommandQueue(context, device, properties);
 }
 
-cl::Buffer MakeBuffer(const cl::Context& context, cl_mem_flags flags, size_t size, void* hostPtr)
+const cl::CommandQueue& CommandScheduler::GetQueue() const
 {
-	cl_int err;
+	return queue;
+}
 
-	cl::Buffer buffer(context, flags, size, hostPtr, &err);
-	CheckErrorCode(err, "Unable to create buffer object");
+bool CommandScheduler::IsOutOfOrder() const
+{
+	return outOfOrder;
+}
 
-	return buffer;
+void CommandScheduler::Finish()
+{
+	cl_int err = queue.finish();
+	CheckErrorCode(err, "Unable to finish queue");
+
+	states.clear();
 }
 
-cl::Sampler MakeSampler(const cl::Context& context, cl_bool normalizedCoords, cl_addressing_mode addressingMode, cl_filter_mode filterMode)
+std::vector<cl::Event> CommandScheduler::GetWaitList(const std::vector<cl::Memory>& reads,
+                                                     const std::vector<cl::Memory>& writes)
 {
-	cl_int err;
+	std::vector<cl::Event> waitList;
 
-	cl::Sampler sampler(context, normalizedCoords, addressingMode, filterMode, &err);
-	CheckErrorCode(err, "Unable to create sampler");
+	if (!outOfOrder)
+	{
+		return waitList;
+	}
 
-	return sampler;
+	for (auto& memory : reads)
+	{
+		auto state = states.find(memory());
+		if (state != states.end() && state->second.lastWrite() != nullptr)
+		{
+			waitList.push_back(state->second.lastWrite);
+		}
+	}
+
+	for (auto& memory : writes)
+	{
+		auto state = states.find(memory());
+		if (state != states.end())
+		{
+			if (state->second.lastWrite() != nullptr)
+			{
+				waitList.push_back(state->second.lastWrite);
+			}
+			waitList.insert(waitList.end(), state->second.reads.begin(), state->second.reads.end());
+		}
+	}
+
+	return waitList;
+}
+
+void CommandScheduler::Commit(const std::vector<cl::Memory>& reads, const std::vector<cl::Memory>& writes,
+                              const cl::Event& event)
+{
+	if (!outOfOrder)
+	{
+		return;
+	}
+
+	for (auto& memory : reads)
+	{
+		states[memory()].reads.push_back(event);
+	}
+
+	for (auto& memory : writes)
+	{
+		MemoryState& state = states[memory()];
+		state.lastWrite = event;
+		state.reads.clear();
+	}
+}
+
+// 64-bit FNV-1a, stable across runs and compilers unlike std::hash
+static std::string HashString(const std::string& text)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+
+	for (auto c : text)
+	{
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 1099511628211ULL;
+	}
+
+	char hex[17];
+	sprintf(hex, "%016llx", hash);
+	return hex;
+}
+
+// Returns an empty string when the cache is disabled (OCL_PROGRAM_CACHE_DIR set to "")
+static std::string GetProgramCacheDir()
+{
+	const char* dir = getenv(PROGRAM_CACHE_DIR_ENV);
+	if (dir == nullptr)
+	{
+		return PROGRAM_CACHE_DEFAULT_DIR;
+	}
+
+	return dir;
+}
+
+static void MakeDirectory(const std::string& path)
+{
+#ifdef WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
+
+static std::string MakeProgramCacheKey(const std::string& source, const cl::Device& device, const std::string& buildOptions)
+{
+	auto profile = GetDeviceProfile(device);
+	std::stringstream key;
+
+	key << "source=" << HashString(source) << ";"
+		<< "platform=" << profile->platformVersion << ";"
+		<< "device=" << profile->name << ";"
+		<< "driver=" << profile->driverVersion << ";"
+		<< "options=" << buildOptions;
+
+	return key.str();
+}
+
+// The file stores the full key ahead of the binary so a hash collision or a
+// changed driver is detected as a mismatch rather than loading a stale binary
+static bool LoadProgramBinary(const std::string& path, const std::string& key, std::vector<unsigned char>& binary)
+{
+	std::ifstream infile(path.c_str(), std::ios::binary);
+	std::string magic, storedKey;
+	size_t size = 0;
+
+	if (!(infile.is_open() && infile.good()))
+	{
+		return false;
+	}
+
+	std::getline(infile, magic);
+	std::getline(infile, storedKey);
+	infile >> size;
+	infile.ignore(1);
+
+	if (magic != PROGRAM_CACHE_MAGIC || storedKey != key || size == 0)
+	{
+		return false;
+	}
+
+	binary.resize(size);
+	infile.read(reinterpret_cast<char*>(&binary[0]), size);
+
+	return infile.gcount() == static_cast<std::streamsize>(size);
+}
+
+static void SaveProgramBinary(const std::string& path, const std::string& key, const std::vector<unsigned char>& binary)
+{
+	// Write to a temporary file first so concurrent runs never read a half-written binary.
+	// The process and thread ids keep concurrent writers out of each other's file.
+	std::stringstream tempPath;
+#ifdef WIN32
+	tempPath << path << "." << _getpid() << "." << std::this_thread::get_id() << ".tmp";
+#else
+	tempPath << path << "." << getpid() << "." << std::this_thread::get_id() << ".tmp";
+#endif
+
+	std::ofstream outfile(tempPath.str().c_str(), std::ios::binary);
+	if (!(outfile.is_open() && outfile.good()))
+	{
+		return;
+	}
+
+	outfile << PROGRAM_CACHE_MAGIC << "\n" << key << "\n" << binary.size() << "\n";
+	outfile.write(reinterpret_cast<const char*>(&binary[0]), binary.size());
+	outfile.close();
+
+	// Replaced in one step, readers see either the old binary or the new one
+#ifdef WIN32
+	bool moved = MoveFileExA(tempPath.str().c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	bool moved = std::rename(tempPath.str().c_str(), path.c_str()) == 0;
+#endif
+	if (!moved)
+	{
+		std::remove(tempPath.str().c_str());
+	}
+}
+
+static bool GetProgramBinary(const cl::Program& program, const cl::Device& device, std::vector<unsigned char>& binary)
+{
+	cl_int err;
+	std::vector<cl::Device> devices = program.getInfo<CL_PROGRAM_DEVICES>();
+	std::vector<size_t> sizes(devices.size());
+	std::vector<unsigned char*> binaries(devices.size(), nullptr);
+	std::vector<std::vector<unsigned char> > storage(devices.size());
+
+	err = clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * sizes.size(), &sizes[0], nullptr);
+	if (err != CL_SUCCESS)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < devices.size(); ++i)
+	{
+		if (sizes[i] > 0)
+		{
+			storage[i].resize(sizes[i]);
+			binaries[i] = &storage[i][0];
+		}
+	}
+
+	err = clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(unsigned char*) * binaries.size(), &binaries[0], nullptr);
+	if (err != CL_SUCCESS)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < devices.size(); ++i)
+	{
+		if (devices[i]() == device() && !storage[i].empty())
+		{
+			binary.swap(storage[i]);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Function-local, so generated headers can register sources during static initialisation
+static std::unordered_map<std::string, const char*>& GetEmbeddedSources()
+{
+	static std::unordered_map<std::string, const char*> sources;
+	return sources;
+}
+
+bool RegisterEmbeddedSource(const std::string& fileName, const char* source)
+{
+	GetEmbeddedSources()[fileName] = source;
+	return true;
+}
+
+std::string LoadKernelSource(const std::string& fileName)
+{
+	auto embedded = GetEmbeddedSources().find(fileName);
+	if (embedded != GetEmbeddedSources().end())
+	{
+		return embedded->second;
+	}
+
+	std::ifstream infile(fileName.c_str());
+	if (!(infile.is_open() && infile.good()))
+	{
+		throw std::runtime_error("Unable to find kernel source " + fileName);
+	}
+
+	std::stringstream stream;
+	stream << infile.rdbuf();
+	return stream.str();
+}
+
+cl::Program MakeAndBuildProgram(const std::vector<const char*>& sourceFileNames, const cl::Context& context, const cl::Device& device, const std::string& buildOptions)
+{
+	std::string buffer;
+
+	for (auto fileName : sourceFileNames)
+	{
+		buffer += LoadKernelSource(fileName);
+	}
+
+	return MakeAndBuildProgramFromSource(buffer, context, device, buildOptions);
+}
+
+cl::Program MakeAndBuildProgramFromSource(const std::string& buffer, const cl::Context& context, const cl::Device& device, const std::string& buildOptions)
+{
+	cl_int err;
+	cl::Program program;
+	cl::Program::Sources sources;
+	std::vector<cl::Device> devices(1, device);
+
+	// Try the program binary cache first
+	std::string cacheDir = GetProgramCacheDir();
+	std::string cacheKey;
+	std::string cachePath;
+
+	if (!cacheDir.empty())
+	{
+		std::vector<unsigned char> binary;
+		cacheKey = MakeProgramCacheKey(buffer, device, buildOptions);
+		cachePath = cacheDir + "/" + HashString(cacheKey) + ".bin";
+
+		if (LoadProgramBinary(cachePath, cacheKey, binary))
+		{
+			std::vector<cl_int> binaryStatus(devices.size(), CL_SUCCESS);
+			cl::Program::Binaries binaries;
+			binaries.push_back(std::make_pair(static_cast<const void*>(&binary[0]), binary.size()));
+
+			program = cl::Program(context, devices, binaries, &binaryStatus, &err);
+			if (err == CL_SUCCESS && binaryStatus[0] == CL_SUCCESS &&
+				program.build(devices, buildOptions.c_str()) == CL_SUCCESS)
+			{
+				std::cout << "Loaded program binary from " << cachePath << std::endl;
+				return program;
+			}
+
+			std::cout << "Cached program binary rejected, rebuilding from source" << std::endl;
+		}
+	}
+
+	sources.push_back(std::make_pair(buffer.c_str(), buffer.length()));
+
+	// Create program object
+	program = cl::Program(context, sources, &err);
+	CheckErrorCode(err, "Unable to create program object");
+
+	// Build program
+	err = program.build(devices, buildOptions.c_str());
+	std::cout << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+	CheckErrorCode(err, "Unable to build program");
+	std::cout << "Build successful" << std::endl;
+
+	// Store the binary for the next run, a failure here only costs a rebuild next time
+	if (!cacheDir.empty())
+	{
+		std::vector<unsigned char> binary;
+		if (GetProgramBinary(program, device, binary))
+		{
+			MakeDirectory(cacheDir);
+			SaveProgramBinary(cachePath, cacheKey, binary);
+		}
+	}
+
+	return program;
+}
+
+std::unordered_map<std::string, cl::Kernel> MakeKernels(cl::Program& program)
+{
+	cl_int err;
+	std::vector<cl::Kernel> tempKernels;
+	std::unordered_map<std::string, cl::Kernel> kernels;
+
+	err = program.createKernels(&tempKernels);
+	CheckErrorCode(err, "Unable to create kernels");
+	std::cout << tempKernels.size() << " Kernels created" << std::endl;
+
+	for (auto k : tempKernels)
+	{
+		std::cout << k.getInfo<CL_KERNEL_FUNCTION_NAME>() << " kernel created" << std::endl;
+		kernels.insert(std::make_pair(k.getInfo<CL_KERNEL_FUNCTION_NAME>(), k));
+	}
+
+	return kernels;
+}
+
+std::string MakeBuildOptions(const std::map<std::string, std::string>& defines, const std::string& flags)
+{
+	std::stringstream options;
+
+	for (auto define : defines)
+	{
+		options << "-D " << define.first;
+		if (!define.second.empty())
+		{
+			options << "=" << define.second;
+		}
+		options << " ";
+	}
+
+	options << flags;
+
+	return options.str();
+}
+
+std::string MakeFloatList(const float* values, size_t count)
+{
+	std::string list;
+	char value[32];
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		sprintf(value, "%.9gf", values[i]);
+		list += (i == 0 ? "" : ",") + std::string(value);
+	}
+
+	return list;
+}
+
+ProgramVariants::ProgramVariants(const std::vector<const char*>& sourceFileNames, const cl::Context& context, const cl::Device& device, const std::string& flags)
+	: sourceFileNames(sourceFileNames), context(context), device(device), flags(flags)
+{
+}
+
+cl::Kernel ProgramVariants::GetKernel(const std::string& kernelName, const std::map<std::string, std::string>& defines)
+{
+	std::string options = MakeBuildOptions(defines, flags);
+
+	auto variant = variants.find(options);
+	if (variant == variants.end())
+	{
+		std::cout << "Building program variant: " << options << std::endl;
+		cl::Program program = MakeAndBuildProgram(sourceFileNames, context, device, options);
+		variant = variants.insert(std::make_pair(options, MakeKernels(program))).first;
+	}
+
+	auto kernel = variant->second.find(kernelName);
+	if (kernel == variant->second.end())
+	{
+		throw std::runtime_error("Kernel " + kernelName + " not found in program variant");
+	}
+
+	return kernel->second;
+}
+
+ProgramLibrary::ProgramLibrary(const cl::Context& context, const cl::Device& device)
+	: context(context), device(device)
+{
+}
+
+ProgramLibrary::~ProgramLibrary()
+{
+	// Background builds hold the context, let them finish first
+	for (auto& entry : entries)
+	{
+		if (entry.program.valid())
+		{
+			entry.program.wait();
+		}
+	}
+}
+
+void ProgramLibrary::Add(const std::vector<const char*>& sourceFileNames, const std::string& buildOptions)
+{
+	std::regex kernelPattern("(?:__)?kernel\\s+void\\s+(\\w+)");
+	Entry entry;
+	entry.sourceFileNames = sourceFileNames;
+	entry.buildOptions = buildOptions;
+
+	for (auto fileName : sourceFileNames)
+	{
+		std::string source = LoadKernelSource(fileName);
+		for (std::sregex_iterator match(source.begin(), source.end(), kernelPattern), end; match != end; ++match)
+		{
+			owners[(*match)[1].str()] = entries.size();
+		}
+	}
+
+	entries.push_back(entry);
+}
+
+void ProgramLibrary::Prefetch(const std::string& kernelName)
+{
+	Start(FindEntry(kernelName));
+}
+
+void ProgramLibrary::PrefetchAll()
+{
+	for (auto& entry : entries)
+	{
+		Start(entry);
+	}
+}
+
+cl::Kernel ProgramLibrary::GetKernel(const std::string& kernelName)
+{
+	cl_int err;
+	Entry& entry = FindEntry(kernelName);
+
+	Start(entry);
+	cl::Kernel kernel(entry.program.get(), kernelName.c_str(), &err);
+	CheckErrorCode(err, "Unable to create kernel " + kernelName);
+
+	return kernel;
+}
+
+ProgramLibrary::Entry& ProgramLibrary::FindEntry(const std::string& kernelName)
+{
+	auto owner = owners.find(kernelName);
+	if (owner == owners.end())
+	{
+		throw std::runtime_error("Kernel " + kernelName + " not found in any program");
+	}
+
+	return entries[owner->second];
+}
+
+void ProgramLibrary::Start(Entry& entry)
+{
+	if (entry.program.valid())
+	{
+		return;
+	}
+
+	std::vector<const char*> sourceFileNames = entry.sourceFileNames;
+	std::string buildOptions = entry.buildOptions;
+	cl::Context context = this->context;
+	cl::Device device = this->device;
+
+	entry.program = std::async(std::launch::async, [=]()
+	{
+		return MakeAndBuildProgram(sourceFileNames, context, device, buildOptions);
+	}).share();
+}
+
+struct TrackedMemory
+{
+	cl_context context;
+	size_t size;
+	std::string tag;
+};
+
+struct ContextMemory
+{
+	MemoryUsage total;
+	std::map<std::string, MemoryUsage> tags;
+};
+
+// Destructor callbacks arrive on runtime threads, so everything is behind one mutex
+struct MemoryTracker
+{
+	std::mutex mutex;
+	std::unordered_map<cl_context, ContextMemory> contexts;
+	std::unordered_map<cl_mem, TrackedMemory> live;
+};
+
+static MemoryTracker& GetMemoryTracker()
+{
+	static MemoryTracker tracker;
+	return tracker;
+}
+
+static thread_local std::vector<std::string> memoryTags;
+
+MemoryTag::MemoryTag(const std::string& name)
+{
+	memoryTags.push_back(name);
+}
+
+MemoryTag::~MemoryTag()
+{
+	memoryTags.pop_back();
+}
+
+static void AddUsage(MemoryUsage& usage, size_t size)
+{
+	usage.liveBytes += size;
+	usage.peakBytes = std::max(usage.peakBytes, usage.liveBytes);
+	++usage.allocations;
+}
+
+static void CL_CALLBACK OnMemoryReleased(cl_mem memory, void*)
+{
+	MemoryTracker& tracker = GetMemoryTracker();
+	std::lock_guard<std::mutex> lock(tracker.mutex);
+
+	auto entry = tracker.live.find(memory);
+	if (entry == tracker.live.end())
+	{
+		return;
+	}
+
+	ContextMemory& usage = tracker.contexts[entry->second.context];
+	usage.total.liveBytes -= entry->second.size;
+	usage.tags[entry->second.tag].liveBytes -= entry->second.size;
+	tracker.live.erase(entry);
+}
+
+static void TrackMemory(const cl::Context& context, const cl::Memory& memory, cl_mem_flags flags)
+{
+	if (flags & CL_MEM_USE_HOST_PTR)
+	{
+		return;
+	}
+
+	TrackedMemory tracked;
+	tracked.context = context();
+	tracked.size = memory.getInfo<CL_MEM_SIZE>();
+	tracked.tag = memoryTags.empty() ? MEMORY_UNTAGGED : memoryTags.back();
+
+	MemoryTracker& tracker = GetMemoryTracker();
+	{
+		std::lock_guard<std::mutex> lock(tracker.mutex);
+		ContextMemory& usage = tracker.contexts[tracked.context];
+		AddUsage(usage.total, tracked.size);
+		AddUsage(usage.tags[tracked.tag], tracked.size);
+		tracker.live[memory()] = tracked;
+	}
+
+	cl_int err = clSetMemObjectDestructorCallback(memory(), OnMemoryReleased, nullptr);
+	CheckErrorCode(err, "Unable to set memory destructor callback");
+}
+
+// Allocation failures name the request and what the context already holds
+static void CheckAllocation(cl_int err, const cl::Context& context, const std::string& what)
+{
+	if (err != CL_SUCCESS)
+	{
+		CheckErrorCode(err, "Unable to create " + what + ", " +
+		               std::to_string(GetMemoryUsage(context).liveBytes) + " bytes already allocated");
+	}
+}
+
+MemoryUsage GetMemoryUsage(const cl::Context& context)
+{
+	MemoryTracker& tracker = GetMemoryTracker();
+	std::lock_guard<std::mutex> lock(tracker.mutex);
+
+	return tracker.contexts[context()].total;
+}
+
+std::map<std::string, MemoryUsage> GetMemoryUsageByTag(const cl::Context& context)
+{
+	MemoryTracker& tracker = GetMemoryTracker();
+	std::lock_guard<std::mutex> lock(tracker.mutex);
+
+	return tracker.contexts[context()].tags;
+}
+
+void PrintMemoryReport(const cl::Context& context, std::ostream& out)
+{
+	MemoryUsage total = GetMemoryUsage(context);
+
+	out << "Device memory: " << total.liveBytes / 1024 << " KB live, " << total.peakBytes / 1024 << " KB peak, "
+		<< total.allocations << " allocation(s)" << std::endl;
+	for (auto& entry : GetMemoryUsageByTag(context))
+	{
+		out << "  " << entry.first << ": " << entry.second.liveBytes / 1024 << " KB live, "
+			<< entry.second.peakBytes / 1024 << " KB peak, " << entry.second.allocations << " allocation(s)" << std::endl;
+	}
+}
+
+size_t GetMemoryBudget(const cl::Context& context, const cl::Device& device)
+{
+	std::string budgetMB = GetEnvironment(MEMORY_BUDGET_ENV);
+	size_t budget = budgetMB.empty() ?
+		static_cast<size_t>(GetDeviceProfile(device)->globalMemSize * MEMORY_BUDGET_FRACTION) :
+		static_cast<size_t>(std::stoull(budgetMB)) * 1024 * 1024;
+	size_t live = GetMemoryUsage(context).liveBytes;
+
+	return budget > live ? budget - live : 0;
+}
+
+bool FitsInMemoryBudget(const cl::Context& context, const cl::Device& device, const std::vector<size_t>& sizes)
+{
+	size_t budget = GetMemoryBudget(context, device);
+	cl_ulong maxAllocation = GetDeviceProfile(device)->maxMemAllocSize;
+	size_t total = 0;
+
+	for (auto size : sizes)
+	{
+		if (size > maxAllocation)
+		{
+			return false;
+		}
+		total += size;
+	}
+
+	return total <= budget;
+}
+
+cl::Image2D MakeImage2D(const cl::Context& context, cl_mem_flags flags, cl::ImageFormat imageFormat, size_t w, size_t h, size_t rowPitch, void* hostPtr)
+{
+	cl_int err;
+
+	cl::Image2D image2D(context, flags, imageFormat, w, h, rowPitch, hostPtr, &err);
+	CheckAllocation(err, context, "image2D object of " + std::to_string(w) + "x" + std::to_string(h) + " pixels");
+	TrackMemory(context, image2D, flags);
+
+	return image2D;
+}
+
+cl::Buffer MakeBuffer(const cl::Context& context, cl_mem_flags flags, size_t size, void* hostPtr)
+{
+	cl_int err;
+
+	cl::Buffer buffer(context, flags, size, hostPtr, &err);
+	CheckAllocation(err, context, "buffer object of " + std::to_string(size) + " bytes");
+	TrackMemory(context, buffer, flags);
+
+	return buffer;
+}
+
+cl::Event* EventProfiler::Record(const std::string& name)
+{
+	pending.push_back(std::make_pair(name, cl::Event()));
+	return &pending.back().second;
+}
+
+void EventProfiler::Track(const std::string& name, const cl::Event& event)
+{
+	pending.push_back(std::make_pair(name, event));
+}
+
+const std::vector<ProfiledCommand>& EventProfiler::Collect()
+{
+	cl_int err;
+
+	for (auto& entry : pending)
+	{
+		err = entry.second.wait();
+		CheckErrorCode(err, "Unable to wait for profiled event " + entry.first);
+
+		ProfiledCommand command;
+		command.name = entry.first;
+		command.type = entry.second.getInfo<CL_EVENT_COMMAND_TYPE>();
+		command.queue = entry.second.getInfo<CL_EVENT_COMMAND_QUEUE>()();
+		command.queued = entry.second.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+		command.submit = entry.second.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+		command.start = entry.second.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		command.end = entry.second.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		commands.push_back(command);
+	}
+
+	pending.clear();
+	return commands;
+}
+
+void EventProfiler::Clear()
+{
+	pending.clear();
+	commands.clear();
+}
+
+static const char* GetCommandCategory(cl_command_type type)
+{
+	switch (type)
+	{
+	case CL_COMMAND_NDRANGE_KERNEL:
+	case CL_COMMAND_TASK:
+		return "kernel";
+	case CL_COMMAND_READ_BUFFER:
+	case CL_COMMAND_READ_IMAGE:
+		return "read";
+	case CL_COMMAND_WRITE_BUFFER:
+	case CL_COMMAND_WRITE_IMAGE:
+		return "write";
+	case CL_COMMAND_COPY_BUFFER:
+	case CL_COMMAND_COPY_IMAGE:
+	case CL_COMMAND_COPY_IMAGE_TO_BUFFER:
+	case CL_COMMAND_COPY_BUFFER_TO_IMAGE:
+		return "copy";
+	case CL_COMMAND_MAP_BUFFER:
+	case CL_COMMAND_MAP_IMAGE:
+	case CL_COMMAND_UNMAP_MEM_OBJECT:
+		return "map";
+	default:
+		return "other";
+	}
+}
+
+static std::string EscapeJson(const std::string& text)
+{
+	std::string escaped;
+
+	for (auto c : text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			escaped += '\\';
+		}
+		escaped += c;
+	}
+
+	return escaped;
+}
+
+void EventProfiler::PrintSummary(std::ostream& out)
+{
+	struct Stats
+	{
+		size_t count;
+		double total;
+		double min;
+		double max;
+		double waiting;
+	};
+
+	std::map<std::string, Stats> stats;
+	std::map<std::string, double> categories;
+
+	Collect();
+
+	for (auto& command : commands)
+	{
+		double duration = (command.end - command.start) / 1000000.0;
+		double waiting = (command.start - command.queued) / 1000000.0;
+
+		auto entry = stats.find(command.name);
+		if (entry == stats.end())
+		{
+			Stats first = { 0, 0.0, duration, duration, 0.0 };
+			entry = stats.insert(std::make_pair(command.name, first)).first;
+		}
+
+		Stats& s = entry->second;
+		++s.count;
+		s.total += duration;
+		s.min = std::min(s.min, duration);
+		s.max = std::max(s.max, duration);
+		s.waiting += waiting;
+
+		categories[GetCommandCategory(command.type)] += duration;
+	}
+
+	out << "Profile summary (ms): name, count, total, mean, min, max, mean queued-to-start" << std::endl;
+	for (auto& entry : stats)
+	{
+		const Stats& s = entry.second;
+		out << "  " << entry.first << ", " << s.count << ", " << s.total << ", " << s.total / s.count << ", "
+			<< s.min << ", " << s.max << ", " << s.waiting / s.count << std::endl;
+	}
+
+	out << "Time by category (ms):";
+	for (auto& category : categories)
+	{
+		out << " " << category.first << " " << category.second;
+	}
+	out << std::endl;
+}
+
+void EventProfiler::WriteChromeTrace(const std::string& fileName)
+{
+	std::ofstream outfile(fileName.c_str());
+	std::unordered_map<cl_command_queue, size_t> queueIds;
+	cl_ulong origin = 0;
+	bool first = true;
+
+	Collect();
+
+	for (auto& command : commands)
+	{
+		if (origin == 0 || command.queued < origin)
+		{
+			origin = command.queued;
+		}
+		if (queueIds.find(command.queue) == queueIds.end())
+		{
+			size_t id = queueIds.size();
+			queueIds[command.queue] = id;
+		}
+	}
+
+	// Each queue gets an execution track and a track for the time commands spend waiting
+	outfile << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+	for (auto& queue : queueIds)
+	{
+		outfile << (first ? "" : ",\n")
+			<< "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,\"tid\":" << queue.second * 2
+			<< ",\"args\":{\"name\":\"Queue " << queue.second << "\"}},\n"
+			<< "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,\"tid\":" << queue.second * 2 + 1
+			<< ",\"args\":{\"name\":\"Queue " << queue.second << " waiting\"}}";
+		first = false;
+	}
+
+	for (auto& command : commands)
+	{
+		size_t tid = queueIds[command.queue] * 2;
+		std::string name = EscapeJson(command.name);
+
+		outfile << (first ? "" : ",\n")
+			<< "{\"ph\":\"X\",\"name\":\"" << name << "\",\"cat\":\"" << GetCommandCategory(command.type)
+			<< "\",\"pid\":0,\"tid\":" << tid
+			<< ",\"ts\":" << (command.start - origin) / 1000.0
+			<< ",\"dur\":" << (command.end - command.start) / 1000.0
+			<< ",\"args\":{\"queued_us\":" << (command.queued - origin) / 1000.0
+			<< ",\"submit_us\":" << (command.submit - origin) / 1000.0 << "}},\n"
+			<< "{\"ph\":\"X\",\"name\":\"" << name << " (waiting)\",\"cat\":\"waiting\",\"pid\":0,\"tid\":" << tid + 1
+			<< ",\"ts\":" << (command.queued - origin) / 1000.0
+			<< ",\"dur\":" << (command.start - command.queued) / 1000.0 << "}";
+		first = false;
+	}
+
+	outfile << std::endl << "]}" << std::endl;
+	outfile.close();
+
+	std::cout << "Wrote trace of " << commands.size() << " command(s) to " << fileName << std::endl;
+}
+
+KernelResources GetKernelResources(const cl::Kernel& kernel, const cl::Device& device, cl_ulong localMemArgsSize)
+{
+	KernelResources resources;
+	cl::Program program = kernel.getInfo<CL_KERNEL_PROGRAM>();
+
+	resources.name = kernel.getInfo<CL_KERNEL_FUNCTION_NAME>();
+	resources.buildOptions = program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device);
+	resources.workGroupSize = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+	resources.preferredWorkGroupSizeMultiple = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+	resources.localMemSize = kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device) + localMemArgsSize;
+	resources.privateMemSize = kernel.getWorkGroupInfo<CL_KERNEL_PRIVATE_MEM_SIZE>(device);
+	resources.groupsPerComputeUnit = resources.localMemSize == 0 ? 0 :
+		GetDeviceProfile(device)->localMemSize / resources.localMemSize;
+
+	return resources;
+}
+
+void KernelReport::Add(const cl::Kernel& kernel, const cl::Device& device, cl_ulong localMemArgsSize)
+{
+	kernels.push_back(GetKernelResources(kernel, device, localMemArgsSize));
+}
+
+void KernelReport::Add(const std::unordered_map<std::string, cl::Kernel>& kernels, const cl::Device& device)
+{
+	for (auto& entry : kernels)
+	{
+		Add(entry.second, device);
+	}
+}
+
+const std::vector<KernelResources>& KernelReport::GetKernels() const
+{
+	return kernels;
+}
+
+void KernelReport::Print(std::ostream& out) const
+{
+	out << "Kernel resources (max work-group, preferred multiple, local bytes, private bytes, work-groups per CU by local memory)" << std::endl;
+	for (auto& kernel : kernels)
+	{
+		out << "  " << kernel.name;
+		if (!kernel.buildOptions.empty())
+		{
+			out << " [" << HashString(kernel.buildOptions) << "]";
+		}
+		out << ": " << kernel.workGroupSize << ", " << kernel.preferredWorkGroupSizeMultiple << ", "
+			<< kernel.localMemSize << ", " << kernel.privateMemSize << ", ";
+		if (kernel.groupsPerComputeUnit == 0)
+		{
+			out << "-";
+		}
+		else
+		{
+			out << kernel.groupsPerComputeUnit;
+		}
+		out << std::endl;
+	}
+}
+
+void KernelReport::WriteJson(const std::string& fileName) const
+{
+	std::ofstream outfile(fileName.c_str());
+
+	outfile << "{\"kernels\":[" << std::endl;
+	for (size_t i = 0; i < kernels.size(); ++i)
+	{
+		const KernelResources& kernel = kernels[i];
+		outfile << "{\"name\":\"" << EscapeJson(kernel.name) << "\""
+			<< ",\"buildOptions\":\"" << EscapeJson(kernel.buildOptions) << "\""
+			<< ",\"workGroupSize\":" << kernel.workGroupSize
+			<< ",\"preferredWorkGroupSizeMultiple\":" << kernel.preferredWorkGroupSizeMultiple
+			<< ",\"localMemSize\":" << kernel.localMemSize
+			<< ",\"privateMemSize\":" << kernel.privateMemSize
+			<< ",\"groupsPerComputeUnit\":" << kernel.groupsPerComputeUnit << "}"
+			<< (i + 1 < kernels.size() ? "," : "") << std::endl;
+	}
+	outfile << "]}" << std::endl;
+	outfile.close();
+
+	std::cout << "Wrote resources of " << kernels.size() << " kernel(s) to " << fileName << std::endl;
+}
+
+// Rounds up to a quarter step between powers of two, wasting at most 25%
+static size_t GetSizeClass(size_t size)
+{
+	size_t power = 256;
+	while (power * 2 <= size)
+	{
+		power *= 2;
+	}
+
+	size_t step = power / 4;
+	return (size + step - 1) / step * step;
+}
+
+static size_t GetImageElementSize(const cl::ImageFormat& imageFormat)
+{
+	size_t channels = 4;
+	switch (imageFormat.image_channel_order)
+	{
+	case CL_R:
+		channels = 1;
+		break;
+	case CL_RG:
+		channels = 2;
+		break;
+	default:
+		break;
+	}
+
+	switch (imageFormat.image_channel_data_type)
+	{
+	case CL_FLOAT:
+		return channels * 4;
+	case CL_HALF_FLOAT:
+		return channels * 2;
+	default:
+		return channels;
+	}
+}
+
+MemoryPool::MemoryPool(const cl::Context& context, const cl::CommandQueue& queue)
+	: context(context), queue(queue), profiler(nullptr), hits(0), misses(0), bytesAllocated(0)
+{
+}
+
+cl::Buffer MemoryPool::AcquireBuffer(cl_mem_flags flags, size_t size, void* hostPtr)
+{
+	cl_int err;
+	cl::Buffer buffer;
+
+	// Memory wrapping a host pointer cannot be shared
+	if (flags & CL_MEM_USE_HOST_PTR)
+	{
+		return MakeBuffer(context, flags, size, hostPtr);
+	}
+
+	bool copyHostPtr = (flags & CL_MEM_COPY_HOST_PTR) != 0;
+	flags &= ~static_cast<cl_mem_flags>(CL_MEM_COPY_HOST_PTR);
+
+	size_t sizeClass = GetSizeClass(size);
+	std::string key = std::to_string(flags) + ":" + std::to_string(sizeClass);
+
+	auto& freeList = freeBuffers[key];
+	if (freeList.empty())
+	{
+		buffer = MakeBuffer(context, flags, sizeClass);
+		bytesAllocated += sizeClass;
+		++misses;
+	}
+	else
+	{
+		buffer = freeList.back();
+		freeList.pop_back();
+		++hits;
+	}
+
+	liveKeys[buffer()] = key;
+
+	if (copyHostPtr)
+	{
+		cl::Event* event = profiler == nullptr ? nullptr : profiler->Record("MemoryPool write buffer");
+		err = queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, size, hostPtr, nullptr, event);
+		CheckErrorCode(err, "Unable to write pooled buffer");
+	}
+
+	return buffer;
+}
+
+cl::Image2D MemoryPool::AcquireImage2D(cl_mem_flags flags, cl::ImageFormat imageFormat, size_t w, size_t h, void* hostPtr)
+{
+	cl_int err;
+	cl::Image2D image;
+
+	if (flags & CL_MEM_USE_HOST_PTR)
+	{
+		return MakeImage2D(context, flags, imageFormat, w, h, 0, hostPtr);
+	}
+
+	bool copyHostPtr = (flags & CL_MEM_COPY_HOST_PTR) != 0;
+	flags &= ~static_cast<cl_mem_flags>(CL_MEM_COPY_HOST_PTR);
+
+	std::string key = std::to_string(flags) + ":" +
+		std::to_string(imageFormat.image_channel_order) + ":" +
+		std::to_string(imageFormat.image_channel_data_type) + ":" +
+		std::to_string(w) + "x" + std::to_string(h);
+
+	auto& freeList = freeImages[key];
+	if (freeList.empty())
+	{
+		image = MakeImage2D(context, flags, imageFormat, w, h);
+		bytesAllocated += w * h * GetImageElementSize(imageFormat);
+		++misses;
+	}
+	else
+	{
+		image = freeList.back();
+		freeList.pop_back();
+		++hits;
+	}
+
+	liveKeys[image()] = key;
+
+	if (copyHostPtr)
+	{
+		cl::size_t<3> origin;
+		cl::size_t<3> region;
+		region[0] = w;
+		region[1] = h;
+		region[2] = 1;
+
+		cl::Event* event = profiler == nullptr ? nullptr : profiler->Record("MemoryPool write image");
+		err = queue.enqueueWriteImage(image, CL_TRUE, origin, region, 0, 0, hostPtr, nullptr, event);
+		CheckErrorCode(err, "Unable to write pooled image");
+	}
+
+	return image;
+}
+
+void MemoryPool::Release(const cl::Buffer& buffer)
+{
+	auto entry = liveKeys.find(buffer());
+	if (entry != liveKeys.end())
+	{
+		freeBuffers[entry->second].push_back(buffer);
+		liveKeys.erase(entry);
+	}
+}
+
+void MemoryPool::Release(const cl::Image2D& image)
+{
+	auto entry = liveKeys.find(image());
+	if (entry != liveKeys.end())
+	{
+		freeImages[entry->second].push_back(image);
+		liveKeys.erase(entry);
+	}
+}
+
+size_t MemoryPool::GetHits() const
+{
+	return hits;
+}
+
+size_t MemoryPool::GetMisses() const
+{
+	return misses;
+}
+
+void MemoryPool::PrintStats() const
+{
+	size_t requests = hits + misses;
+	std::cout << "Memory pool: " << requests << " request(s), " << hits << " hit(s), " << misses << " allocation(s)";
+	if (requests > 0)
+	{
+		std::cout << ", " << 100.0 * hits / requests << "% hit rate";
+	}
+	std::cout << ", " << bytesAllocated / 1024 << " KB allocated" << std::endl;
+}
+
+void MemoryPool::SetProfiler(EventProfiler* profiler)
+{
+	this->profiler = profiler;
+}
+
+cl::Image2D MakeImage2D(MemoryPool& pool, cl_mem_flags flags, cl::ImageFormat imageFormat, size_t w, size_t h, void* hostPtr)
+{
+	return pool.AcquireImage2D(flags, imageFormat, w, h, hostPtr);
+}
+
+cl::Buffer MakeBuffer(MemoryPool& pool, cl_mem_flags flags, size_t size, void* hostPtr)
+{
+	return pool.AcquireBuffer(flags, size, hostPtr);
+}
+
+cl::Sampler MakeSampler(const cl::Context& context, cl_bool normalizedCoords, cl_addressing_mode addressingMode, cl_filter_mode filterMode)
+{
+	cl_int err;
+
+	cl::Sampler sampler(context, normalizedCoords, addressingMode, filterMode, &err);
+	CheckErrorCode(err, "Unable to create sampler");
+
+	return sampler;
+}
+
+bool UseZeroCopy(const cl::Device& device)
+{
+	std::string mode = ToLower(GetEnvironment(ZERO_COPY_ENV));
+
+	if (mode == "on" || mode == "1")
+	{
+		return true;
+	}
+	if (mode == "off" || mode == "0")
+	{
+		return false;
+	}
+
+	return GetDeviceProfile(device)->hostUnifiedMemory;
+}
+
+void* AllocateAligned(size_t size, size_t alignment)
+{
+	void* ptr = nullptr;
+	size = (size + alignment - 1) / alignment * alignment;
+
+#ifdef WIN32
+	ptr = _aligned_malloc(size, alignment);
+#else
+	if (posix_memalign(&ptr, alignment, size) != 0)
+	{
+		ptr = nullptr;
+	}
+#endif
+
+	if (ptr == nullptr)
+	{
+		throw std::runtime_error("Unable to allocate " + std::to_string(size) + " aligned bytes");
+	}
+
+	return ptr;
+}
+
+void FreeAligned(void* ptr)
+{
+#ifdef WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+static void CL_CALLBACK OnAlignedMemoryReleased(cl_mem, void* userData)
+{
+	FreeAligned(userData);
+}
+
+void FreeAlignedOnRelease(const cl::Memory& memory, void* ptr)
+{
+	cl_int err = clSetMemObjectDestructorCallback(memory(), OnAlignedMemoryReleased, ptr);
+	CheckErrorCode(err, "Unable to set memory destructor callback");
+}
+
+MappedMemory::MappedMemory(const cl::CommandQueue& queue, const cl::Image2D& image, cl_map_flags flags)
+	: queue(queue), memory(image), data(nullptr), rowPitch(0)
+{
+	cl_int err;
+	cl::size_t<3> origin;
+	cl::size_t<3> region;
+	region[0] = image.getImageInfo<CL_IMAGE_WIDTH>();
+	region[1] = image.getImageInfo<CL_IMAGE_HEIGHT>();
+	region[2] = 1;
+
+	data = queue.enqueueMapImage(image, CL_TRUE, flags, origin, region, &rowPitch, nullptr, nullptr, nullptr, &err);
+	CheckErrorCode(err, "Unable to map image");
+}
+
+MappedMemory::MappedMemory(const cl::CommandQueue& queue, const cl::Buffer& buffer, cl_map_flags flags,
+                           size_t size, size_t offset)
+	: queue(queue), memory(buffer), data(nullptr), rowPitch(size)
+{
+	cl_int err;
+
+	data = queue.enqueueMapBuffer(buffer, CL_TRUE, flags, offset, size, nullptr, nullptr, &err);
+	CheckErrorCode(err, "Unable to map buffer");
+}
+
+MappedMemory::~MappedMemory()
+{
+	// Destructors mustn't throw, so a failed unmap is only reported
+	cl_int err = queue.enqueueUnmapMemObject(memory, data);
+	if (err != CL_SUCCESS)
+	{
+		std::cerr << "Error " << err << ": Unable to unmap memory object" << std::endl;
+	}
+}
+
+void* MappedMemory::GetData() const
+{
+	return data;
+}
+
+size_t MappedMemory::GetRowPitch() const
+{
+	return rowPitch;
+}
+
+const unsigned char* MappedMemory::GetPackedRows(size_t rowSize, size_t rows, std::vector<unsigned char>& packed) const
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+	if (rowPitch == rowSize)
+	{
+		return bytes;
+	}
+
+	packed.resize(rowSize * rows);
+	for (size_t y = 0; y < rows; ++y)
+	{
+		std::copy(bytes + y * rowPitch, bytes + y * rowPitch + rowSize, packed.begin() + y * rowSize);
+	}
+
+	return &packed[0];
+}
+
+std::vector<std::string> ListFiles(const std::string& directory, const std::string& extension)
+{
+	std::vector<std::string> fileNames;
+	std::string suffix = ToLower(extension);
+
+#ifdef WIN32
+	_finddata_t data;
+	intptr_t handle = _findfirst((directory + "/*").c_str(), &data);
+	if (handle != -1)
+	{
+		do
+		{
+			if (!(data.attrib & _A_SUBDIR))
+			{
+				fileNames.push_back(data.name);
+			}
+		} while (_findnext(handle, &data) == 0);
+		_findclose(handle);
+	}
+#else
+	DIR* dir = opendir(directory.c_str());
+	if (dir != nullptr)
+	{
+		while (dirent* entry = readdir(dir))
+		{
+			if (entry->d_type != DT_DIR)
+			{
+				fileNames.push_back(entry->d_name);
+			}
+		}
+		closedir(dir);
+	}
+#endif
+
+	fileNames.erase(std::remove_if(fileNames.begin(), fileNames.end(), [&suffix](const std::string& name)
+	{
+		return name.size() < suffix.size() || ToLower(name.substr(name.size() - suffix.size())) != suffix;
+	}), fileNames.end());
+	std::sort(fileNames.begin(), fileNames.end());
+
+	return fileNames;
+}
+
+StreamingPipeline::StreamingPipeline(const cl::Context& context, const cl::Device& device, MemoryPool& pool,
+                                     ComputeStage compute, CompleteStage complete, size_t scratchImages,
+                                     size_t depth, cl_command_queue_properties properties)
+	: pool(pool), compute(compute), complete(complete), scratchImages(scratchImages),
+	  slots(std::max<size_t>(depth, 1)), next(0), profiler(nullptr)
+{
+	uploadQueue = MakeCommandQueue(context, device, properties);
+	computeQueue = MakeCommandQueue(context, device, properties);
+	downloadQueue = MakeCommandQueue(context, device, properties);
+
+	for (auto& slot : slots)
+	{
+		slot.width = 0;
+		slot.height = 0;
+		slot.hostInput = nullptr;
+		slot.busy = false;
+	}
+}
+
+StreamingPipeline::~StreamingPipeline()
+{
+	Flush();
+
+	for (auto& slot : slots)
+	{
+		if (slot.input() != nullptr)
+		{
+			pool.Release(slot.input);
+			pool.Release(slot.output);
+			for (auto& image : slot.scratch)
+			{
+				pool.Release(image);
+			}
+		}
+	}
+}
+
+void StreamingPipeline::Push(const std::string& name, unsigned char* hostInput, int width, int height)
+{
+	cl_int err;
+	StreamSlot& slot = slots[next];
+	next = (next + 1) % slots.size();
+
+	if (slot.busy)
+	{
+		Complete(slot);
+	}
+
+	Reserve(slot, width, height);
+	slot.name = name;
+	slot.hostInput = hostInput;
+	slot.hostOutput.resize(width * height * 4);
+
+	cl::size_t<3> origin;
+	cl::size_t<3> region;
+	region[0] = width;
+	region[1] = height;
+	region[2] = 1;
+
+	// Each stage is flushed right away so the queues actually run side by side
+	cl::Event uploaded;
+	err = uploadQueue.enqueueWriteImage(slot.input, CL_FALSE, origin, region, 0, 0, hostInput, nullptr, &uploaded);
+	CheckErrorCode(err, "Unable to upload " + name);
+	uploadQueue.flush();
+
+	std::vector<cl::Event> waitList(1, uploaded);
+	cl::Event computed = compute(computeQueue, slot, waitList);
+	computeQueue.flush();
+
+	waitList.assign(1, computed);
+	err = downloadQueue.enqueueReadImage(slot.output, CL_FALSE, origin, region, 0, 0, &slot.hostOutput[0],
+	                                     &waitList, &slot.downloaded);
+	CheckErrorCode(err, "Unable to download " + name);
+	downloadQueue.flush();
+
+	if (profiler != nullptr)
+	{
+		profiler->Track("Upload " + name, uploaded);
+		profiler->Track("Download " + name, slot.downloaded);
+	}
+
+	slot.busy = true;
+}
+
+void StreamingPipeline::Flush()
+{
+	// Oldest first, so frames complete in the order they were pushed
+	for (size_t i = 0; i < slots.size(); ++i)
+	{
+		StreamSlot& slot = slots[(next + i) % slots.size()];
+		if (slot.busy)
+		{
+			Complete(slot);
+		}
+	}
+}
+
+void StreamingPipeline::SetProfiler(EventProfiler* profiler)
+{
+	this->profiler = profiler;
+}
+
+void StreamingPipeline::Reserve(StreamSlot& slot, int width, int height)
+{
+	if (slot.width == width && slot.height == height)
+	{
+		return;
+	}
+
+	if (slot.input() != nullptr)
+	{
+		pool.Release(slot.input);
+		pool.Release(slot.output);
+		for (auto& image : slot.scratch)
+		{
+			pool.Release(image);
+		}
+	}
+
+	cl::ImageFormat imageFormat(CL_RGBA, CL_UNORM_INT8);
+	slot.input = MakeImage2D(pool, CL_MEM_READ_WRITE, imageFormat, width, height);
+	slot.output = MakeImage2D(pool, CL_MEM_READ_WRITE, imageFormat, width, height);
+	slot.scratch.resize(scratchImages);
+	for (auto& image : slot.scratch)
+	{
+		image = MakeImage2D(pool, CL_MEM_READ_WRITE, imageFormat, width, height);
+	}
+
+	slot.width = width;
+	slot.height = height;
+}
+
+void StreamingPipeline::Complete(StreamSlot& slot)
+{
+	cl_int err = slot.downloaded.wait();
+	CheckErrorCode(err, "Unable to wait for " + slot.name);
+
+	slot.busy = false;
+	complete(slot);
+	slot.hostInput = nullptr;
+}
+
+// An empty vector is cl::NullRange
+static cl::NDRange MakeNDRange(const std::vector<size_t>& sizes)
+{
+	switch (sizes.size())
+	{
+	case 1:
+		return cl::NDRange(sizes[0]);
+	case 2:
+		return cl::NDRange(sizes[0], sizes[1]);
+	case 3:
+		return cl::NDRange(sizes[0], sizes[1], sizes[2]);
+	default:
+		return cl::NullRange;
+	}
+}
+
+WorkGroupTuner::WorkGroupTuner()
+{
+	const char* value = getenv(TUNING_DB_ENV);
+	fileName = value == nullptr ? TUNING_DB_DEFAULT_FILENAME : value;
+	Load();
+}
+
+WorkGroupTuner::WorkGroupTuner(const std::string& fileName)
+	: fileName(fileName)
+{
+	Load();
+}
+
+cl::NDRange WorkGroupTuner::GetLocalSize(const cl::CommandQueue& queue, const cl::Kernel& kernel,
+                                         const cl::NDRange& global, const std::vector<cl::Event>* events)
+{
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	std::string buildOptions = kernel.getInfo<CL_KERNEL_PROGRAM>().getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device);
+
+	// Specialised builds of the same kernel are tuned separately
+	std::ostringstream key;
+	auto profile = GetDeviceProfile(device);
+	key << profile->name << "/" << profile->driverVersion << "|"
+		<< kernel.getInfo<CL_KERNEL_FUNCTION_NAME>() << "|" << HashString(buildOptions) << "|";
+	for (size_t i = 0; i < global.dimensions(); ++i)
+	{
+		key << (i == 0 ? "" : "x") << global[i];
+	}
+
+	auto entry = results.find(key.str());
+	if (entry == results.end())
+	{
+		entry = results.insert(std::make_pair(key.str(), Tune(queue, device, kernel, global, events))).first;
+		Save(entry->first, entry->second);
+	}
+
+	return MakeNDRange(entry->second);
+}
+
+// Best of TUNING_RUNS launches in nanoseconds, 0 if the local size is rejected
+static cl_ulong TimeLaunch(const cl::CommandQueue& queue, const cl::Kernel& kernel,
+                           const cl::NDRange& global, const cl::NDRange& local)
+{
+	cl_ulong best = 0;
+
+	for (auto i = 0; i < TUNING_RUNS; ++i)
+	{
+		cl::Event event;
+		if (queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, nullptr, &event) != CL_SUCCESS ||
+			event.wait() != CL_SUCCESS)
+		{
+			return 0;
+		}
+
+		cl_ulong time = event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+		                event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		if (best == 0 || time < best)
+		{
+			best = std::max<cl_ulong>(time, 1);
+		}
+	}
+
+	return best;
+}
+
+std::vector<size_t> WorkGroupTuner::Tune(const cl::CommandQueue& queue, const cl::Device& device, const cl::Kernel& kernel,
+                                         const cl::NDRange& global, const std::vector<cl::Event>* events)
+{
+	cl_int err;
+
+	// The benchmark reads whatever the kernel's inputs hold, so they have to be ready
+	if (events != nullptr && !events->empty())
+	{
+		err = cl::Event::waitForEvents(*events);
+		CheckErrorCode(err, "Unable to wait for events before tuning");
+	}
+	err = queue.finish();
+	CheckErrorCode(err, "Unable to finish queue before tuning");
+
+	cl::CommandQueue tuningQueue = MakeCommandQueue(queue.getInfo<CL_QUEUE_CONTEXT>(), device, CL_QUEUE_PROFILING_ENABLE);
+	KernelResources resources = GetKernelResources(kernel, device);
+	size_t multiple = std::max<size_t>(resources.preferredWorkGroupSizeMultiple, 1);
+	size_t maxSize = resources.workGroupSize;
+	auto profile = GetDeviceProfile(device);
+	const std::vector<size_t>& maxItemSizes = profile->maxWorkItemSizes;
+	size_t dimensions = global.dimensions();
+
+	// The runtime's own choice is the baseline every candidate has to beat
+	std::vector<size_t> bestSize;
+	cl_ulong bestTime = TimeLaunch(tuningQueue, kernel, global, cl::NullRange);
+
+	std::vector<std::vector<size_t> > candidates;
+	if (dimensions == 1)
+	{
+		for (size_t x = multiple; x <= std::min(maxSize, maxItemSizes[0]); x *= 2)
+		{
+			if (global[0] % x == 0)
+			{
+				candidates.push_back(std::vector<size_t>(1, x));
+			}
+		}
+	}
+	else if (dimensions == 2)
+	{
+		for (size_t x = 1; x <= std::min(maxSize, maxItemSizes[0]); x *= 2)
+		{
+			for (size_t y = 1; x * y <= maxSize && y <= maxItemSizes[1]; y *= 2)
+			{
+				if (x * y % multiple == 0 && global[0] % x == 0 && global[1] % y == 0)
+				{
+					std::vector<size_t> candidate;
+					candidate.push_back(x);
+					candidate.push_back(y);
+					candidates.push_back(candidate);
+				}
+			}
+		}
+	}
+
+	for (auto& candidate : candidates)
+	{
+		cl::NDRange local = dimensions == 1 ? cl::NDRange(candidate[0]) : cl::NDRange(candidate[0], candidate[1]);
+		cl_ulong time = TimeLaunch(tuningQueue, kernel, global, local);
+
+		if (time != 0 && (bestTime == 0 || time < bestTime))
+		{
+			bestTime = time;
+			bestSize = candidate;
+		}
+	}
+
+	std::cout << "Tuned " << kernel.getInfo<CL_KERNEL_FUNCTION_NAME>() << " over " << candidates.size()
+		<< " candidate(s): local size ";
+	for (size_t i = 0; i < bestSize.size(); ++i)
+	{
+		std::cout << (i == 0 ? "" : "x") << bestSize[i];
+	}
+	std::cout << (bestSize.empty() ? "chosen by the runtime" : "") << ", " << bestTime / 1000000.0 << " ms" << std::endl;
+
+	return bestSize;
+}
+
+// One line per result: key, a tab, then the local size or "-" for the runtime's choice
+void WorkGroupTuner::Load()
+{
+	if (fileName.empty())
+	{
+		return;
+	}
+
+	std::ifstream infile(fileName.c_str());
+	std::string line;
+
+	while (std::getline(infile, line))
+	{
+		size_t tab = line.find('\t');
+		if (tab == std::string::npos)
+		{
+			continue;
+		}
+
+		std::vector<size_t> localSize;
+		std::istringstream sizes(line.substr(tab + 1));
+		size_t size;
+		while (sizes >> size)
+		{
+			localSize.push_back(size);
+		}
+
+		results[line.substr(0, tab)] = localSize;
+	}
+}
+
+void WorkGroupTuner::Save(const std::string& key, const std::vector<size_t>& localSize)
+{
+	if (fileName.empty())
+	{
+		return;
+	}
+
+	std::ofstream outfile(fileName.c_str(), std::ios::app);
+	outfile << key << "\t";
+	for (auto size : localSize)
+	{
+		outfile << size << " ";
+	}
+	outfile << (localSize.empty() ? "-" : "") << std::endl;
+}
+
+// cl_khr_command_buffer entry points, declared here because the SDK headers predate the extension
+typedef struct _cl_command_buffer_khr* cl_command_buffer_khr;
+typedef cl_uint cl_sync_point_khr;
+typedef cl_ulong cl_command_buffer_property_khr;
+
+typedef cl_command_buffer_khr (CL_API_CALL *clCreateCommandBufferKHR_fn)(
+	cl_uint numQueues, const cl_command_queue* queues, const cl_command_buffer_property_khr* properties, cl_int* err);
+typedef cl_int (CL_API_CALL *clCommandNDRangeKernelKHR_fn)(
+	cl_command_buffer_khr commandBuffer, cl_command_queue queue, const cl_ulong* properties, cl_kernel kernel,
+	cl_uint workDim, const size_t* globalOffset, const size_t* globalSize, const size_t* localSize,
+	cl_uint numSyncPoints, const cl_sync_point_khr* syncPoints, cl_sync_point_khr* syncPoint, void* mutableHandle);
+typedef cl_int (CL_API_CALL *clFinalizeCommandBufferKHR_fn)(cl_command_buffer_khr commandBuffer);
+typedef cl_int (CL_API_CALL *clEnqueueCommandBufferKHR_fn)(
+	cl_uint numQueues, cl_command_queue* queues, cl_command_buffer_khr commandBuffer,
+	cl_uint numEvents, const cl_event* events, cl_event* event);
+typedef cl_int (CL_API_CALL *clReleaseCommandBufferKHR_fn)(cl_command_buffer_khr commandBuffer);
+
+struct CommandBufferFunctions
+{
+	clCreateCommandBufferKHR_fn create;
+	clCommandNDRangeKernelKHR_fn commandNDRangeKernel;
+	clFinalizeCommandBufferKHR_fn finalize;
+	clEnqueueCommandBufferKHR_fn enqueue;
+	clReleaseCommandBufferKHR_fn release;
+};
+
+CommandGraph::CommandGraph(const cl::CommandQueue& queue)
+	: queue(queue), bindingCount(0)
+{
+	if (queue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+	{
+		throw std::runtime_error("Command graphs need an in-order queue");
+	}
+
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	if (!GetDeviceProfile(device)->HasExtension("cl_khr_command_buffer"))
+	{
+		return;
+	}
+
+	cl_platform_id platform = device.getInfo<CL_DEVICE_PLATFORM>();
+	std::unique_ptr<CommandBufferFunctions> found(new CommandBufferFunctions);
+	found->create = reinterpret_cast<clCreateCommandBufferKHR_fn>(
+		clGetExtensionFunctionAddressForPlatform(platform, "clCreateCommandBufferKHR"));
+	found->commandNDRangeKernel = reinterpret_cast<clCommandNDRangeKernelKHR_fn>(
+		clGetExtensionFunctionAddressForPlatform(platform, "clCommandNDRangeKernelKHR"));
+	found->finalize = reinterpret_cast<clFinalizeCommandBufferKHR_fn>(
+		clGetExtensionFunctionAddressForPlatform(platform, "clFinalizeCommandBufferKHR"));
+	found->enqueue = reinterpret_cast<clEnqueueCommandBufferKHR_fn>(
+		clGetExtensionFunctionAddressForPlatform(platform, "clEnqueueCommandBufferKHR"));
+	found->release = reinterpret_cast<clReleaseCommandBufferKHR_fn>(
+		clGetExtensionFunctionAddressForPlatform(platform, "clReleaseCommandBufferKHR"));
+
+	if (found->create != nullptr && found->commandNDRangeKernel != nullptr && found->finalize != nullptr &&
+		found->enqueue != nullptr && found->release != nullptr)
+	{
+		functions = std::move(found);
+	}
+}
+
+CommandGraph::~CommandGraph()
+{
+	for (auto& entry : commandBuffers)
+	{
+		functions->release(static_cast<cl_command_buffer_khr>(entry.second.commandBuffer));
+	}
+}
+
+GraphBinding CommandGraph::AddBinding()
+{
+	GraphBinding binding = { bindingCount++ };
+	return binding;
+}
+
+CommandGraph::Node CommandGraph::MakeNode(const cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local)
+{
+	cl_int err;
+	Node node;
+
+	// A fresh kernel object keeps this launch's arguments apart from every other use of the kernel
+	std::string name = kernel.getInfo<CL_KERNEL_FUNCTION_NAME>();
+	node.kernel = cl::Kernel(kernel.getInfo<CL_KERNEL_PROGRAM>(), name.c_str(), &err);
+	CheckErrorCode(err, "Unable to copy kernel " + name);
+
+	node.global.assign(static_cast<const size_t*>(global), static_cast<const size_t*>(global) + global.dimensions());
+	node.local.assign(static_cast<const size_t*>(local), static_cast<const size_t*>(local) + local.dimensions());
+
+	return node;
+}
+
+void CommandGraph::Bind(const std::vector<cl_mem>& handles)
+{
+	for (auto& node : nodes)
+	{
+		for (size_t i = 0; i < node.bindings.size(); ++i)
+		{
+			cl_mem handle = handles[node.bindings[i].second];
+			if (node.bound[i] != handle)
+			{
+				cl_int err = node.kernel.setArg(node.bindings[i].first, sizeof(cl_mem), &handle);
+				CheckErrorCode(err, "Unable to bind kernel argument " + std::to_string(node.bindings[i].first));
+				node.bound[i] = handle;
+			}
+		}
+	}
+}
+
+// Records the nodes with their current arguments, each waiting for the one before
+void* CommandGraph::MakeCommandBuffer()
+{
+	cl_int err;
+	cl_command_queue queueHandle = queue();
+
+	cl_command_buffer_khr commandBuffer = functions->create(1, &queueHandle, nullptr, &err);
+	CheckErrorCode(err, "Unable to create command buffer");
+
+	cl_sync_point_khr previous = 0;
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		const Node& node = nodes[i];
+		cl_sync_point_khr syncPoint;
+
+		err = functions->commandNDRangeKernel(commandBuffer, nullptr, nullptr, node.kernel(),
+		                                      static_cast<cl_uint>(node.global.size()), nullptr, &node.global[0],
+		                                      node.local.empty() ? nullptr : &node.local[0],
+		                                      i == 0 ? 0 : 1, i == 0 ? nullptr : &previous, &syncPoint, nullptr);
+		if (err != CL_SUCCESS)
+		{
+			functions->release(commandBuffer);
+			CheckErrorCode(err, "Unable to record command buffer");
+		}
+		previous = syncPoint;
+	}
+
+	err = functions->finalize(commandBuffer);
+	if (err != CL_SUCCESS)
+	{
+		functions->release(commandBuffer);
+		CheckErrorCode(err, "Unable to finalize command buffer");
+	}
+
+	return commandBuffer;
+}
+
+void CommandGraph::Replay(const std::vector<cl::Memory>& bindings, const std::vector<cl::Event>* events, cl::Event* event)
+{
+	cl_int err;
+
+	if (bindings.size() != bindingCount)
+	{
+		throw std::runtime_error("Command graph expects " + std::to_string(bindingCount) + " binding(s), got " +
+		                         std::to_string(bindings.size()));
+	}
+
+	std::vector<cl_mem> handles;
+	for (auto& memory : bindings)
+	{
+		handles.push_back(memory());
+	}
+
+	if (functions)
+	{
+		auto entry = commandBuffers.find(handles);
+		if (entry == commandBuffers.end())
+		{
+			Bind(handles);
+			RecordedCommandBuffer recorded = { MakeCommandBuffer(), bindings };
+			entry = commandBuffers.insert(std::make_pair(handles, recorded)).first;
+		}
+
+		std::vector<cl_event> waitList;
+		if (events != nullptr)
+		{
+			for (auto& waitEvent : *events)
+			{
+				waitList.push_back(waitEvent());
+			}
+		}
+
+		cl_event replayEvent;
+		err = functions->enqueue(0, nullptr, static_cast<cl_command_buffer_khr>(entry->second.commandBuffer),
+		                         static_cast<cl_uint>(waitList.size()), waitList.empty() ? nullptr : &waitList[0],
+		                         event == nullptr ? nullptr : &replayEvent);
+		CheckErrorCode(err, "Unable to enqueue command buffer");
+
+		if (event != nullptr)
+		{
+			*event = cl::Event(replayEvent);
+		}
+		return;
+	}
+
+	// The queue is in-order, so only the first launch waits and only the last signals
+	Bind(handles);
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		const Node& node = nodes[i];
+		err = queue.enqueueNDRangeKernel(node.kernel, cl::NullRange, MakeNDRange(node.global), MakeNDRange(node.local),
+		                                 i == 0 ? events : nullptr, i + 1 == nodes.size() ? event : nullptr);
+		CheckErrorCode(err, "Unable to replay command graph");
+	}
+}
+
+bool CommandGraph::UsesCommandBuffers() const
+{
+	return functions != nullptr;
+}
+
+size_t CommandGraph::GetSize() const
+{
+	return nodes.size();
 }
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <fstream>
-#include <unordered_map>
+#include <map>
+#include <chrono>
+#include <algorithm>
 
 #include <CL/cl.hpp>
 
@@ -12,15 +14,27 @@
 #include "OCLUtils.h"
 #include "Filters.h"
 
+// Kernel sources embedded at build time by EmbedKernel.ps1
+#include "Reduction.cl.h"
+#include "Convolution.cl.h"
+#include "Bloom.cl.h"
+
 #define REDUCTION_CL_FILENAME "Reduction.cl"
 #define CONVOLUTION_CL_FILENAME "Convolution.cl"
 #define BLOOM_CL_FILENAME "Bloom.cl"
 
+#define OUTPUT_DIRECTORY "Output"
+
 #define LUMINANCE_KERNEL "Luminance"
 #define REDUCTION_STEP_KERNEL "ReductionStep"
 #define REDUCTION_COMPLETE_KERNEL "ReductionComplete"
 #define ONE_PASS_CONVOLUTION_KERNEL "OnePassConvolution"
+#define SEPARABLE_CONVOLUTION_KERNEL "SeparableConvolution"
+#define BUFFER_ONE_PASS_CONVOLUTION_KERNEL "BufferOnePassConvolution"
+#define RECURSIVE_GAUSSIAN_COLUMNS_KERNEL "RecursiveGaussianColumns"
+#define RECURSIVE_GAUSSIAN_ROWS_KERNEL "RecursiveGaussianRows"
 #define DISCARD_PIXELS_KERNEL "DiscardPixels"
+#define DISCARD_PIXELS_BY_SUM_KERNEL "DiscardPixelsBySum"
 #define MERGE_IMAGES_KERNEL "MergeImages"
 
 #define VENDOR_INTEL "Intel"
@@ -28,6 +42,49 @@
 #define VENDOR_NVIDIA "NVIDIA"
 #define SELECTED_VENDOR VENDOR_INTEL
 
+// SeparableConvolution's work-group is TILE_SIZE wide and as tall as the device allows, up to TILE_SIZE
+#define TILE_SIZE 16
+
+// Buffer kernels handle BUFFER_PIXELS pixels of a row per work-item
+#define BUFFER_PIXELS 4
+
+// Test frame the image and buffer paths are timed on
+#define PATH_TEST_SIZE 1024
+#define PATH_RUNS 5
+
+// inputImage, sampler, outputLuminance
+typedef KernelFunctor<cl::Image2D, cl::Sampler, cl::Buffer> LuminanceKernel;
+// data, partialSums
+typedef KernelFunctor<cl::Buffer, cl::LocalSpaceArg> ReductionStepKernel;
+// data, partialSums, sum
+typedef KernelFunctor<cl::Buffer, cl::LocalSpaceArg, cl::Buffer> ReductionCompleteKernel;
+// inputImage, outputImage, sampler, filter, filterSize, horizontalPass
+typedef KernelFunctor<cl::Image2D, cl::Image2D, cl::Sampler, cl::Buffer, int, int> OnePassConvolutionKernel;
+// input, output, filter, filterSize, horizontalPass, width, height
+typedef KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, int, int, int, int> BufferOnePassConvolutionKernel;
+// inputImage, scratch, outputImage, sampler, coefficients, width, height
+typedef KernelFunctor<cl::Image2D, cl::Buffer, cl::Image2D, cl::Sampler, cl_float4, int, int> RecursiveGaussianKernel;
+// inputImage, outputImage, sampler, luminanceAverage
+typedef KernelFunctor<cl::Image2D, cl::Image2D, cl::Sampler, float> DiscardPixelsKernel;
+// inputImageA, inputImageB, outputImage, sampler
+typedef KernelFunctor<cl::Image2D, cl::Image2D, cl::Image2D, cl::Sampler> MergeImagesKernel;
+
+// Where a device runs the convolutions, images and samplers are emulated on some CPU runtimes
+enum class ConvolutionPath
+{
+	Image,
+	Buffer
+};
+
+std::map<std::string, std::string> MakeOnePassConvolutionDefines(int filterSize, const float* filter, int horizontalPass);
+std::map<std::string, std::string> MakeSeparableConvolutionDefines(int filterSize, const float* filter, const cl::NDRange& tileSize);
+cl::NDRange GetTileSize(const cl::Device& device);
+bool FitsSeparableConvolution(const cl::Device& device, int filterSize, const cl::NDRange& tileSize);
+cl::NDRange RoundUpToTile(int w, int h, const cl::NDRange& tileSize);
+cl::NDRange GetBufferRange(int w, int h);
+ConvolutionPath ChooseConvolutionPath(const cl::Context& context, const cl::Device& device,
+                                      ProgramVariants& convolutionVariants, int filterSize, const float* filter);
+
 int main()
 {
 	cl_int err;
@@ -39,15 +96,30 @@ int main()
 	// ==============================================================
 	cl::Device device = GetDevice(SELECTED_VENDOR);
 	cl::Context context = MakeContext(device);
-	cl::CommandQueue queue = MakeCommandQueue(context, device);
-
-	std::vector<const char*> sourceFileNames;
-	sourceFileNames.push_back(REDUCTION_CL_FILENAME);
-	sourceFileNames.push_back(CONVOLUTION_CL_FILENAME);
-	sourceFileNames.push_back(BLOOM_CL_FILENAME);
-	cl::Program program = MakeAndBuildProgram(sourceFileNames, context, device);
-
-	std::unordered_map<std::string, cl::Kernel> kernels = MakeKernels(program);
+	auto profile = GetDeviceProfile(device);
+	// Stages declare what they read and write, the scheduler orders them on an out-of-order queue
+	CommandScheduler scheduler(context, device, CL_QUEUE_PROFILING_ENABLE);
+	cl::CommandQueue queue = scheduler.GetQueue();
+	// The pool's uploads carry no wait lists, so they get an in-order queue of their own
+	MemoryPool pool(context, MakeCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE));
+
+	// Records every stage of the pipeline for the trace written at the end
+	EventProfiler profiler;
+	pool.SetProfiler(&profiler);
+
+	// Each source is its own program, built in the background while the user answers the prompts
+	ProgramLibrary library(context, device);
+	library.Add({REDUCTION_CL_FILENAME});
+	library.Add({BLOOM_CL_FILENAME});
+	library.Prefetch(DISCARD_PIXELS_KERNEL);
+
+	// Image kernels use tuned local sizes, the in-place reduction keeps its explicit one
+	WorkGroupTuner tuner;
+
+	// Blur kernels are specialised per filter size and pass direction
+	std::vector<const char*> convolutionFileNames;
+	convolutionFileNames.push_back(CONVOLUTION_CL_FILENAME);
+	ProgramVariants convolutionVariants(convolutionFileNames, context, device);
 
 	// ==============================================================
 	//
@@ -55,22 +127,49 @@ int main()
 	//
 	// ==============================================================
 	std::string filename;
+	std::string directory;
+	std::vector<std::string> batchFileNames;
 	std::ifstream infile;
 	char input;
-	int filterSize = 7;
+	float sigma = 0.0f;
 	float luminanceAverage = 0.0f;
 
-	std::cout << "Image filename: ";
-	std::cin >> filename;
-	infile.open(filename);
-	while (!(infile.is_open() && infile.good()))
+	std::cout << "Process every image in a directory? (y/n)" << std::endl;
+	std::cin >> input;
+	while (input != 'y' && input != 'n')
+	{
+		std::cout << "Invalid input. Try again." << std::endl;
+		std::cout << "Process every image in a directory? (y/n)" << std::endl;
+		std::cin >> input;
+	}
+
+	if (input == 'y')
+	{
+		std::cout << "Image directory: ";
+		std::cin >> directory;
+		batchFileNames = ListFiles(directory, ".bmp");
+		while (batchFileNames.empty())
+		{
+			std::cout << "No bitmap images found. Try again." << std::endl;
+			std::cout << "Image directory: ";
+			std::cin >> directory;
+			batchFileNames = ListFiles(directory, ".bmp");
+		}
+	}
+	else
 	{
-		std::cout << "Invalid image file. Try again." << std::endl;
 		std::cout << "Image filename: ";
 		std::cin >> filename;
 		infile.open(filename);
+		while (!(infile.is_open() && infile.good()))
+		{
+			std::cout << "Invalid image file. Try again." << std::endl;
+			std::cout << "Image filename: ";
+			std::cin >> filename;
+			infile.open(filename);
+		}
+		infile.close();
 	}
-	infile.close();
 
 	std::cout << "Use custom settings? (y/n)" << std::endl;
 	std::cin >> input;
@@ -83,13 +182,13 @@ int main()
 
 	if (input == 'y')
 	{
-		std::cout << "Gaussian filter window size? (3/5/7)" << std::endl;
-		std::cin >> filterSize;
-		while (filterSize != 3 && filterSize != 5 && filterSize != 7)
+		std::cout << "Gaussian sigma? (0.5-50, 0 for default)" << std::endl;
+		std::cin >> sigma;
+		while (!(sigma == 0.0f || (sigma >= MIN_GAUSSIAN_SIGMA && sigma <= MAX_GAUSSIAN_SIGMA)))
 		{
 			std::cout << "Invalid input. Try again." << std::endl;
-			std::cout << "Gaussian filter window size? (3/5/7)" << std::endl;
-			std::cin >> filterSize;
+			std::cout << "Gaussian sigma? (0.5-50, 0 for default)" << std::endl;
+			std::cin >> sigma;
 		}
 
 		std::cout << "Bloom threshold value? (1-255, 0 for default)" << std::endl;
@@ -102,6 +201,306 @@ int main()
 		}
 	}
 
+	// The reduction is only built when the threshold has to be measured
+	if (luminanceAverage == 0.0f)
+	{
+		library.Prefetch(LUMINANCE_KERNEL);
+	}
+
+	DiscardPixelsKernel discardPixels(library.GetKernel(DISCARD_PIXELS_KERNEL));
+	MergeImagesKernel mergeImages(library.GetKernel(MERGE_IMAGES_KERNEL));
+	discardPixels.SetProfiler(&profiler);
+	mergeImages.SetProfiler(&profiler);
+	discardPixels.SetTuner(&tuner);
+	mergeImages.SetTuner(&tuner);
+
+	// ==============================================================
+	//
+	// Create buffer for filter data
+	//
+	// ==============================================================
+	// The 7 tap table unless a sigma was given
+	std::vector<float> weights(GaussianFilter7, GaussianFilter7 + 7);
+	if (sigma > 0.0f)
+	{
+		weights = MakeGaussianFilter(sigma, GetGaussianRadius(sigma));
+	}
+	int filterSize = static_cast<int>(weights.size());
+	float* filter = &weights[0];
+	cl::Buffer filterBuffer = MakeBuffer(pool, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+	                                     sizeof(float) * filterSize, filter);
+
+	cl::Sampler sampler = MakeSampler(context, CL_FALSE, CL_ADDRESS_CLAMP, CL_FILTER_NEAREST);
+
+	// Wide blurs go through the recursive Gaussian, which costs the same for every sigma
+	int recursiveRadius = GetRecursiveGaussianRadius();
+	bool recursive = sigma > 0.0f && UseRecursiveGaussian(sigma, recursiveRadius);
+	if (recursive)
+	{
+		std::cout << "Radius is above " << recursiveRadius << ", the blur uses the recursive Gaussian" << std::endl;
+	}
+
+	// Image or buffer kernels, whichever ran the two pass blur faster on this device.
+	// The recursive Gaussian has one path only, so the convolutions aren't timed for it.
+	ConvolutionPath path = ConvolutionPath::Image;
+	if (!recursive)
+	{
+		path = ChooseConvolutionPath(context, device, convolutionVariants, filterSize, filter);
+	}
+
+	// ==============================================================
+	//
+	// Batch bloom
+	//
+	// ==============================================================
+	if (!batchFileNames.empty())
+	{
+		// Both blur passes in one launch, the intermediate image never reaches global memory.
+		// Filters too wide for the separable tile are blurred in two passes instead, and
+		// radii above the recursive radius with the recursive Gaussian. Devices where
+		// buffers measured faster copy the thresholded frame through the buffer kernels.
+		cl::NDRange tileSize = GetTileSize(device);
+		bool buffers = !recursive && path == ConvolutionPath::Buffer;
+		bool separable = !recursive && !buffers && FitsSeparableConvolution(device, filterSize, tileSize);
+		cl::Kernel separableKernel;
+		cl::Kernel horizontalKernel;
+		cl::Kernel verticalKernel;
+		cl::Kernel recursiveColumnsKernel;
+		cl::Kernel recursiveRowsKernel;
+		BufferOnePassConvolutionKernel bufferHorizontalConvolution;
+		BufferOnePassConvolutionKernel bufferVerticalConvolution;
+		cl_float4 coefficients = {};
+
+		if (recursive)
+		{
+			std::vector<float> recursiveCoefficients = MakeRecursiveGaussianCoefficients(sigma);
+			std::copy(recursiveCoefficients.begin(), recursiveCoefficients.end(), coefficients.s);
+			recursiveColumnsKernel = convolutionVariants.GetKernel(RECURSIVE_GAUSSIAN_COLUMNS_KERNEL,
+			                                                       std::map<std::string, std::string>());
+			recursiveRowsKernel = convolutionVariants.GetKernel(RECURSIVE_GAUSSIAN_ROWS_KERNEL,
+			                                                    std::map<std::string, std::string>());
+		}
+		else if (buffers)
+		{
+			bufferHorizontalConvolution = BufferOnePassConvolutionKernel(convolutionVariants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+			                                                             MakeOnePassConvolutionDefines(filterSize, filter, 1)));
+			bufferVerticalConvolution = BufferOnePassConvolutionKernel(convolutionVariants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+			                                                           MakeOnePassConvolutionDefines(filterSize, filter, 0)));
+		}
+		else if (separable)
+		{
+			separableKernel = convolutionVariants.GetKernel(SEPARABLE_CONVOLUTION_KERNEL,
+			                                                MakeSeparableConvolutionDefines(filterSize, filter, tileSize));
+		}
+		else
+		{
+			horizontalKernel = convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+			                                                 MakeOnePassConvolutionDefines(filterSize, filter, 1));
+			verticalKernel = convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+			                                               MakeOnePassConvolutionDefines(filterSize, filter, 0));
+		}
+
+		// The whole frame is recorded once per image size and replayed with the slot's images bound
+		struct BloomGraph
+		{
+			std::unique_ptr<CommandGraph> graph;
+			cl::Buffer luminanceBuffer;
+			cl::Buffer sumBuffer;
+			// Float intermediates of the recursive Gaussian
+			cl::Buffer recursiveScratch;
+			cl::Image2D recursiveImage;
+			// Pixels of the buffer path, the graph then only covers the threshold
+			cl::Buffer pixelBufferA;
+			cl::Buffer pixelBufferB;
+		};
+		std::map<std::pair<int, int>, BloomGraph> graphs;
+
+		// input -> scratch[0] -> scratch[1], merged with input into output
+		auto compute = [&](const cl::CommandQueue& computeQueue, StreamSlot& slot, const std::vector<cl::Event>& waitList)
+		{
+			BloomGraph& bloomGraph = graphs[std::make_pair(slot.width, slot.height)];
+
+			if (!bloomGraph.graph)
+			{
+				bloomGraph.graph.reset(new CommandGraph(computeQueue));
+				CommandGraph& graph = *bloomGraph.graph;
+				GraphBinding input = graph.AddBinding();
+				GraphBinding scratchA = graph.AddBinding();
+				GraphBinding scratchB = graph.AddBinding();
+				GraphBinding output = graph.AddBinding();
+				cl::NDRange imageRange(slot.width, slot.height);
+
+				if (luminanceAverage == 0.0f)
+				{
+					// The threshold is derived from the sum on the device, so frames need no host round trip
+					MemoryTag luminanceTag("Luminance");
+					bloomGraph.luminanceBuffer = MakeBuffer(pool, CL_MEM_READ_WRITE, sizeof(float) * slot.width * slot.height);
+					bloomGraph.sumBuffer = MakeBuffer(pool, CL_MEM_READ_WRITE, sizeof(float));
+					size_t localSize = profile->maxWorkGroupSize;
+					size_t globalSize = (slot.width * slot.height) / 4;
+
+					graph.Record(library.GetKernel(LUMINANCE_KERNEL), imageRange, cl::NullRange,
+					             input, sampler, bloomGraph.luminanceBuffer);
+
+					graph.Record(library.GetKernel(REDUCTION_STEP_KERNEL), cl::NDRange(globalSize), cl::NDRange(localSize),
+					             bloomGraph.luminanceBuffer, cl::Local(sizeof(float) * 4 * localSize));
+
+					while (globalSize / localSize > localSize)
+					{
+						globalSize = globalSize / localSize;
+						graph.Record(library.GetKernel(REDUCTION_STEP_KERNEL), cl::NDRange(globalSize), cl::NDRange(localSize),
+						             bloomGraph.luminanceBuffer, cl::Local(sizeof(float) * 4 * localSize));
+					}
+
+					globalSize = globalSize / localSize;
+					graph.Record(library.GetKernel(REDUCTION_COMPLETE_KERNEL), cl::NDRange(globalSize), cl::NullRange,
+					             bloomGraph.luminanceBuffer, cl::Local(sizeof(float) * 4 * localSize), bloomGraph.sumBuffer);
+
+					graph.Record(library.GetKernel(DISCARD_PIXELS_BY_SUM_KERNEL), imageRange, cl::NullRange,
+					             input, scratchA, sampler, bloomGraph.sumBuffer);
+				}
+				else
+				{
+					graph.Record(discardPixels.GetKernel(), imageRange, cl::NullRange,
+					             input, scratchA, sampler, luminanceAverage);
+				}
+
+				GraphBinding blurred = scratchB;
+				if (buffers)
+				{
+					MemoryTag pixelTag("Pixel buffers");
+					bloomGraph.pixelBufferA = MakeBuffer(pool, CL_MEM_READ_WRITE, slot.width * slot.height * 4);
+					bloomGraph.pixelBufferB = MakeBuffer(pool, CL_MEM_READ_WRITE, slot.width * slot.height * 4);
+				}
+				else if (recursive)
+				{
+					MemoryTag recursiveTag("Recursive Gaussian");
+					bloomGraph.recursiveScratch = MakeBuffer(pool, CL_MEM_READ_WRITE, sizeof(cl_float4) * slot.width * slot.height);
+					bloomGraph.recursiveImage = MakeImage2D(pool, CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT),
+					                                        slot.width, slot.height);
+
+					graph.Record(recursiveColumnsKernel, cl::NDRange(slot.width), cl::NullRange,
+					             scratchA, bloomGraph.recursiveScratch, bloomGraph.recursiveImage, sampler, coefficients,
+					             slot.width, slot.height);
+					graph.Record(recursiveRowsKernel, cl::NDRange(slot.height), cl::NullRange,
+					             bloomGraph.recursiveImage, bloomGraph.recursiveScratch, scratchB, sampler, coefficients,
+					             slot.width, slot.height);
+				}
+				else if (separable)
+				{
+					graph.Record(separableKernel, RoundUpToTile(slot.width, slot.height, tileSize), tileSize,
+					             scratchA, scratchB, sampler, filterBuffer, filterSize);
+				}
+				else
+				{
+					// scratch[0] -> scratch[1] -> scratch[0]
+					graph.Record(horizontalKernel, imageRange, cl::NullRange,
+					             scratchA, scratchB, sampler, filterBuffer, filterSize, 1);
+					graph.Record(verticalKernel, imageRange, cl::NullRange,
+					             scratchB, scratchA, sampler, filterBuffer, filterSize, 0);
+					blurred = scratchA;
+				}
+				if (!buffers)
+				{
+					graph.Record(mergeImages.GetKernel(), imageRange, cl::NullRange,
+					             input, blurred, output, sampler);
+				}
+
+				std::cout << "Recorded " << graph.GetSize() << " launches for " << slot.width << "x" << slot.height
+				          << (graph.UsesCommandBuffers() ? " as command buffers" : " as a replay list") << std::endl;
+			}
+
+			cl::Event graphEvent;
+			bloomGraph.graph->Replay({slot.input, slot.scratch[0], slot.scratch[1], slot.output}, &waitList, &graphEvent);
+			profiler.Track("Bloom graph", graphEvent);
+
+			if (!buffers)
+			{
+				return graphEvent;
+			}
+
+			// The compute queue is in order, so the blur and merge follow the replay without waits
+			cl::size_t<3> origin;
+			cl::size_t<3> region;
+			region[0] = slot.width;
+			region[1] = slot.height;
+			region[2] = 1;
+			cl_int err = computeQueue.enqueueCopyImageToBuffer(slot.scratch[0], bloomGraph.pixelBufferA, origin, region, 0);
+			CheckErrorCode(err, "Unable to copy discarded pixels to pixel buffer");
+
+			bufferHorizontalConvolution(computeQueue, GetBufferRange(slot.width, slot.height), cl::NullRange,
+			                            bloomGraph.pixelBufferA, bloomGraph.pixelBufferB, filterBuffer, filterSize, 1,
+			                            slot.width, slot.height);
+			bufferVerticalConvolution(computeQueue, GetBufferRange(slot.width, slot.height), cl::NullRange,
+			                          bloomGraph.pixelBufferB, bloomGraph.pixelBufferA, filterBuffer, filterSize, 0,
+			                          slot.width, slot.height);
+
+			err = computeQueue.enqueueCopyBufferToImage(bloomGraph.pixelBufferA, slot.scratch[1], 0, origin, region);
+			CheckErrorCode(err, "Unable to copy pixel buffer to blurred image");
+
+			cl::Event mergeEvent;
+			mergeImages.Enqueue(computeQueue, cl::NDRange(slot.width, slot.height), cl::NullRange, nullptr, &mergeEvent,
+			                    slot.input, slot.scratch[1], slot.output, sampler);
+
+			return mergeEvent;
+		};
+
+		auto complete = [](StreamSlot& slot)
+		{
+			std::string outputFilename = OUTPUT_DIRECTORY "/Bloom_" + slot.name;
+			stbi_write_bmp(outputFilename.c_str(), slot.width, slot.height, 4, &slot.hostOutput[0]);
+			stbi_image_free(slot.hostInput);
+			std::cout << "Wrote " << outputFilename << std::endl;
+		};
+
+		auto startTime = std::chrono::steady_clock::now();
+
+		{
+			MemoryTag slotTag("Stream slots");
+			StreamingPipeline pipeline(context, device, pool, compute, complete, 2, 3, CL_QUEUE_PROFILING_ENABLE);
+			pipeline.SetProfiler(&profiler);
+
+			// Decoding the next image on the host overlaps the device work already in flight
+			for (auto& batchFileName : batchFileNames)
+			{
+				int w, h, n;
+				unsigned char* inputImage = stbi_load((directory + "/" + batchFileName).c_str(), &w, &h, &n, 4);
+				if (inputImage == nullptr)
+				{
+					std::cout << "Skipping " << batchFileName << ", unable to decode" << std::endl;
+					continue;
+				}
+
+				pipeline.Push(batchFileName, inputImage, w, h);
+			}
+
+			pipeline.Flush();
+		}
+
+		for (auto& entry : graphs)
+		{
+			pool.Release(entry.second.luminanceBuffer);
+			pool.Release(entry.second.sumBuffer);
+			pool.Release(entry.second.recursiveScratch);
+			pool.Release(entry.second.recursiveImage);
+			pool.Release(entry.second.pixelBufferA);
+			pool.Release(entry.second.pixelBufferB);
+		}
+
+		std::cout << "Processed " << batchFileNames.size() << " image(s) in "
+		          << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count()
+		          << " ms" << std::endl;
+
+		pool.Release(filterBuffer);
+		pool.PrintStats();
+		PrintMemoryReport(context);
+
+		profiler.PrintSummary();
+		profiler.WriteChromeTrace(OUTPUT_DIRECTORY "/BloomBatchTrace.json");
+
+		return 0;
+	}
+
 	// ==============================================================
 	//
 	// Create buffers for image data
@@ -109,86 +508,131 @@ int main()
 	// ==============================================================
 	int w, h, n;
 	unsigned char* inputImage = stbi_load(filename.c_str(), &w, &h, &n, 4);
-	unsigned char* outputImage = new unsigned char[w * h * 4];
+	// Readbacks are non-blocking, so every debug image gets its own host buffer
+	unsigned char* discardedImage = new unsigned char[w * h * 4];
+	unsigned char* onePassImage = new unsigned char[w * h * 4];
+	unsigned char* twoPassImage = new unsigned char[w * h * 4];
+	bool zeroCopy = UseZeroCopy(device);
+	unsigned char* bloomImage = zeroCopy ? nullptr : new unsigned char[w * h * 4];
+	// Each debug image is encoded on a host thread as soon as its readback lands
+	std::vector<std::future<void> > encodes;
 	cl::size_t<3> origin;
 	cl::size_t<3> region;
 	region[0] = w;
 	region[1] = h;
 	region[2] = 1;
 	cl::ImageFormat imageFormat(CL_RGBA, CL_UNORM_INT8);
-	cl::Sampler sampler = MakeSampler(context, CL_FALSE, CL_ADDRESS_CLAMP, CL_FILTER_NEAREST);
 
-	cl::Image2D imageBufferA = MakeImage2D(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-	                                       imageFormat, w, h, 0, inputImage);
+	// Zero-copy input wraps host memory, everything else lives on the device
+	size_t imageSize = w * h * 4;
+	std::vector<size_t> imageSizes(zeroCopy ? 2 : 3, imageSize);
+	if (!FitsInMemoryBudget(context, device, imageSizes))
+	{
+		throw std::runtime_error("A " + std::to_string(w) + "x" + std::to_string(h) + " image needs " +
+		                         std::to_string(imageSizes.size() * imageSize / (1024 * 1024)) + " MB of device memory, only " +
+		                         std::to_string(GetMemoryBudget(context, device) / (1024 * 1024)) + " MB available");
+	}
+	MemoryTag imageTag("Images");
+
+	// Zero-copy mode runs on the input in page-aligned host memory and
+	// encodes the bloom image from the mapped output instead of reading it back
+	unsigned char* hostImage = inputImage;
+	if (zeroCopy)
+	{
+		std::cout << "Using zero-copy host memory" << std::endl;
+		hostImage = static_cast<unsigned char*>(AllocateAligned(w * h * 4));
+		std::copy(inputImage, inputImage + w * h * 4, hostImage);
+	}
+
+	cl::Image2D imageBufferA = MakeImage2D(pool, CL_MEM_READ_WRITE | (zeroCopy ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR),
+	                                       imageFormat, w, h, hostImage);
+	if (zeroCopy)
+	{
+		FreeAlignedOnRelease(imageBufferA, hostImage);
+	}
 
 	//TODO: For some reason Intel doesn't allow not using host ptr, but NVIDIA does
 	//		Maybe something wrong with C++ interface
-	cl::Image2D imageBufferB = MakeImage2D(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-	                                       imageFormat, w, h, 0, inputImage);
-	cl::Image2D imageBufferC = MakeImage2D(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-	                                       imageFormat, w, h, 0, inputImage);
-
-	// ==============================================================
-	//
-	// Create buffer for filter data
-	//
-	// ==============================================================
-	std::unordered_map<int, const float*> filters;
-	filters.insert(std::make_pair(3, GaussianFilter3));
-	filters.insert(std::make_pair(5, GaussianFilter5));
-	filters.insert(std::make_pair(7, GaussianFilter7));
-	float* filter = const_cast<float*>(filters[filterSize]);;
-	cl::Buffer filterBuffer = MakeBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-	                                     sizeof(float) * filterSize, filter);
+	cl::Image2D imageBufferB = MakeImage2D(pool, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+	                                       imageFormat, w, h, inputImage);
+	cl::Image2D imageBufferC = MakeImage2D(pool, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | (zeroCopy ? CL_MEM_ALLOC_HOST_PTR : 0),
+	                                       imageFormat, w, h, inputImage);
 
 	// ==============================================================
 	//
 	// Find average luminance of input image
 	//
 	// ==============================================================
-	if (luminanceAverage == 0.0f)
+	if (luminanceAverage == 0.0f && !FitsInMemoryBudget(context, device, {sizeof(float) * w * h, sizeof(float)}))
+	{
+		// The host still has the input, which beats failing on the per-pixel luminance buffer
+		std::cout << "Luminance buffer does not fit in device memory, averaging on the host" << std::endl;
+		double luminanceSum = 0.0;
+		for (int i = 0; i < w * h; ++i)
+		{
+			luminanceSum += 0.299 * inputImage[i * 4] + 0.587 * inputImage[i * 4 + 1] + 0.114 * inputImage[i * 4 + 2];
+		}
+		luminanceAverage = static_cast<float>(luminanceSum / (w * h));
+	}
+	else if (luminanceAverage == 0.0f)
 	{
+		MemoryTag luminanceTag("Luminance");
+		LuminanceKernel luminance(library.GetKernel(LUMINANCE_KERNEL));
+		ReductionStepKernel reductionStep(library.GetKernel(REDUCTION_STEP_KERNEL));
+		ReductionCompleteKernel reductionComplete(library.GetKernel(REDUCTION_COMPLETE_KERNEL));
+		luminance.SetProfiler(&profiler);
+		reductionStep.SetProfiler(&profiler);
+		reductionComplete.SetProfiler(&profiler);
+		luminance.SetTuner(&tuner);
+
 		float luminanceSum;
-		cl::Buffer luminanceBuffer = MakeBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * w * h);
-		cl::Buffer sumBuffer = MakeBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float));
-		size_t localSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+		cl::Buffer luminanceBuffer = MakeBuffer(pool, CL_MEM_READ_WRITE, sizeof(float) * w * h);
+		cl::Buffer sumBuffer = MakeBuffer(pool, CL_MEM_WRITE_ONLY, sizeof(float));
+		size_t localSize = profile->maxWorkGroupSize;
 		size_t globalSize = (w * h) / 4;
 
-		err = kernels[LUMINANCE_KERNEL].setArg(0, imageBufferA);
-		err |= kernels[LUMINANCE_KERNEL].setArg(1, sampler);
-		err |= kernels[LUMINANCE_KERNEL].setArg(2, luminanceBuffer);
-		CheckErrorCode(err, "Unable to set luminance kernel arguments");
-
-		err = kernels[REDUCTION_STEP_KERNEL].setArg(0, luminanceBuffer);
-		err |= kernels[REDUCTION_STEP_KERNEL].setArg(1, sizeof(float) * 4 * localSize, nullptr);
-		CheckErrorCode(err, "Unable to set reduction step kernel arguments");
-
-		err = kernels[REDUCTION_COMPLETE_KERNEL].setArg(0, luminanceBuffer);
-		err |= kernels[REDUCTION_COMPLETE_KERNEL].setArg(1, sizeof(float) * 4 * localSize, nullptr);
-		err |= kernels[REDUCTION_COMPLETE_KERNEL].setArg(2, sumBuffer);
-		CheckErrorCode(err, "Unable to set reduction complete kernel arguments");
-
-		err = queue.enqueueNDRangeKernel(kernels[LUMINANCE_KERNEL], cl::NullRange, cl::NDRange(w, h));
-		CheckErrorCode(err, "Unable to enqueue luminance kernel");
+		scheduler.Submit({imageBufferA}, {luminanceBuffer}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			luminance.Enqueue(queue, cl::NDRange(w, h), cl::NullRange, events, event,
+			                  imageBufferA, sampler, luminanceBuffer);
+		});
 
-		err = queue.enqueueNDRangeKernel(kernels[REDUCTION_STEP_KERNEL], cl::NullRange, cl::NDRange(globalSize),
-		                                 cl::NDRange(localSize));
-		CheckErrorCode(err, "Unable to enqueue reduction step kernel");
+		scheduler.Submit({}, {luminanceBuffer}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			reductionStep.Enqueue(queue, cl::NDRange(globalSize), cl::NDRange(localSize), events, event,
+			                      luminanceBuffer, cl::Local(sizeof(float) * 4 * localSize));
+		});
 
 		while (globalSize / localSize > localSize)
 		{
 			globalSize = globalSize / localSize;
-			err = queue.enqueueNDRangeKernel(kernels[REDUCTION_STEP_KERNEL], cl::NullRange, cl::NDRange(globalSize),
-			                                 cl::NDRange(localSize));
-			CheckErrorCode(err, "Unable to enqueue reduction step kernel");
+			scheduler.Submit({}, {luminanceBuffer}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+			{
+				reductionStep.Enqueue(queue, cl::NDRange(globalSize), cl::NDRange(localSize), events, event,
+				                      luminanceBuffer, cl::Local(sizeof(float) * 4 * localSize));
+			});
 		}
 
 		globalSize = globalSize / localSize;
-		err = queue.enqueueNDRangeKernel(kernels[REDUCTION_COMPLETE_KERNEL], cl::NullRange, cl::NDRange(globalSize));
-		CheckErrorCode(err, "Unable to enqueue reduction complete kernel");
+		scheduler.Submit({luminanceBuffer}, {sumBuffer}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			reductionComplete.Enqueue(queue, cl::NDRange(globalSize), cl::NullRange, events, event,
+			                          luminanceBuffer, cl::Local(sizeof(float) * 4 * localSize), sumBuffer);
+		});
+
+		// The threshold is a kernel argument, so the host has to wait for this one value
+		cl::Event sumEvent = scheduler.Submit({sumBuffer}, {}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			err = queue.enqueueReadBuffer(sumBuffer, CL_FALSE, 0, sizeof(float), &luminanceSum, events, event);
+			CheckErrorCode(err, "Unable to read sum");
+		});
+		profiler.Track("Read luminance sum", sumEvent);
 
-		err = queue.enqueueReadBuffer(sumBuffer, CL_TRUE, 0, sizeof(float), &luminanceSum);
-		CheckErrorCode(err, "Unable to read sum");
+		err = sumEvent.wait();
+		CheckErrorCode(err, "Unable to wait for sum");
+
+		pool.Release(luminanceBuffer);
+		pool.Release(sumBuffer);
 
 		luminanceAverage = luminanceSum / (w * h);
 	}
@@ -200,78 +644,357 @@ int main()
 	// Discard pixels
 	//
 	// ==============================================================
-	err = kernels[DISCARD_PIXELS_KERNEL].setArg(0, imageBufferA);
-	err |= kernels[DISCARD_PIXELS_KERNEL].setArg(1, imageBufferB);
-	err |= kernels[DISCARD_PIXELS_KERNEL].setArg(2, sampler);
-	err |= kernels[DISCARD_PIXELS_KERNEL].setArg(3, luminanceAverage);
-	CheckErrorCode(err, "Unable to set discard pixels kernel arguments");
-
-	err = queue.enqueueNDRangeKernel(kernels[DISCARD_PIXELS_KERNEL], cl::NullRange, cl::NDRange(w, h));
-	CheckErrorCode(err, "Unable to enqueue discard pixels kernel");
-
-	err = queue.enqueueReadImage(imageBufferB, CL_TRUE, origin, region, 0, 0, outputImage);
-	CheckErrorCode(err, "Unable to read discarded pixels output image");
+	scheduler.Submit({imageBufferA}, {imageBufferB}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+	{
+		discardPixels.Enqueue(queue, cl::NDRange(w, h), cl::NullRange, events, event,
+		                      imageBufferA, imageBufferB, sampler, luminanceAverage);
+	});
 
-	stbi_write_bmp("Output/DiscardedPixelsImage.bmp", w, h, 4, outputImage);
+	cl::Event discardedRead = scheduler.Submit({imageBufferB}, {}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+	{
+		err = queue.enqueueReadImage(imageBufferB, CL_FALSE, origin, region, 0, 0, discardedImage, events, event);
+		CheckErrorCode(err, "Unable to read discarded pixels output image");
+	});
+	profiler.Track("Read discarded pixels", discardedRead);
+	encodes.push_back(ThenOnHost(discardedRead, [=]()
+	{
+		stbi_write_bmp("Output/DiscardedPixelsImage.bmp", w, h, 4, discardedImage);
+	}));
 
 	// ==============================================================
 	//
 	// Two pass gaussian blur
 	//
 	// ==============================================================
-	err = kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(0, imageBufferB);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(1, imageBufferA);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(2, sampler);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(3, filterBuffer);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(4, filterSize);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(5, 1);
-	CheckErrorCode(err, "Unable to set one pass convolution kernel arguments");
+	cl::Event onePassRead;
+	cl::Buffer pixelBufferA;
+	cl::Buffer pixelBufferB;
+	cl::Buffer recursiveScratch;
+	cl::Image2D recursiveImage;
+	if (recursive)
+	{
+		RecursiveGaussianKernel recursiveColumns(convolutionVariants.GetKernel(RECURSIVE_GAUSSIAN_COLUMNS_KERNEL,
+		                                         std::map<std::string, std::string>()));
+		RecursiveGaussianKernel recursiveRows(convolutionVariants.GetKernel(RECURSIVE_GAUSSIAN_ROWS_KERNEL,
+		                                      std::map<std::string, std::string>()));
+		recursiveColumns.SetProfiler(&profiler, "RecursiveGaussianColumns");
+		recursiveRows.SetProfiler(&profiler, "RecursiveGaussianRows");
+
+		std::vector<float> recursiveCoefficients = MakeRecursiveGaussianCoefficients(sigma);
+		cl_float4 coefficients = {};
+		std::copy(recursiveCoefficients.begin(), recursiveCoefficients.end(), coefficients.s);
+
+		// Columns into the float image, rows from it back into the discarded pixels
+		MemoryTag recursiveTag("Recursive Gaussian");
+		recursiveScratch = MakeBuffer(pool, CL_MEM_READ_WRITE, sizeof(cl_float4) * w * h);
+		recursiveImage = MakeImage2D(pool, CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), w, h);
+
+		scheduler.Submit({imageBufferB}, {recursiveScratch, recursiveImage}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			recursiveColumns.Enqueue(queue, cl::NDRange(w), cl::NullRange, events, event,
+			                         imageBufferB, recursiveScratch, recursiveImage, sampler, coefficients, w, h);
+		});
 
-	err = queue.enqueueNDRangeKernel(kernels[ONE_PASS_CONVOLUTION_KERNEL], cl::NullRange, cl::NDRange(w, h));
-	CheckErrorCode(err, "Unable to enqueue one pass convolution kernel");
+		scheduler.Submit({recursiveImage}, {recursiveScratch, imageBufferB}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			recursiveRows.Enqueue(queue, cl::NDRange(h), cl::NullRange, events, event,
+			                      recursiveImage, recursiveScratch, imageBufferB, sampler, coefficients, w, h);
+		});
+	}
+	else if (path == ConvolutionPath::Buffer)
+	{
+		BufferOnePassConvolutionKernel horizontalConvolution(convolutionVariants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+		                                                     MakeOnePassConvolutionDefines(filterSize, filter, 1)));
+		BufferOnePassConvolutionKernel verticalConvolution(convolutionVariants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+		                                                   MakeOnePassConvolutionDefines(filterSize, filter, 0)));
+		horizontalConvolution.SetProfiler(&profiler, "HorizontalConvolution");
+		verticalConvolution.SetProfiler(&profiler, "VerticalConvolution");
+
+		// The discarded pixels are copied in and out, the merge below still samples images
+		MemoryTag pixelTag("Pixel buffers");
+		pixelBufferA = MakeBuffer(pool, CL_MEM_READ_WRITE, w * h * 4);
+		pixelBufferB = MakeBuffer(pool, CL_MEM_READ_WRITE, w * h * 4);
+
+		scheduler.Submit({imageBufferB}, {pixelBufferA}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			err = queue.enqueueCopyImageToBuffer(imageBufferB, pixelBufferA, origin, region, 0, events, event);
+			CheckErrorCode(err, "Unable to copy discarded pixels to pixel buffer");
+		});
 
-	err = queue.enqueueReadImage(imageBufferA, CL_TRUE, origin, region, 0, 0, outputImage);
-	CheckErrorCode(err, "Unable to read discarded pixels output image");
+		scheduler.Submit({pixelBufferA, filterBuffer}, {pixelBufferB}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			horizontalConvolution.Enqueue(queue, GetBufferRange(w, h), cl::NullRange, events, event,
+			                              pixelBufferA, pixelBufferB, filterBuffer, filterSize, 1, w, h);
+		});
 
-	stbi_write_bmp("Output/OnePassBlurredImage.bmp", w, h, 4, outputImage);
+		onePassRead = scheduler.Submit({pixelBufferB}, {}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			err = queue.enqueueReadBuffer(pixelBufferB, CL_FALSE, 0, w * h * 4, onePassImage, events, event);
+			CheckErrorCode(err, "Unable to read one pass blurred pixels");
+		});
 
-	err = kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(0, imageBufferA);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(1, imageBufferB);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(5, 0);
-	CheckErrorCode(err, "Unable to set one pass convolution kernel arguments");
+		scheduler.Submit({pixelBufferB, filterBuffer}, {pixelBufferA}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			verticalConvolution.Enqueue(queue, GetBufferRange(w, h), cl::NullRange, events, event,
+			                            pixelBufferB, pixelBufferA, filterBuffer, filterSize, 0, w, h);
+		});
 
-	err = queue.enqueueNDRangeKernel(kernels[ONE_PASS_CONVOLUTION_KERNEL], cl::NullRange, cl::NDRange(w, h));
-	CheckErrorCode(err, "Unable to enqueue one pass convolution kernel");
+		scheduler.Submit({pixelBufferA}, {imageBufferB}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			err = queue.enqueueCopyBufferToImage(pixelBufferA, imageBufferB, 0, origin, region, events, event);
+			CheckErrorCode(err, "Unable to copy pixel buffer to blurred image");
+		});
+	}
+	else
+	{
+		OnePassConvolutionKernel horizontalConvolution(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                               MakeOnePassConvolutionDefines(filterSize, filter, 1)));
+		OnePassConvolutionKernel verticalConvolution(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                             MakeOnePassConvolutionDefines(filterSize, filter, 0)));
+		horizontalConvolution.SetProfiler(&profiler, "HorizontalConvolution");
+		verticalConvolution.SetProfiler(&profiler, "VerticalConvolution");
+		horizontalConvolution.SetTuner(&tuner);
+		verticalConvolution.SetTuner(&tuner);
+
+		scheduler.Submit({imageBufferB, filterBuffer}, {imageBufferA}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			horizontalConvolution.Enqueue(queue, cl::NDRange(w, h), cl::NullRange, events, event,
+			                              imageBufferB, imageBufferA, sampler, filterBuffer, filterSize, 1);
+		});
+
+		onePassRead = scheduler.Submit({imageBufferA}, {}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			err = queue.enqueueReadImage(imageBufferA, CL_FALSE, origin, region, 0, 0, onePassImage, events, event);
+			CheckErrorCode(err, "Unable to read one pass blurred image");
+		});
 
-	err = queue.enqueueReadImage(imageBufferB, CL_TRUE, origin, region, 0, 0, outputImage);
-	CheckErrorCode(err, "Unable to read output image buffer");
+		scheduler.Submit({imageBufferA, filterBuffer}, {imageBufferB}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			verticalConvolution.Enqueue(queue, cl::NDRange(w, h), cl::NullRange, events, event,
+			                            imageBufferA, imageBufferB, sampler, filterBuffer, filterSize, 0);
+		});
+	}
 
-	stbi_write_bmp("Output/TwoPassBlurredImage.bmp", w, h, 4, outputImage);
+	// The recursive Gaussian has no one pass image worth writing
+	if (!recursive)
+	{
+		profiler.Track("Read one pass blur", onePassRead);
+		encodes.push_back(ThenOnHost(onePassRead, [=]()
+		{
+			stbi_write_bmp("Output/OnePassBlurredImage.bmp", w, h, 4, onePassImage);
+		}));
+	}
+
+	cl::Event twoPassRead = scheduler.Submit({imageBufferB}, {}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+	{
+		err = queue.enqueueReadImage(imageBufferB, CL_FALSE, origin, region, 0, 0, twoPassImage, events, event);
+		CheckErrorCode(err, "Unable to read output image buffer");
+	});
+	profiler.Track("Read two pass blur", twoPassRead);
+	encodes.push_back(ThenOnHost(twoPassRead, [=]()
+	{
+		stbi_write_bmp("Output/TwoPassBlurredImage.bmp", w, h, 4, twoPassImage);
+	}));
 
 	// ==============================================================
 	//
 	// Merge original input image with two pass blurred image
 	//
 	// ==============================================================
-	err = queue.enqueueWriteImage(imageBufferA, CL_TRUE, origin, region, 0, 0, inputImage);
-	CheckErrorCode(err, "Unable to write image buffer A");
+	profiler.Track("Write input image", scheduler.Submit({}, {imageBufferA},
+	               [&](const std::vector<cl::Event>* events, cl::Event* event)
+	{
+		err = queue.enqueueWriteImage(imageBufferA, CL_FALSE, origin, region, 0, 0, inputImage, events, event);
+		CheckErrorCode(err, "Unable to write image buffer A");
+	}));
 
-	err = kernels[MERGE_IMAGES_KERNEL].setArg(0, imageBufferA);
-	err |= kernels[MERGE_IMAGES_KERNEL].setArg(1, imageBufferB);
-	err |= kernels[MERGE_IMAGES_KERNEL].setArg(2, imageBufferC);
-	err |= kernels[MERGE_IMAGES_KERNEL].setArg(3, sampler);
-	CheckErrorCode(err, "Unable to set merge images kernel arguments");
+	scheduler.Submit({imageBufferA, imageBufferB}, {imageBufferC}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+	{
+		mergeImages.Enqueue(queue, cl::NDRange(w, h), cl::NullRange, events, event,
+		                    imageBufferA, imageBufferB, imageBufferC, sampler);
+	});
 
-	err = queue.enqueueNDRangeKernel(kernels[MERGE_IMAGES_KERNEL], cl::NullRange, cl::NDRange(w, h));
-	CheckErrorCode(err, "Unable to enqueue merge images kernel");
+	if (!zeroCopy)
+	{
+		cl::Event bloomRead = scheduler.Submit({imageBufferC}, {}, [&](const std::vector<cl::Event>* events, cl::Event* event)
+		{
+			err = queue.enqueueReadImage(imageBufferC, CL_FALSE, origin, region, 0, 0, bloomImage, events, event);
+			CheckErrorCode(err, "Unable to read output image buffer");
+		});
+		profiler.Track("Read bloom image", bloomRead);
+		encodes.push_back(ThenOnHost(bloomRead, [=]()
+		{
+			stbi_write_bmp("Output/BloomImage.bmp", w, h, 4, bloomImage);
+		}));
+	}
 
-	err = queue.enqueueReadImage(imageBufferC, CL_TRUE, origin, region, 0, 0, outputImage);
-	CheckErrorCode(err, "Unable to read output image buffer");
+	scheduler.Finish();
 
-	stbi_write_bmp("Output/BloomImage.bmp", w, h, 4, outputImage);
+	if (zeroCopy)
+	{
+		std::vector<unsigned char> packed;
+		MappedMemory mapped(queue, imageBufferC, CL_MAP_READ);
+		stbi_write_bmp("Output/BloomImage.bmp", w, h, 4, mapped.GetPackedRows(w * 4, h, packed));
+	}
 
-	delete[] outputImage;
+	for (auto& encode : encodes)
+	{
+		encode.get();
+	}
+
+	pool.Release(filterBuffer);
+	pool.Release(imageBufferA);
+	pool.Release(imageBufferB);
+	pool.Release(imageBufferC);
+	pool.Release(pixelBufferA);
+	pool.Release(pixelBufferB);
+	pool.Release(recursiveScratch);
+	pool.Release(recursiveImage);
+	pool.PrintStats();
+	PrintMemoryReport(context);
+
+	profiler.PrintSummary();
+	profiler.WriteChromeTrace("Output/BloomTrace.json");
+
+	delete[] discardedImage;
+	delete[] onePassImage;
+	delete[] twoPassImage;
+	delete[] bloomImage;
 	stbi_image_free(inputImage);
 
 	return 0;
 }
+
+std::map<std::string, std::string> MakeOnePassConvolutionDefines(int filterSize, const float* filter, int horizontalPass)
+{
+	std::map<std::string, std::string> defines;
+	defines["FILTER_SIZE"] = std::to_string(filterSize);
+	if (filterSize <= MAX_BAKED_FILTER_SIZE)
+	{
+		defines["FILTER_WEIGHTS"] = MakeFloatList(filter, filterSize);
+	}
+	defines["HORIZONTAL_PASS"] = std::to_string(horizontalPass);
+	return defines;
+}
+
+std::map<std::string, std::string> MakeSeparableConvolutionDefines(int filterSize, const float* filter, const cl::NDRange& tileSize)
+{
+	std::map<std::string, std::string> defines;
+	defines["FILTER_SIZE"] = std::to_string(filterSize);
+	if (filterSize <= MAX_BAKED_FILTER_SIZE)
+	{
+		defines["FILTER_WEIGHTS"] = MakeFloatList(filter, filterSize);
+	}
+	defines["TILE_WIDTH"] = std::to_string(tileSize[0]);
+	defines["TILE_HEIGHT"] = std::to_string(tileSize[1]);
+	return defines;
+}
+
+cl::NDRange GetTileSize(const cl::Device& device)
+{
+	size_t height = std::min<size_t>(TILE_SIZE, GetDeviceProfile(device)->maxWorkGroupSize / TILE_SIZE);
+	return cl::NDRange(TILE_SIZE, std::max<size_t>(height, 1));
+}
+
+// The separable kernel keeps a column of rows per work-group in local memory,
+// which wide filters outgrow
+bool FitsSeparableConvolution(const cl::Device& device, int filterSize, const cl::NDRange& tileSize)
+{
+	size_t rows = tileSize[1] + filterSize - 1;
+	return rows * tileSize[0] * sizeof(cl_float4) <= GetDeviceProfile(device)->localMemSize;
+}
+
+cl::NDRange RoundUpToTile(int w, int h, const cl::NDRange& tileSize)
+{
+	return cl::NDRange((w + tileSize[0] - 1) / tileSize[0] * tileSize[0],
+	                   (h + tileSize[1] - 1) / tileSize[1] * tileSize[1]);
+}
+
+cl::NDRange GetBufferRange(int w, int h)
+{
+	return cl::NDRange((w + BUFFER_PIXELS - 1) / BUFFER_PIXELS, h);
+}
+
+// Times the two pass blur through images and through buffers on a test frame
+// and picks the faster, once per device and filter size
+ConvolutionPath ChooseConvolutionPath(const cl::Context& context, const cl::Device& device,
+                                      ProgramVariants& convolutionVariants, int filterSize, const float* filter)
+{
+	static std::map<std::pair<cl_device_id, int>, ConvolutionPath> choices;
+	auto choice = choices.find(std::make_pair(device(), filterSize));
+	if (choice != choices.end())
+	{
+		return choice->second;
+	}
+
+	cl::CommandQueue queue = MakeCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+	cl::Buffer filterBuffer = MakeBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+	                                     sizeof(float) * filterSize, const_cast<float*>(filter));
+
+	// Shortest time from the start of the first pass to the end of the second, after a warm-up run
+	auto timeRuns = [&](const std::function<void(cl::Event*, cl::Event*)>& enqueue)
+	{
+		cl_ulong best = 0;
+		for (auto run = 0; run <= PATH_RUNS; ++run)
+		{
+			cl::Event startEvent, finishEvent;
+			enqueue(&startEvent, &finishEvent);
+
+			cl_int err = queue.finish();
+			CheckErrorCode(err, "Unable to finish queue");
+
+			cl_ulong time = finishEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+			                startEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			if (run > 0 && (best == 0 || time < best))
+			{
+				best = time;
+			}
+		}
+
+		return best / 1000000.0;
+	};
+
+	double imageTime = 0.0;
+	if (GetDeviceProfile(device)->imageSupport)
+	{
+		cl::ImageFormat imageFormat(CL_RGBA, CL_UNORM_INT8);
+		cl::Sampler sampler = MakeSampler(context, CL_FALSE, CL_ADDRESS_CLAMP, CL_FILTER_NEAREST);
+		cl::Image2D imageA = MakeImage2D(context, CL_MEM_READ_WRITE, imageFormat, PATH_TEST_SIZE, PATH_TEST_SIZE);
+		cl::Image2D imageB = MakeImage2D(context, CL_MEM_READ_WRITE, imageFormat, PATH_TEST_SIZE, PATH_TEST_SIZE);
+		OnePassConvolutionKernel horizontalConvolution(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                               MakeOnePassConvolutionDefines(filterSize, filter, 1)));
+		OnePassConvolutionKernel verticalConvolution(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                             MakeOnePassConvolutionDefines(filterSize, filter, 0)));
+
+		imageTime = timeRuns([&](cl::Event* startEvent, cl::Event* finishEvent)
+		{
+			horizontalConvolution.Enqueue(queue, cl::NDRange(PATH_TEST_SIZE, PATH_TEST_SIZE), cl::NullRange, nullptr, startEvent,
+			                              imageA, imageB, sampler, filterBuffer, filterSize, 1);
+			verticalConvolution.Enqueue(queue, cl::NDRange(PATH_TEST_SIZE, PATH_TEST_SIZE), cl::NullRange, nullptr, finishEvent,
+			                            imageB, imageA, sampler, filterBuffer, filterSize, 0);
+		});
+	}
+
+	cl::Buffer bufferA = MakeBuffer(context, CL_MEM_READ_WRITE, PATH_TEST_SIZE * PATH_TEST_SIZE * 4);
+	cl::Buffer bufferB = MakeBuffer(context, CL_MEM_READ_WRITE, PATH_TEST_SIZE * PATH_TEST_SIZE * 4);
+	BufferOnePassConvolutionKernel bufferHorizontalConvolution(convolutionVariants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+	                                                           MakeOnePassConvolutionDefines(filterSize, filter, 1)));
+	BufferOnePassConvolutionKernel bufferVerticalConvolution(convolutionVariants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+	                                                         MakeOnePassConvolutionDefines(filterSize, filter, 0)));
+
+	double bufferTime = timeRuns([&](cl::Event* startEvent, cl::Event* finishEvent)
+	{
+		bufferHorizontalConvolution.Enqueue(queue, GetBufferRange(PATH_TEST_SIZE, PATH_TEST_SIZE), cl::NullRange, nullptr, startEvent,
+		                                    bufferA, bufferB, filterBuffer, filterSize, 1, PATH_TEST_SIZE, PATH_TEST_SIZE);
+		bufferVerticalConvolution.Enqueue(queue, GetBufferRange(PATH_TEST_SIZE, PATH_TEST_SIZE), cl::NullRange, nullptr, finishEvent,
+		                                  bufferB, bufferA, filterBuffer, filterSize, 0, PATH_TEST_SIZE, PATH_TEST_SIZE);
+	});
+
+	ConvolutionPath path = (imageTime > 0.0 && imageTime <= bufferTime) ? ConvolutionPath::Image : ConvolutionPath::Buffer;
+	choices[std::make_pair(device(), filterSize)] = path;
+
+	std::cout << GetDeviceProfile(device)->name << ": image path " << imageTime << " ms, buffer path " << bufferTime
+	          << " ms, using the " << (path == ConvolutionPath::Image ? "image" : "buffer") << " path" << std::endl;
+
+	return path;
+}
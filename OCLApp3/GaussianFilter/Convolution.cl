@@ -1,3 +1,60 @@
+// Compile-time specialisation (see ProgramVariants in OCLUtils.h)
+//   FILTER_SIZE       - filter width, replaces the filterSize argument so loops unroll
+//   FILTER_WEIGHTS    - 1D weights for OnePassConvolution, replaces the filter argument
+//   FILTER_WEIGHTS_2D - 2D weights for SimpleConvolution, replaces the filter argument
+//   HORIZONTAL_PASS   - pass direction for OnePassConvolution, replaces horizontalPass
+//   TILE_WIDTH        - work-group width of TiledConvolution and SeparableConvolution
+//   TILE_HEIGHT       - work-group height of TiledConvolution and SeparableConvolution
+// Specialised kernels keep the same arguments so the host sets them identically.
+// TiledConvolution and SeparableConvolution are only built when TILE_WIDTH and
+// TILE_HEIGHT are set, since their required work-group size may not fit the device,
+// and TiledConvolution only up to MAX_TILED_FILTER_SIZE, as its static tile would
+// outgrow local memory. The host only sets the tile for sizes that fit.
+#ifdef FILTER_SIZE
+#define FILTER_WIDTH FILTER_SIZE
+#else
+#define FILTER_WIDTH filterSize
+#endif
+
+#ifdef FILTER_WEIGHTS
+__constant float filterWeights[] = { FILTER_WEIGHTS };
+#define FILTER_WEIGHT(i) filterWeights[i]
+#else
+#define FILTER_WEIGHT(i) filter[i]
+#endif
+
+#ifdef FILTER_WEIGHTS_2D
+__constant float filterWeights2D[] = { FILTER_WEIGHTS_2D };
+#define FILTER_WEIGHT_2D(i) filterWeights2D[i]
+#else
+#define FILTER_WEIGHT_2D(i) filter[i]
+#endif
+
+#ifdef HORIZONTAL_PASS
+#define IS_HORIZONTAL_PASS HORIZONTAL_PASS
+#else
+#define IS_HORIZONTAL_PASS horizontalPass
+#endif
+
+// Largest filterSize the tiled kernels take when they aren't specialised
+#define MAX_TILED_FILTER_SIZE 15
+
+#if defined(TILE_WIDTH) && defined(TILE_HEIGHT)
+#define BUILD_SEPARABLE_CONVOLUTION
+#if !defined(FILTER_SIZE) || FILTER_SIZE <= MAX_TILED_FILTER_SIZE
+#define BUILD_TILED_CONVOLUTION
+#endif
+#endif
+
+// The tile holds the work-group's pixels plus a halo of half a filter on every side
+#ifdef FILTER_SIZE
+#define TILE_HALO (FILTER_SIZE / 2)
+#else
+#define TILE_HALO (MAX_TILED_FILTER_SIZE / 2)
+#endif
+#define TILE_STRIDE (TILE_WIDTH + 2 * TILE_HALO)
+#define TILE_ROWS (TILE_HEIGHT + 2 * TILE_HALO)
+
 __kernel
 void SimpleConvolution(__read_only image2d_t inputImage,
 					   __write_only image2d_t outputImage,
@@ -18,14 +75,20 @@ void SimpleConvolution(__read_only image2d_t inputImage,
 	int2 coord;
 	float4 pixel;
 
-	const int halfFilterSize = filterSize / 2;
+	const int halfFilterSize = FILTER_WIDTH / 2;
 
 	// Iterate over the rows
+#ifdef FILTER_SIZE
+	#pragma unroll
+#endif
 	for (int i = -(halfFilterSize); i <= halfFilterSize; i++)
 	{
 		coord.y = row + i;
 
 		// Iterate over the columns
+#ifdef FILTER_SIZE
+		#pragma unroll
+#endif
 		for (int j = -(halfFilterSize); j <= halfFilterSize; j++)
 		{
 			coord.x = column + j;
@@ -34,7 +97,7 @@ void SimpleConvolution(__read_only image2d_t inputImage,
 			pixel = read_imagef(inputImage, sampler, coord);
 
 			// Acculumate weighted sum
-			sum.xyz += pixel.xyz * filter[filterIndex++];
+			sum.xyz += pixel.xyz * FILTER_WEIGHT_2D(filterIndex++);
 			sum.w = 1.0f;
 		}
 	}
@@ -44,6 +107,82 @@ void SimpleConvolution(__read_only image2d_t inputImage,
 	write_imagef(outputImage, coord, sum);
 }
 
+#ifdef BUILD_TILED_CONVOLUTION
+// SimpleConvolution reading from a tile in local memory. The work-group loads
+// its pixels and the halo once, instead of every work-item reading its whole
+// window through the sampler. Must be launched with TILE_WIDTH x TILE_HEIGHT
+// work-groups, the global size rounded up to a multiple of that.
+__kernel
+__attribute__((reqd_work_group_size(TILE_WIDTH, TILE_HEIGHT, 1)))
+void TiledConvolution(__read_only image2d_t inputImage,
+					  __write_only image2d_t outputImage,
+					  sampler_t sampler,
+					  __constant float* filter,
+					  __private int filterSize)
+{
+	__local float4 tile[TILE_ROWS * TILE_STRIDE];
+
+	int localColumn = get_local_id(0);
+	int localRow = get_local_id(1);
+
+	// Image position of the tile's top left corner, halo included
+	int tileColumn = get_group_id(0) * TILE_WIDTH - TILE_HALO;
+	int tileRow = get_group_id(1) * TILE_HEIGHT - TILE_HALO;
+
+	// Load the tile cooperatively, the sampler handles pixels outside the image
+	for (int y = localRow; y < TILE_ROWS; y += TILE_HEIGHT)
+	{
+		for (int x = localColumn; x < TILE_STRIDE; x += TILE_WIDTH)
+		{
+			tile[y * TILE_STRIDE + x] = read_imagef(inputImage, sampler, (int2)(tileColumn + x, tileRow + y));
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int column = get_global_id(0);
+	int row = get_global_id(1);
+
+	// Work-items past the edge of the image only help with the load
+	if (column >= get_image_width(outputImage) || row >= get_image_height(outputImage))
+	{
+		return;
+	}
+
+	// Accumulated pixel value
+	float4 sum = (float4)(0.0f);
+
+	// Filter's current index
+	int filterIndex = 0;
+
+	const int halfFilterSize = FILTER_WIDTH / 2;
+
+	// Iterate over the rows
+#ifdef FILTER_SIZE
+	#pragma unroll
+#endif
+	for (int i = -(halfFilterSize); i <= halfFilterSize; i++)
+	{
+		int tileIndex = (TILE_HALO + localRow + i) * TILE_STRIDE + TILE_HALO + localColumn;
+
+		// Iterate over the columns
+#ifdef FILTER_SIZE
+		#pragma unroll
+#endif
+		for (int j = -(halfFilterSize); j <= halfFilterSize; j++)
+		{
+			// Acculumate weighted sum
+			sum.xyz += tile[tileIndex + j].xyz * FILTER_WEIGHT_2D(filterIndex++);
+		}
+	}
+
+	sum.w = 1.0f;
+
+	// Write new pixel value to output
+	write_imagef(outputImage, (int2)(column, row), sum);
+}
+#endif
+
 __kernel
 void OnePassConvolution(__read_only image2d_t inputImage,
 						__write_only image2d_t outputImage,
@@ -65,12 +204,15 @@ void OnePassConvolution(__read_only image2d_t inputImage,
 	int2 coord = (int2)(column, row);
 	float4 pixel;
 
-	const int halfFilterSize = filterSize / 2;
+	const int halfFilterSize = FILTER_WIDTH / 2;
 
 	// Iterate over the filter
+#ifdef FILTER_SIZE
+	#pragma unroll
+#endif
 	for (int i = -(halfFilterSize); i <= halfFilterSize; i++)
 	{
-		if (horizontalPass)
+		if (IS_HORIZONTAL_PASS)
 		{
 			coord.x = column + i;
 		}
@@ -83,7 +225,7 @@ void OnePassConvolution(__read_only image2d_t inputImage,
 		pixel = read_imagef(inputImage, sampler, coord);
 
 		// Acculumate weighted sum
-		sum.xyz += pixel.xyz * filter[filterIndex++];
+		sum.xyz += pixel.xyz * FILTER_WEIGHT(filterIndex++);
 		sum.w = 1.0f;
 	}
 
@@ -91,3 +233,293 @@ void OnePassConvolution(__read_only image2d_t inputImage,
 	coord = (int2)(column, row);
 	write_imagef(outputImage, coord, sum);
 }
+
+#ifdef BUILD_SEPARABLE_CONVOLUTION
+// Both passes of the two pass convolution in one launch. The work-group runs
+// the horizontal pass for its rows and the halo rows above and below, keeps
+// the results in local memory and runs the vertical pass from there, so the
+// intermediate image never goes through global memory. Launched like
+// TiledConvolution, with the 1D weights of OnePassConvolution.
+__kernel
+__attribute__((reqd_work_group_size(TILE_WIDTH, TILE_HEIGHT, 1)))
+void SeparableConvolution(__read_only image2d_t inputImage,
+						  __write_only image2d_t outputImage,
+						  sampler_t sampler,
+						  __constant float* filter,
+						  __private int filterSize)
+{
+	__local float4 rows[TILE_ROWS * TILE_WIDTH];
+
+	int localColumn = get_local_id(0);
+	int localRow = get_local_id(1);
+	int column = get_global_id(0);
+	int row = get_global_id(1);
+
+	// Image row of the first halo row
+	int tileRow = get_group_id(1) * TILE_HEIGHT - TILE_HALO;
+
+	const int halfFilterSize = FILTER_WIDTH / 2;
+
+	// Horizontal pass, rows outside the image come out black like the
+	// intermediate image's border does in the two pass version
+	for (int y = localRow; y < TILE_ROWS; y += TILE_HEIGHT)
+	{
+		float4 sum = (float4)(0.0f);
+		int filterIndex = 0;
+
+#ifdef FILTER_SIZE
+		#pragma unroll
+#endif
+		for (int i = -(halfFilterSize); i <= halfFilterSize; i++)
+		{
+			float4 pixel = read_imagef(inputImage, sampler, (int2)(column + i, tileRow + y));
+			sum.xyz += pixel.xyz * FILTER_WEIGHT(filterIndex++);
+		}
+
+		rows[y * TILE_WIDTH + localColumn] = sum;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Work-items past the edge of the image only help with the horizontal pass
+	if (column >= get_image_width(outputImage) || row >= get_image_height(outputImage))
+	{
+		return;
+	}
+
+	// Vertical pass from local memory
+	float4 sum = (float4)(0.0f);
+	int filterIndex = 0;
+
+#ifdef FILTER_SIZE
+	#pragma unroll
+#endif
+	for (int i = -(halfFilterSize); i <= halfFilterSize; i++)
+	{
+		sum.xyz += rows[(TILE_HALO + localRow + i) * TILE_WIDTH + localColumn].xyz * FILTER_WEIGHT(filterIndex++);
+	}
+
+	sum.w = 1.0f;
+
+	// Write new pixel value to output
+	write_imagef(outputImage, (int2)(column, row), sum);
+}
+#endif
+
+// Buffer path, for runtimes where images are emulated in software. Pixels are
+// RGBA8 in a plain buffer, row after row, and every work-item handles
+// BUFFER_PIXELS consecutive pixels of a row with vload16/vstore16. Pixels
+// outside the image read as zero, like the CL_ADDRESS_CLAMP sampler of the
+// image path.
+#define BUFFER_PIXELS 4
+
+// BUFFER_PIXELS pixels starting at (x, y), as 0-255 floats
+float16 LoadPixels(__global const uchar* image, int x, int y, int width, int height)
+{
+	if (y < 0 || y >= height)
+	{
+		return (float16)(0.0f);
+	}
+
+	if (x >= 0 && x + BUFFER_PIXELS <= width)
+	{
+		return convert_float16(vload16(0, image + (y * width + x) * 4));
+	}
+
+	// Partly outside the row, one pixel at a time
+	float4 pixels[BUFFER_PIXELS];
+	for (int i = 0; i < BUFFER_PIXELS; i++)
+	{
+		int column = x + i;
+		pixels[i] = (column >= 0 && column < width) ? convert_float4(vload4(y * width + column, image)) : (float4)(0.0f);
+	}
+
+	return (float16)(pixels[0], pixels[1], pixels[2], pixels[3]);
+}
+
+// Writes the pixels of sum that are inside the row, alpha opaque
+void StorePixels(float16 sum, __global uchar* image, int x, int y, int width)
+{
+	sum.s37bf = (float4)(255.0f);
+	uchar16 pixels = convert_uchar16_sat_rte(sum);
+
+	if (x + BUFFER_PIXELS <= width)
+	{
+		vstore16(pixels, 0, image + (y * width + x) * 4);
+		return;
+	}
+
+	uchar4 parts[BUFFER_PIXELS] = { pixels.s0123, pixels.s4567, pixels.s89ab, pixels.scdef };
+	for (int i = 0; x + i < width; i++)
+	{
+		vstore4(parts[i], y * width + x + i, image);
+	}
+}
+
+// SimpleConvolution on buffers, launched with ceil(width / BUFFER_PIXELS) x height work-items
+__kernel
+void BufferSimpleConvolution(__global const uchar* input,
+							 __global uchar* output,
+							 __constant float* filter,
+							 __private int filterSize,
+							 __private int width,
+							 __private int height)
+{
+	int x = get_global_id(0) * BUFFER_PIXELS;
+	int y = get_global_id(1);
+
+	if (x >= width || y >= height)
+	{
+		return;
+	}
+
+	float16 sum = (float16)(0.0f);
+	int filterIndex = 0;
+
+	const int halfFilterSize = FILTER_WIDTH / 2;
+
+#ifdef FILTER_SIZE
+	#pragma unroll
+#endif
+	for (int i = -(halfFilterSize); i <= halfFilterSize; i++)
+	{
+#ifdef FILTER_SIZE
+		#pragma unroll
+#endif
+		for (int j = -(halfFilterSize); j <= halfFilterSize; j++)
+		{
+			sum += LoadPixels(input, x + j, y + i, width, height) * FILTER_WEIGHT_2D(filterIndex++);
+		}
+	}
+
+	StorePixels(sum, output, x, y, width);
+}
+
+// OnePassConvolution on buffers, launched like BufferSimpleConvolution
+__kernel
+void BufferOnePassConvolution(__global const uchar* input,
+							  __global uchar* output,
+							  __constant float* filter,
+							  __private int filterSize,
+							  __private int horizontalPass,
+							  __private int width,
+							  __private int height)
+{
+	int x = get_global_id(0) * BUFFER_PIXELS;
+	int y = get_global_id(1);
+
+	if (x >= width || y >= height)
+	{
+		return;
+	}
+
+	float16 sum = (float16)(0.0f);
+	int filterIndex = 0;
+
+	const int halfFilterSize = FILTER_WIDTH / 2;
+
+#ifdef FILTER_SIZE
+	#pragma unroll
+#endif
+	for (int i = -(halfFilterSize); i <= halfFilterSize; i++)
+	{
+		float16 pixels;
+		if (IS_HORIZONTAL_PASS)
+		{
+			pixels = LoadPixels(input, x + i, y, width, height);
+		}
+		else
+		{
+			pixels = LoadPixels(input, x, y + i, width, height);
+		}
+
+		sum += pixels * FILTER_WEIGHT(filterIndex++);
+	}
+
+	StorePixels(sum, output, x, y, width);
+}
+
+// Young and van Vliet's recursive Gaussian, coefficients holds b, a1, a2 and a3
+// from MakeRecursiveGaussianCoefficients in Filters.h. Every work-item filters a
+// whole line forwards into scratch, then backwards out of it, so the work per
+// pixel doesn't depend on sigma. Pixels outside the image count as zero, as with
+// CLK_ADDRESS_CLAMP in the convolution kernels.
+
+// Vertical pass, launched with one work-item per column. Neighbouring work-items
+// use neighbouring scratch elements. The result goes to a float image so the
+// horizontal pass starts from unrounded values.
+__kernel
+void RecursiveGaussianColumns(__read_only image2d_t inputImage,
+							  __global float4* scratch,
+							  __write_only image2d_t outputImage,
+							  sampler_t sampler,
+							  __private float4 coefficients,
+							  __private int width,
+							  __private int height)
+{
+	int column = get_global_id(0);
+	float4 y0;
+	float4 y1 = (float4)(0.0f);
+	float4 y2 = (float4)(0.0f);
+	float4 y3 = (float4)(0.0f);
+
+	for (int row = 0; row < height; row++)
+	{
+		float4 pixel = read_imagef(inputImage, sampler, (int2)(column, row));
+		y0 = coefficients.x * pixel + coefficients.y * y1 + coefficients.z * y2 + coefficients.w * y3;
+		scratch[row * width + column] = y0;
+		y3 = y2;
+		y2 = y1;
+		y1 = y0;
+	}
+
+	y1 = y2 = y3 = (float4)(0.0f);
+
+	for (int row = height - 1; row >= 0; row--)
+	{
+		y0 = coefficients.x * scratch[row * width + column] + coefficients.y * y1 + coefficients.z * y2 + coefficients.w * y3;
+		write_imagef(outputImage, (int2)(column, row), y0);
+		y3 = y2;
+		y2 = y1;
+		y1 = y0;
+	}
+}
+
+// Horizontal pass, launched with one work-item per row. Scratch is stored column
+// after column, so neighbouring work-items still use neighbouring elements.
+__kernel
+void RecursiveGaussianRows(__read_only image2d_t inputImage,
+						   __global float4* scratch,
+						   __write_only image2d_t outputImage,
+						   sampler_t sampler,
+						   __private float4 coefficients,
+						   __private int width,
+						   __private int height)
+{
+	int row = get_global_id(0);
+	float4 y0;
+	float4 y1 = (float4)(0.0f);
+	float4 y2 = (float4)(0.0f);
+	float4 y3 = (float4)(0.0f);
+
+	for (int column = 0; column < width; column++)
+	{
+		float4 pixel = read_imagef(inputImage, sampler, (int2)(column, row));
+		y0 = coefficients.x * pixel + coefficients.y * y1 + coefficients.z * y2 + coefficients.w * y3;
+		scratch[column * height + row] = y0;
+		y3 = y2;
+		y2 = y1;
+		y1 = y0;
+	}
+
+	y1 = y2 = y3 = (float4)(0.0f);
+
+	for (int column = width - 1; column >= 0; column--)
+	{
+		y0 = coefficients.x * scratch[column * height + row] + coefficients.y * y1 + coefficients.z * y2 + coefficients.w * y3;
+		write_imagef(outputImage, (int2)(column, row), (float4)(y0.xyz, 1.0f));
+		y3 = y2;
+		y2 = y1;
+		y1 = y0;
+	}
+}
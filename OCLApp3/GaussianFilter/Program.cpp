@@ -1,6 +1,10 @@
 #include <iostream>
 #include <fstream>
 #include <unordered_map>
+#include <map>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
 
 #include <CL/cl.hpp>
 
@@ -12,18 +16,93 @@
 #include "OCLUtils.h"
 #include "Filters.h"
 
+// Kernel sources embedded at build time by EmbedKernel.ps1
+#include "Convolution.cl.h"
+
 #define CL_FILENAME "Convolution.cl"
 
 #define INPUT_IMAGE_FILENAME "Input/bunnycity1.bmp"
+#define INPUT_DIRECTORY "Input"
+#define OUTPUT_DIRECTORY "Output"
 
 #define SIMPLE_CONVOLUTION_KERNEL "SimpleConvolution"
 #define ONE_PASS_CONVOLUTION_KERNEL "OnePassConvolution"
+#define TILED_CONVOLUTION_KERNEL "TiledConvolution"
+#define SEPARABLE_CONVOLUTION_KERNEL "SeparableConvolution"
+#define BUFFER_SIMPLE_CONVOLUTION_KERNEL "BufferSimpleConvolution"
+#define BUFFER_ONE_PASS_CONVOLUTION_KERNEL "BufferOnePassConvolution"
+#define RECURSIVE_GAUSSIAN_COLUMNS_KERNEL "RecursiveGaussianColumns"
+#define RECURSIVE_GAUSSIAN_ROWS_KERNEL "RecursiveGaussianRows"
+
+// Tiled kernels' work-groups are TILE_SIZE wide and as tall as the device allows, up to TILE_SIZE
+#define TILE_SIZE 16
+#define MAX_TILED_FILTER_SIZE 15
+#define TILED_RUNS 100
+
+// Buffer kernels handle BUFFER_PIXELS pixels of a row per work-item
+#define BUFFER_PIXELS 4
+
+// Test frame the image and buffer paths are timed on
+#define PATH_TEST_SIZE 1024
+#define PATH_RUNS 5
+
+#define SPLIT_RUNS 5
+
+// Launches per sigma when timing the recursive Gaussian against the two pass convolution
+#define RECURSIVE_RUNS 20
 
 #define VENDOR_INTEL "Intel"
 #define VENDOR_AMD "Advanced Micro Devices"
 #define VENDOR_NVIDIA "NVIDIA"
 #define SELECTED_VENDOR VENDOR_INTEL
 
+// inputImage, outputImage, sampler, filter, filterSize
+// Also used for TiledConvolution and SeparableConvolution, which take the same arguments
+typedef KernelFunctor<cl::Image2D, cl::Image2D, cl::Sampler, cl::Buffer, int> SimpleConvolutionKernel;
+// inputImage, outputImage, sampler, filter, filterSize, horizontalPass
+typedef KernelFunctor<cl::Image2D, cl::Image2D, cl::Sampler, cl::Buffer, int, int> OnePassConvolutionKernel;
+// input, output, filter, filterSize, width, height
+typedef KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, int, int, int> BufferSimpleConvolutionKernel;
+// input, output, filter, filterSize, horizontalPass, width, height
+typedef KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, int, int, int, int> BufferOnePassConvolutionKernel;
+// inputImage, scratch, outputImage, sampler, coefficients, width, height
+typedef KernelFunctor<cl::Image2D, cl::Buffer, cl::Image2D, cl::Sampler, cl_float4, int, int> RecursiveGaussianKernel;
+
+// Where a device runs the convolutions, images and samplers are emulated on some CPU runtimes
+enum class ConvolutionPath
+{
+	Image,
+	Buffer
+};
+
+std::map<std::string, std::string> MakeSimpleConvolutionDefines(int filterSize, const float* filter);
+std::map<std::string, std::string> MakeOnePassConvolutionDefines(int filterSize, const float* filter, int horizontalPass);
+std::map<std::string, std::string> MakeTiledConvolutionDefines(int filterSize, const float* filter, const cl::NDRange& tileSize);
+std::map<std::string, std::string> MakeSeparableConvolutionDefines(int filterSize, const float* filter, const cl::NDRange& tileSize);
+cl::NDRange GetTileSize(const cl::Device& device);
+bool FitsSeparableConvolution(const cl::Device& device, int filterSize, const cl::NDRange& tileSize);
+cl::NDRange GetBufferRange(int w, int h);
+ConvolutionPath ChooseConvolutionPath(const cl::Context& context, const cl::Device& device,
+                                      ProgramVariants& convolutionVariants, int filterSize, const float* filter);
+cl::NDRange RoundUpToTile(int w, int h, const cl::NDRange& tileSize);
+void CompareTiledConvolution(const cl::Context& context, const cl::Device& device, const cl::CommandQueue& queue,
+                             ProgramVariants& convolutionVariants, const cl::Image2D& inputImage, const cl::Sampler& sampler,
+                             int w, int h);
+void EnqueueRecursiveGaussian(const cl::CommandQueue& queue, RecursiveGaussianKernel& columns, RecursiveGaussianKernel& rows,
+                              const cl::Image2D& inputImage, const cl::Buffer& scratch, const cl::Image2D& intermediateImage,
+                              const cl::Image2D& outputImage, const cl::Sampler& sampler, float sigma, int w, int h,
+                              const std::vector<cl::Event>* events, cl::Event* startEvent, cl::Event* finishEvent);
+void CompareRecursiveGaussian(const cl::Context& context, const cl::CommandQueue& queue,
+                              ProgramVariants& convolutionVariants, const cl::Image2D& inputImage, const cl::Sampler& sampler,
+                              int w, int h);
+void BlurBatch(const cl::Context& context, const cl::Device& device, MemoryPool& pool,
+               ProgramVariants& convolutionVariants, ConvolutionPath path, float sigma, int filterSize, const float* filter);
+void BlurAcrossDevices(const std::vector<cl::Device>& devices, const unsigned char* inputImage, int w, int h,
+                       int filterSize, const float* filter);
+void SaveImage(const cl::CommandQueue& queue, const cl::Image2D& image, int w, int h,
+               const char* filename, bool zeroCopy, unsigned char* outputImage);
+void SaveBuffer(const cl::CommandQueue& queue, const cl::Buffer& buffer, int w, int h, const char* filename);
+
 int main()
 {
 	cl_int err;
@@ -36,26 +115,114 @@ int main()
 	cl::Device device = GetDevice(SELECTED_VENDOR);
 	cl::Context context = MakeContext(device);
 	cl::CommandQueue queue = MakeCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+	MemoryPool pool(context, queue);
 
+	// Convolution kernels are specialised per filter size and pass direction
 	std::vector<const char*> sourceFileNames;
 	sourceFileNames.push_back(CL_FILENAME);
-	cl::Program program = MakeAndBuildProgram(sourceFileNames, context, device);
+	ProgramVariants convolutionVariants(sourceFileNames, context, device);
 
-	std::unordered_map<std::string, cl::Kernel> kernels = MakeKernels(program);
+	// Convolution launches use tuned local sizes instead of cl::NullRange
+	WorkGroupTuner tuner;
 
 	// ==============================================================
 	//
 	// Handle user input
 	//
 	// ==============================================================
-	int filterSize = 7;
-	std::cout << "Gaussian filter window size? (3/5/7)" << std::endl;
-	std::cin >> filterSize;
-	while (filterSize != 3 && filterSize != 5 && filterSize != 7)
+	float sigma = 1.0f;
+	std::cout << "Gaussian sigma? (0.5-50)" << std::endl;
+	std::cin >> sigma;
+	while (!(sigma >= MIN_GAUSSIAN_SIGMA && sigma <= MAX_GAUSSIAN_SIGMA))
 	{
 		std::cout << "Invalid input. Try again." << std::endl;
-		std::cout << "Gaussian filter window size? (3/5/7)" << std::endl;
-		std::cin >> filterSize;
+		std::cout << "Gaussian sigma? (0.5-50)" << std::endl;
+		std::cin >> sigma;
+	}
+
+	char input;
+	std::cout << "Blur every image in " INPUT_DIRECTORY "/ instead of profiling? (y/n)" << std::endl;
+	std::cin >> input;
+	while (input != 'y' && input != 'n')
+	{
+		std::cout << "Invalid input. Try again." << std::endl;
+		std::cout << "Blur every image in " INPUT_DIRECTORY "/ instead of profiling? (y/n)" << std::endl;
+		std::cin >> input;
+	}
+
+	char tiled = 'n';
+	// The comparisons sweep every filter size, which takes a while
+	char compare = 'n';
+	if (input == 'n')
+	{
+		std::cout << "Use the local memory tiled kernel for the simple blur? (y/n)" << std::endl;
+		std::cin >> tiled;
+		while (tiled != 'y' && tiled != 'n')
+		{
+			std::cout << "Invalid input. Try again." << std::endl;
+			std::cout << "Use the local memory tiled kernel for the simple blur? (y/n)" << std::endl;
+			std::cin >> tiled;
+		}
+
+		std::cout << "Compare the tiled and recursive kernels against the simple and two pass ones? (y/n)" << std::endl;
+		std::cin >> compare;
+		while (compare != 'y' && compare != 'n')
+		{
+			std::cout << "Invalid input. Try again." << std::endl;
+			std::cout << "Compare the tiled and recursive kernels against the simple and two pass ones? (y/n)" << std::endl;
+			std::cin >> compare;
+		}
+	}
+
+	// ==============================================================
+	//
+	// Create buffer for filter data
+	//
+	// ==============================================================
+	std::unordered_map<int, const float*> filters;
+	filters.insert(std::make_pair(3, GaussianFilter3));
+	filters.insert(std::make_pair(5, GaussianFilter5));
+	filters.insert(std::make_pair(7, GaussianFilter7));
+	filters.insert(std::make_pair(9, GaussianFilter3x3));
+	filters.insert(std::make_pair(25, GaussianFilter5x5));
+	filters.insert(std::make_pair(49, GaussianFilter7x7));
+
+	// Weights for the chosen sigma, the tables above are for profiling.
+	// The 2D kernels only take windows up to MAX_TILED_FILTER_SIZE.
+	int filterSize = 2 * GetGaussianRadius(sigma) + 1;
+	std::vector<float> filter1D = MakeGaussianFilter(sigma, filterSize / 2);
+	std::vector<float> filter2D;
+	if (filterSize <= MAX_TILED_FILTER_SIZE)
+	{
+		filter2D = MakeGaussianFilter2D(sigma, filterSize / 2);
+	}
+	std::cout << "Sigma " << sigma << " uses a " << filterSize << "x" << filterSize << " window" << std::endl;
+	int recursiveRadius = GetRecursiveGaussianRadius();
+	bool recursive = UseRecursiveGaussian(sigma, recursiveRadius);
+	if (recursive)
+	{
+		std::cout << "Radius is above " << recursiveRadius << ", batch and two pass blurs use the recursive Gaussian" << std::endl;
+	}
+
+	// Image or buffer kernels, whichever ran the two pass blur faster on this device.
+	// The recursive Gaussian has one path only, so the convolutions aren't timed for it.
+	ConvolutionPath path = ConvolutionPath::Image;
+	if (!recursive)
+	{
+		path = ChooseConvolutionPath(context, device, convolutionVariants, filterSize, &filter1D[0]);
+	}
+
+	// ==============================================================
+	//
+	// Batch separable gaussian blur
+	//
+	// ==============================================================
+	if (input == 'y')
+	{
+		BlurBatch(context, device, pool, convolutionVariants, path, sigma, filterSize, &filter1D[0]);
+		pool.PrintStats();
+		PrintMemoryReport(context);
+		return 0;
 	}
 
 	// ==============================================================
@@ -65,7 +232,8 @@ int main()
 	// ==============================================================
 	int w, h, n;
 	unsigned char* inputImage = stbi_load(INPUT_IMAGE_FILENAME, &w, &h, &n, 4);
-	unsigned char* outputImage = new unsigned char[w * h * 4];
+	bool zeroCopy = UseZeroCopy(device);
+	unsigned char* outputImage = zeroCopy ? nullptr : new unsigned char[w * h * 4];
 	cl::size_t<3> origin;
 	cl::size_t<3> region;
 	region[0] = w;
@@ -74,97 +242,247 @@ int main()
 	cl::ImageFormat imageFormat(CL_RGBA, CL_UNORM_INT8);
 	cl::Sampler sampler = MakeSampler(context, CL_FALSE, CL_ADDRESS_CLAMP, CL_FILTER_NEAREST);
 
-	cl::Image2D imageBufferA = MakeImage2D(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-	                                       imageFormat, w, h, 0, inputImage);
+	// Zero-copy mode runs on the input in page-aligned host memory and
+	// encodes results from mapped images instead of reading them back
+	unsigned char* hostImage = inputImage;
+	if (zeroCopy)
+	{
+		std::cout << "Using zero-copy host memory" << std::endl;
+		hostImage = static_cast<unsigned char*>(AllocateAligned(w * h * 4));
+		std::copy(inputImage, inputImage + w * h * 4, hostImage);
+	}
+
+	cl::Image2D imageBufferA = MakeImage2D(pool, CL_MEM_READ_WRITE | (zeroCopy ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR),
+	                                       imageFormat, w, h, hostImage);
+	if (zeroCopy)
+	{
+		FreeAlignedOnRelease(imageBufferA, hostImage);
+	}
 
 	//TODO: For some reason Intel doesn't allow not using host ptr, but NVIDIA does
 	//		Maybe something wrong with C++ interface
-	cl::Image2D imageBufferB = MakeImage2D(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-	                                       imageFormat, w, h, 0, inputImage);
+	cl::Image2D imageBufferB = MakeImage2D(pool, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | (zeroCopy ? CL_MEM_ALLOC_HOST_PTR : 0),
+	                                       imageFormat, w, h, inputImage);
 
-	// ==============================================================
-	//
-	// Create buffer for filter data
-	//
-	// ==============================================================
-	std::unordered_map<int, const float*> filters;
-	filters.insert(std::make_pair(3, GaussianFilter3));
-	filters.insert(std::make_pair(5, GaussianFilter5));
-	filters.insert(std::make_pair(7, GaussianFilter7));
-	filters.insert(std::make_pair(9, GaussianFilter3x3));
-	filters.insert(std::make_pair(25, GaussianFilter5x5));
-	filters.insert(std::make_pair(49, GaussianFilter7x7));
+	// The simple and two pass blurs go through these on devices where buffers measured faster
+	cl::Buffer pixelBufferA;
+	cl::Buffer pixelBufferB;
+	if (path == ConvolutionPath::Buffer)
+	{
+		pixelBufferA = MakeBuffer(pool, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, w * h * 4, inputImage);
+		pixelBufferB = MakeBuffer(pool, CL_MEM_READ_WRITE, w * h * 4);
+	}
 
 	// ==============================================================
 	//
 	// Simple gaussian blur
 	//
 	// ==============================================================
-	float* filter = const_cast<float*>(filters[filterSize * filterSize]);
-	cl::Buffer filterBuffer = MakeBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-	                                     sizeof(float) * filterSize * filterSize, filter);
+	float* filter = nullptr;
+	cl::Buffer filterBuffer;
+	SimpleConvolutionKernel simpleConvolution;
 
-	err = kernels[SIMPLE_CONVOLUTION_KERNEL].setArg(0, imageBufferA);
-	err |= kernels[SIMPLE_CONVOLUTION_KERNEL].setArg(1, imageBufferB);
-	err |= kernels[SIMPLE_CONVOLUTION_KERNEL].setArg(2, sampler);
-	err |= kernels[SIMPLE_CONVOLUTION_KERNEL].setArg(3, filterBuffer);
-	err |= kernels[SIMPLE_CONVOLUTION_KERNEL].setArg(4, filterSize);
-	CheckErrorCode(err, "Unable to set simple convolution kernel arguments");
+	if (filter2D.empty())
+	{
+		std::cout << "Skipping the simple blur, the 2D kernels take windows up to "
+		          << MAX_TILED_FILTER_SIZE << "x" << MAX_TILED_FILTER_SIZE << std::endl;
+	}
+	else
+	{
+		filter = &filter2D[0];
+		filterBuffer = MakeBuffer(pool, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		                          sizeof(float) * filterSize * filterSize, filter);
 
-	err = queue.enqueueNDRangeKernel(kernels[SIMPLE_CONVOLUTION_KERNEL], cl::NullRange, cl::NDRange(w, h));
-	CheckErrorCode(err, "Unable to enqueue simple convolution kernel");
+		if (path == ConvolutionPath::Buffer)
+		{
+			BufferSimpleConvolutionKernel bufferSimpleConvolution(convolutionVariants.GetKernel(BUFFER_SIMPLE_CONVOLUTION_KERNEL,
+			                                                      MakeSimpleConvolutionDefines(filterSize, filter)));
 
-	err = queue.enqueueReadImage(imageBufferB, CL_TRUE, origin, region, 0, 0, outputImage);
-	CheckErrorCode(err, "Unable to read output image buffer");
+			bufferSimpleConvolution(queue, GetBufferRange(w, h), cl::NullRange,
+			                        pixelBufferA, pixelBufferB, filterBuffer, filterSize, w, h);
+
+			SaveBuffer(queue, pixelBufferB, w, h, "Output/SimpleBlurImage.bmp");
+		}
+		else
+		{
+			if (tiled == 'y')
+			{
+				// Same arguments, but the work-group size is fixed by the tile
+				cl::NDRange tileSize = GetTileSize(device);
+				SimpleConvolutionKernel tiledConvolution(convolutionVariants.GetKernel(TILED_CONVOLUTION_KERNEL,
+				                                         MakeTiledConvolutionDefines(filterSize, filter, tileSize)));
+
+				tiledConvolution(queue, RoundUpToTile(w, h, tileSize), tileSize,
+				                 imageBufferA, imageBufferB, sampler, filterBuffer, filterSize);
+			}
+			else
+			{
+				simpleConvolution = SimpleConvolutionKernel(convolutionVariants.GetKernel(SIMPLE_CONVOLUTION_KERNEL,
+				                                            MakeSimpleConvolutionDefines(filterSize, filter)));
+				simpleConvolution.SetTuner(&tuner);
+
+				simpleConvolution(queue, cl::NDRange(w, h), cl::NullRange,
+				                  imageBufferA, imageBufferB, sampler, filterBuffer, filterSize);
+			}
 
-	stbi_write_bmp("Output/SimpleBlurImage.bmp", w, h, 4, outputImage);
+			SaveImage(queue, imageBufferB, w, h, "Output/SimpleBlurImage.bmp", zeroCopy, outputImage);
+		}
+
+		pool.Release(filterBuffer);
+	}
 
 	// ==============================================================
 	//
 	// Two pass gaussian blur
 	//
 	// ==============================================================
-	filter = const_cast<float*>(filters[filterSize]);
-	filterBuffer = MakeBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+	filter = &filter1D[0];
+	filterBuffer = MakeBuffer(pool, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
 	                          sizeof(float) * filterSize, filter);
 
-	err = kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(0, imageBufferA);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(1, imageBufferB);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(2, sampler);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(3, filterBuffer);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(4, filterSize);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(5, 1);
-	CheckErrorCode(err, "Unable to set one pass convolution kernel arguments");
+	OnePassConvolutionKernel horizontalConvolution;
+	OnePassConvolutionKernel verticalConvolution;
+
+	if (recursive)
+	{
+		std::cout << "Skipping the two pass convolution, the recursive Gaussian below writes its image" << std::endl;
+	}
+	else if (path == ConvolutionPath::Buffer)
+	{
+		BufferOnePassConvolutionKernel bufferHorizontalConvolution(convolutionVariants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+		                                                           MakeOnePassConvolutionDefines(filterSize, filter, 1)));
+		BufferOnePassConvolutionKernel bufferVerticalConvolution(convolutionVariants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+		                                                         MakeOnePassConvolutionDefines(filterSize, filter, 0)));
+
+		bufferHorizontalConvolution(queue, GetBufferRange(w, h), cl::NullRange,
+		                            pixelBufferA, pixelBufferB, filterBuffer, filterSize, 1, w, h);
+
+		SaveBuffer(queue, pixelBufferB, w, h, "Output/OnePassBlurredImage.bmp");
 
-	err = queue.enqueueNDRangeKernel(kernels[ONE_PASS_CONVOLUTION_KERNEL], cl::NullRange, cl::NDRange(w, h));
-	CheckErrorCode(err, "Unable to enqueue one pass convolution kernel");
+		bufferVerticalConvolution(queue, GetBufferRange(w, h), cl::NullRange,
+		                          pixelBufferB, pixelBufferA, filterBuffer, filterSize, 0, w, h);
 
-	err = queue.enqueueReadImage(imageBufferB, CL_TRUE, origin, region, 0, 0, outputImage);
-	CheckErrorCode(err, "Unable to read discarded pixels output image");
+		SaveBuffer(queue, pixelBufferA, w, h, "Output/TwoPassBlurredImage.bmp");
+	}
+	else
+	{
+		horizontalConvolution = OnePassConvolutionKernel(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                                 MakeOnePassConvolutionDefines(filterSize, filter, 1)));
+		verticalConvolution = OnePassConvolutionKernel(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                               MakeOnePassConvolutionDefines(filterSize, filter, 0)));
+		horizontalConvolution.SetTuner(&tuner);
+		verticalConvolution.SetTuner(&tuner);
 
-	stbi_write_bmp("Output/OnePassBlurredImage.bmp", w, h, 4, outputImage);
+		horizontalConvolution(queue, cl::NDRange(w, h), cl::NullRange,
+		                      imageBufferA, imageBufferB, sampler, filterBuffer, filterSize, 1);
 
-	err = kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(0, imageBufferB);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(1, imageBufferA);
-	err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(5, 0);
-	CheckErrorCode(err, "Unable to set one pass convolution kernel arguments");
+		SaveImage(queue, imageBufferB, w, h, "Output/OnePassBlurredImage.bmp", zeroCopy, outputImage);
 
-	err = queue.enqueueNDRangeKernel(kernels[ONE_PASS_CONVOLUTION_KERNEL], cl::NullRange, cl::NDRange(w, h));
-	CheckErrorCode(err, "Unable to enqueue one pass convolution kernel");
+		verticalConvolution(queue, cl::NDRange(w, h), cl::NullRange,
+		                    imageBufferB, imageBufferA, sampler, filterBuffer, filterSize, 0);
 
-	err = queue.enqueueReadImage(imageBufferA, CL_TRUE, origin, region, 0, 0, outputImage);
-	CheckErrorCode(err, "Unable to read output image buffer");
+		SaveImage(queue, imageBufferA, w, h, "Output/TwoPassBlurredImage.bmp", zeroCopy, outputImage);
 
-	stbi_write_bmp("Output/TwoPassBlurredImage.bmp", w, h, 4, outputImage);
+		err = queue.enqueueWriteImage(imageBufferA, CL_TRUE, origin, region, 0, 0, inputImage);
+		CheckErrorCode(err, "Unable to write image buffer A");
+	}
 
-	err = queue.enqueueWriteImage(imageBufferA, CL_TRUE, origin, region, 0, 0, inputImage);
-	CheckErrorCode(err, "Unable to write image buffer A");
+	pool.Release(pixelBufferA);
+	pool.Release(pixelBufferB);
+
+	// ==============================================================
+	//
+	// Fused separable gaussian blur, both passes in one launch
+	//
+	// ==============================================================
+	cl::NDRange tileSize = GetTileSize(device);
+	SimpleConvolutionKernel separableConvolution;
+
+	if (FitsSeparableConvolution(device, filterSize, tileSize))
+	{
+		separableConvolution = SimpleConvolutionKernel(convolutionVariants.GetKernel(SEPARABLE_CONVOLUTION_KERNEL,
+		                                               MakeSeparableConvolutionDefines(filterSize, filter, tileSize)));
+
+		separableConvolution(queue, RoundUpToTile(w, h, tileSize), tileSize,
+		                     imageBufferA, imageBufferB, sampler, filterBuffer, filterSize);
+
+		SaveImage(queue, imageBufferB, w, h, "Output/SeparableBlurredImage.bmp", zeroCopy, outputImage);
+	}
+	else
+	{
+		std::cout << "Skipping the separable blur, a " << filterSize << " wide tile doesn't fit in local memory" << std::endl;
+	}
+
+	// ==============================================================
+	//
+	// Recursive gaussian blur, the same cost for every sigma
+	//
+	// ==============================================================
+	RecursiveGaussianKernel recursiveColumns(convolutionVariants.GetKernel(RECURSIVE_GAUSSIAN_COLUMNS_KERNEL,
+	                                         std::map<std::string, std::string>()));
+	RecursiveGaussianKernel recursiveRows(convolutionVariants.GetKernel(RECURSIVE_GAUSSIAN_ROWS_KERNEL,
+	                                      std::map<std::string, std::string>()));
+	cl::Buffer recursiveScratch = MakeBuffer(pool, CL_MEM_READ_WRITE, sizeof(cl_float4) * w * h);
+	cl::Image2D recursiveImage = MakeImage2D(pool, CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), w, h);
+
+	EnqueueRecursiveGaussian(queue, recursiveColumns, recursiveRows, imageBufferA, recursiveScratch, recursiveImage,
+	                         imageBufferB, sampler, sigma, w, h, nullptr, nullptr, nullptr);
+
+	SaveImage(queue, imageBufferB, w, h, "Output/RecursiveBlurredImage.bmp", zeroCopy, outputImage);
+	if (recursive)
+	{
+		SaveImage(queue, imageBufferB, w, h, "Output/TwoPassBlurredImage.bmp", zeroCopy, outputImage);
+	}
+
+	pool.Release(recursiveScratch);
+	pool.Release(recursiveImage);
+
+	// ==============================================================
+	//
+	// Two pass gaussian blur split across devices (see OCL_MULTI_DEVICE)
+	//
+	// ==============================================================
+	std::vector<cl::Device> devices = GetDevices(device);
+	if (devices.size() > 1)
+	{
+		BlurAcrossDevices(devices, inputImage, w, h, filterSize, filter);
+	}
 
 	// ==============================================================
 	//
 	// Perform profiling
 	//
 	// ==============================================================
+	pool.Release(filterBuffer);
+
+	if (compare == 'y')
+	{
+		CompareTiledConvolution(context, device, queue, convolutionVariants, imageBufferA, sampler, w, h);
+		CompareRecursiveGaussian(context, queue, convolutionVariants, imageBufferA, sampler, w, h);
+	}
+
+	// Resources of every specialisation profiled below, larger filters unroll into more registers
+	KernelReport report;
+	for (auto size : {3, 5, 7})
+	{
+		report.Add(convolutionVariants.GetKernel(SIMPLE_CONVOLUTION_KERNEL,
+		           MakeSimpleConvolutionDefines(size, filters[size * size])), device);
+		report.Add(convolutionVariants.GetKernel(TILED_CONVOLUTION_KERNEL,
+		           MakeTiledConvolutionDefines(size, filters[size * size], GetTileSize(device))), device);
+		report.Add(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		           MakeOnePassConvolutionDefines(size, filters[size], 1)), device);
+		report.Add(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		           MakeOnePassConvolutionDefines(size, filters[size], 0)), device);
+		report.Add(convolutionVariants.GetKernel(SEPARABLE_CONVOLUTION_KERNEL,
+		           MakeSeparableConvolutionDefines(size, filters[size], tileSize)), device);
+	}
+	report.Print();
+	report.WriteJson("Profiling/KernelResources.json");
+
+	// Every command below, including the pool's filter uploads, ends up in the trace
+	EventProfiler profiler;
+	pool.SetProfiler(&profiler);
+
 	cl::Event startEvent, finishEvent;
 	int filterSizes[3] = {3, 5, 7};
 	std::ofstream outfile;
@@ -176,22 +494,24 @@ int main()
 		outfile << name << std::endl;
 		cl_ulong totalTime = 0;
 
+		// Resolve the specialised kernel once per filter size, not per launch
+		filter = const_cast<float*>(filters[filterSizes[i] * filterSizes[i]]);
+		simpleConvolution = SimpleConvolutionKernel(convolutionVariants.GetKernel(SIMPLE_CONVOLUTION_KERNEL,
+		                                            MakeSimpleConvolutionDefines(filterSizes[i], filter)));
+		simpleConvolution.SetProfiler(&profiler, name);
+		simpleConvolution.SetTuner(&tuner);
+
 		for (auto u = 0; u < 1000; ++u)
 		{
-			filter = const_cast<float*>(filters[filterSizes[i] * filterSizes[i]]);
-			filterBuffer = MakeBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			filterBuffer = MakeBuffer(pool, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
 			                          sizeof(float) * filterSizes[i] * filterSizes[i], filter);
 
-			err = kernels[SIMPLE_CONVOLUTION_KERNEL].setArg(3, filterBuffer);
-			err |= kernels[SIMPLE_CONVOLUTION_KERNEL].setArg(4, filterSizes[i]);
-			CheckErrorCode(err, "Unable to set simple convolution kernel arguments");
-
-			err = queue.enqueueNDRangeKernel(kernels[SIMPLE_CONVOLUTION_KERNEL], cl::NullRange, cl::NDRange(w, h),
-			                                 cl::NullRange, nullptr, &finishEvent);
-			CheckErrorCode(err, "Unable to enqueue simple convolution kernel");
+			simpleConvolution.Enqueue(queue, cl::NDRange(w, h), cl::NullRange, nullptr, &finishEvent,
+			                          imageBufferA, imageBufferB, sampler, filterBuffer, filterSizes[i]);
 
 			err = queue.finish();
 			CheckErrorCode(err, "Unable to finish queue");
+			pool.Release(filterBuffer);
 			auto start = finishEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
 			auto end = finishEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>();
 			totalTime += end - start;
@@ -209,40 +529,37 @@ int main()
 		outfile << name << std::endl;
 		cl_ulong totalTime = 0;
 
+		filter = const_cast<float*>(filters[filterSizes[i]]);
+		horizontalConvolution = OnePassConvolutionKernel(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                                 MakeOnePassConvolutionDefines(filterSizes[i], filter, 1)));
+		verticalConvolution = OnePassConvolutionKernel(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                               MakeOnePassConvolutionDefines(filterSizes[i], filter, 0)));
+		horizontalConvolution.SetProfiler(&profiler, name + " horizontal");
+		verticalConvolution.SetProfiler(&profiler, name + " vertical");
+		horizontalConvolution.SetTuner(&tuner);
+		verticalConvolution.SetTuner(&tuner);
+
 		for (auto u = 0; u < 1000; ++u)
 		{
-			filter = const_cast<float*>(filters[filterSizes[i]]);
-			filterBuffer = MakeBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			filterBuffer = MakeBuffer(pool, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
 			                          sizeof(float) * filterSizes[i], filter);
 
-			err = kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(0, imageBufferA);
-			err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(1, imageBufferB);
-			err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(3, filterBuffer);
-			err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(4, filterSizes[i]);
-			err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(5, 1);
-			CheckErrorCode(err, "Unable to set one pass convolution kernel arguments");
-
-			err = queue.enqueueNDRangeKernel(kernels[ONE_PASS_CONVOLUTION_KERNEL], cl::NullRange, cl::NDRange(w, h),
-			                                 cl::NullRange, nullptr, &startEvent);
-			CheckErrorCode(err, "Unable to enqueue one pass convolution kernel");
-
-			err = kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(0, imageBufferB);
-			err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(1, imageBufferA);
-			err |= kernels[ONE_PASS_CONVOLUTION_KERNEL].setArg(5, 0);
-			CheckErrorCode(err, "Unable to set one pass convolution kernel arguments");
+			horizontalConvolution.Enqueue(queue, cl::NDRange(w, h), cl::NullRange, nullptr, &startEvent,
+			                              imageBufferA, imageBufferB, sampler, filterBuffer, filterSizes[i], 1);
 
-			err = queue.enqueueNDRangeKernel(kernels[ONE_PASS_CONVOLUTION_KERNEL], cl::NullRange, cl::NDRange(w, h),
-			                                 cl::NullRange, nullptr, &finishEvent);
-			CheckErrorCode(err, "Unable to enqueue one pass convolution kernel");
+			verticalConvolution.Enqueue(queue, cl::NDRange(w, h), cl::NullRange, nullptr, &finishEvent,
+			                            imageBufferB, imageBufferA, sampler, filterBuffer, filterSizes[i], 0);
 
 			err = queue.finish();
 			CheckErrorCode(err, "Unable to finish queue");
+			pool.Release(filterBuffer);
 			auto start = startEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
 			auto end = finishEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>();
 			totalTime += end - start;
 			outfile << (end - start) / 1000000.0f << std::endl;
 
-			err = queue.enqueueWriteImage(imageBufferA, CL_TRUE, origin, region, 0, 0, inputImage);
+			err = queue.enqueueWriteImage(imageBufferA, CL_TRUE, origin, region, 0, 0, inputImage,
+			                              nullptr, profiler.Record("Reset image buffer A"));
 			CheckErrorCode(err, "Unable to write image buffer A");
 		}
 
@@ -250,8 +567,747 @@ int main()
 		outfile.close();
 	}
 
+	for (auto i = 0; i < 3; ++i)
+	{
+		std::string name = "Separable" + std::to_string(filterSizes[i]) + "x" + std::to_string(filterSizes[i]);
+		outfile.open("Profiling/" + name + ".txt");
+		outfile << name << std::endl;
+		cl_ulong totalTime = 0;
+
+		filter = const_cast<float*>(filters[filterSizes[i]]);
+		separableConvolution = SimpleConvolutionKernel(convolutionVariants.GetKernel(SEPARABLE_CONVOLUTION_KERNEL,
+		                                               MakeSeparableConvolutionDefines(filterSizes[i], filter, tileSize)));
+		separableConvolution.SetProfiler(&profiler, name);
+
+		for (auto u = 0; u < 1000; ++u)
+		{
+			filterBuffer = MakeBuffer(pool, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			                          sizeof(float) * filterSizes[i], filter);
+
+			separableConvolution.Enqueue(queue, RoundUpToTile(w, h, tileSize), tileSize, nullptr, &finishEvent,
+			                             imageBufferA, imageBufferB, sampler, filterBuffer, filterSizes[i]);
+
+			err = queue.finish();
+			CheckErrorCode(err, "Unable to finish queue");
+			pool.Release(filterBuffer);
+			auto start = finishEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			auto end = finishEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+			totalTime += end - start;
+			outfile << (end - start) / 1000000.0f << std::endl;
+		}
+
+		std::cout << "Average time for " << name << ": " << totalTime / 1000000.0f / 1000.0f << std::endl;
+		outfile.close();
+	}
+
+	profiler.PrintSummary();
+	profiler.WriteChromeTrace("Profiling/GaussianFilterTrace.json");
+	pool.SetProfiler(nullptr);
+
+	pool.Release(imageBufferA);
+	pool.Release(imageBufferB);
+	pool.PrintStats();
+	PrintMemoryReport(context);
+
 	delete[] outputImage;
 	stbi_image_free(inputImage);
 
 	return 0;
 }
+
+std::map<std::string, std::string> MakeSimpleConvolutionDefines(int filterSize, const float* filter)
+{
+	std::map<std::string, std::string> defines;
+	defines["FILTER_SIZE"] = std::to_string(filterSize);
+	if (filterSize <= MAX_BAKED_FILTER_SIZE)
+	{
+		defines["FILTER_WEIGHTS_2D"] = MakeFloatList(filter, filterSize * filterSize);
+	}
+	return defines;
+}
+
+std::map<std::string, std::string> MakeOnePassConvolutionDefines(int filterSize, const float* filter, int horizontalPass)
+{
+	std::map<std::string, std::string> defines;
+	defines["FILTER_SIZE"] = std::to_string(filterSize);
+	if (filterSize <= MAX_BAKED_FILTER_SIZE)
+	{
+		defines["FILTER_WEIGHTS"] = MakeFloatList(filter, filterSize);
+	}
+	defines["HORIZONTAL_PASS"] = std::to_string(horizontalPass);
+	return defines;
+}
+
+std::map<std::string, std::string> MakeTiledConvolutionDefines(int filterSize, const float* filter, const cl::NDRange& tileSize)
+{
+	std::map<std::string, std::string> defines = MakeSimpleConvolutionDefines(filterSize, filter);
+	defines["TILE_WIDTH"] = std::to_string(tileSize[0]);
+	defines["TILE_HEIGHT"] = std::to_string(tileSize[1]);
+	return defines;
+}
+
+std::map<std::string, std::string> MakeSeparableConvolutionDefines(int filterSize, const float* filter, const cl::NDRange& tileSize)
+{
+	std::map<std::string, std::string> defines;
+	defines["FILTER_SIZE"] = std::to_string(filterSize);
+	if (filterSize <= MAX_BAKED_FILTER_SIZE)
+	{
+		defines["FILTER_WEIGHTS"] = MakeFloatList(filter, filterSize);
+	}
+	defines["TILE_WIDTH"] = std::to_string(tileSize[0]);
+	defines["TILE_HEIGHT"] = std::to_string(tileSize[1]);
+	return defines;
+}
+
+cl::NDRange GetTileSize(const cl::Device& device)
+{
+	size_t height = std::min<size_t>(TILE_SIZE, GetDeviceProfile(device)->maxWorkGroupSize / TILE_SIZE);
+	return cl::NDRange(TILE_SIZE, std::max<size_t>(height, 1));
+}
+
+// The separable kernel keeps a column of rows per work-group in local memory,
+// which wide filters outgrow
+bool FitsSeparableConvolution(const cl::Device& device, int filterSize, const cl::NDRange& tileSize)
+{
+	size_t rows = tileSize[1] + filterSize - 1;
+	return rows * tileSize[0] * sizeof(cl_float4) <= GetDeviceProfile(device)->localMemSize;
+}
+
+cl::NDRange RoundUpToTile(int w, int h, const cl::NDRange& tileSize)
+{
+	return cl::NDRange((w + tileSize[0] - 1) / tileSize[0] * tileSize[0],
+	                   (h + tileSize[1] - 1) / tileSize[1] * tileSize[1]);
+}
+
+cl::NDRange GetBufferRange(int w, int h)
+{
+	return cl::NDRange((w + BUFFER_PIXELS - 1) / BUFFER_PIXELS, h);
+}
+
+// Times the two pass blur through images and through buffers on a test frame
+// and picks the faster, once per device and filter size
+ConvolutionPath ChooseConvolutionPath(const cl::Context& context, const cl::Device& device,
+                                      ProgramVariants& convolutionVariants, int filterSize, const float* filter)
+{
+	static std::map<std::pair<cl_device_id, int>, ConvolutionPath> choices;
+	auto choice = choices.find(std::make_pair(device(), filterSize));
+	if (choice != choices.end())
+	{
+		return choice->second;
+	}
+
+	cl::CommandQueue queue = MakeCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+	cl::Buffer filterBuffer = MakeBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+	                                     sizeof(float) * filterSize, const_cast<float*>(filter));
+
+	// Shortest time from the start of the first pass to the end of the second, after a warm-up run
+	auto timeRuns = [&](const std::function<void(cl::Event*, cl::Event*)>& enqueue)
+	{
+		cl_ulong best = 0;
+		for (auto run = 0; run <= PATH_RUNS; ++run)
+		{
+			cl::Event startEvent, finishEvent;
+			enqueue(&startEvent, &finishEvent);
+
+			cl_int err = queue.finish();
+			CheckErrorCode(err, "Unable to finish queue");
+
+			cl_ulong time = finishEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+			                startEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			if (run > 0 && (best == 0 || time < best))
+			{
+				best = time;
+			}
+		}
+
+		return best / 1000000.0;
+	};
+
+	double imageTime = 0.0;
+	if (GetDeviceProfile(device)->imageSupport)
+	{
+		cl::ImageFormat imageFormat(CL_RGBA, CL_UNORM_INT8);
+		cl::Sampler sampler = MakeSampler(context, CL_FALSE, CL_ADDRESS_CLAMP, CL_FILTER_NEAREST);
+		cl::Image2D imageA = MakeImage2D(context, CL_MEM_READ_WRITE, imageFormat, PATH_TEST_SIZE, PATH_TEST_SIZE);
+		cl::Image2D imageB = MakeImage2D(context, CL_MEM_READ_WRITE, imageFormat, PATH_TEST_SIZE, PATH_TEST_SIZE);
+		OnePassConvolutionKernel horizontalConvolution(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                               MakeOnePassConvolutionDefines(filterSize, filter, 1)));
+		OnePassConvolutionKernel verticalConvolution(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                             MakeOnePassConvolutionDefines(filterSize, filter, 0)));
+
+		imageTime = timeRuns([&](cl::Event* startEvent, cl::Event* finishEvent)
+		{
+			horizontalConvolution.Enqueue(queue, cl::NDRange(PATH_TEST_SIZE, PATH_TEST_SIZE), cl::NullRange, nullptr, startEvent,
+			                              imageA, imageB, sampler, filterBuffer, filterSize, 1);
+			verticalConvolution.Enqueue(queue, cl::NDRange(PATH_TEST_SIZE, PATH_TEST_SIZE), cl::NullRange, nullptr, finishEvent,
+			                            imageB, imageA, sampler, filterBuffer, filterSize, 0);
+		});
+	}
+
+	cl::Buffer bufferA = MakeBuffer(context, CL_MEM_READ_WRITE, PATH_TEST_SIZE * PATH_TEST_SIZE * 4);
+	cl::Buffer bufferB = MakeBuffer(context, CL_MEM_READ_WRITE, PATH_TEST_SIZE * PATH_TEST_SIZE * 4);
+	BufferOnePassConvolutionKernel bufferHorizontalConvolution(convolutionVariants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+	                                                           MakeOnePassConvolutionDefines(filterSize, filter, 1)));
+	BufferOnePassConvolutionKernel bufferVerticalConvolution(convolutionVariants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+	                                                         MakeOnePassConvolutionDefines(filterSize, filter, 0)));
+
+	double bufferTime = timeRuns([&](cl::Event* startEvent, cl::Event* finishEvent)
+	{
+		bufferHorizontalConvolution.Enqueue(queue, GetBufferRange(PATH_TEST_SIZE, PATH_TEST_SIZE), cl::NullRange, nullptr, startEvent,
+		                                    bufferA, bufferB, filterBuffer, filterSize, 1, PATH_TEST_SIZE, PATH_TEST_SIZE);
+		bufferVerticalConvolution.Enqueue(queue, GetBufferRange(PATH_TEST_SIZE, PATH_TEST_SIZE), cl::NullRange, nullptr, finishEvent,
+		                                  bufferB, bufferA, filterBuffer, filterSize, 0, PATH_TEST_SIZE, PATH_TEST_SIZE);
+	});
+
+	ConvolutionPath path = (imageTime > 0.0 && imageTime <= bufferTime) ? ConvolutionPath::Image : ConvolutionPath::Buffer;
+	choices[std::make_pair(device(), filterSize)] = path;
+
+	std::cout << GetDeviceProfile(device)->name << ": image path " << imageTime << " ms, buffer path " << bufferTime
+	          << " ms, using the " << (path == ConvolutionPath::Image ? "image" : "buffer") << " path" << std::endl;
+
+	return path;
+}
+
+// Times SimpleConvolution against TiledConvolution from 3x3 up to the largest
+// tiled window and checks they produce the same image
+void CompareTiledConvolution(const cl::Context& context, const cl::Device& device, const cl::CommandQueue& queue,
+                             ProgramVariants& convolutionVariants, const cl::Image2D& inputImage, const cl::Sampler& sampler,
+                             int w, int h)
+{
+	cl_int err;
+	cl::ImageFormat imageFormat(CL_RGBA, CL_UNORM_INT8);
+	cl::Image2D simpleOutput = MakeImage2D(context, CL_MEM_READ_WRITE, imageFormat, w, h);
+	cl::Image2D tiledOutput = MakeImage2D(context, CL_MEM_READ_WRITE, imageFormat, w, h);
+	std::vector<unsigned char> simplePixels(w * h * 4);
+	std::vector<unsigned char> tiledPixels(w * h * 4);
+	cl::NDRange tileSize = GetTileSize(device);
+	cl::size_t<3> origin;
+	cl::size_t<3> region;
+	region[0] = w;
+	region[1] = h;
+	region[2] = 1;
+
+	std::ofstream outfile("Profiling/TiledConvolution.txt");
+	outfile << "Size Simple(ms) Tiled(ms) Speedup MaxDifference" << std::endl;
+	std::cout << "Simple against tiled convolution with " << tileSize[0] << "x" << tileSize[1] << " tiles" << std::endl;
+
+	for (int filterSize = 3; filterSize <= MAX_TILED_FILTER_SIZE; filterSize += 2)
+	{
+		// Window spanning three standard deviations each way
+		std::vector<float> filter = MakeGaussianFilter2D(filterSize / 6.0f, filterSize / 2);
+		cl::Buffer filterBuffer = MakeBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		                                     sizeof(float) * filter.size(), &filter[0]);
+
+		SimpleConvolutionKernel simpleConvolution(convolutionVariants.GetKernel(SIMPLE_CONVOLUTION_KERNEL,
+		                                          MakeSimpleConvolutionDefines(filterSize, &filter[0])));
+		SimpleConvolutionKernel tiledConvolution(convolutionVariants.GetKernel(TILED_CONVOLUTION_KERNEL,
+		                                         MakeTiledConvolutionDefines(filterSize, &filter[0], tileSize)));
+
+		cl_ulong simpleTime = 0;
+		cl_ulong tiledTime = 0;
+		for (auto run = 0; run < TILED_RUNS; ++run)
+		{
+			cl::Event simpleEvent, tiledEvent;
+			simpleConvolution.Enqueue(queue, cl::NDRange(w, h), cl::NullRange, nullptr, &simpleEvent,
+			                          inputImage, simpleOutput, sampler, filterBuffer, filterSize);
+			tiledConvolution.Enqueue(queue, RoundUpToTile(w, h, tileSize), tileSize, nullptr, &tiledEvent,
+			                         inputImage, tiledOutput, sampler, filterBuffer, filterSize);
+
+			err = queue.finish();
+			CheckErrorCode(err, "Unable to finish queue");
+			simpleTime += simpleEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+			              simpleEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			tiledTime += tiledEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+			             tiledEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		}
+
+		err = queue.enqueueReadImage(simpleOutput, CL_TRUE, origin, region, 0, 0, &simplePixels[0]);
+		CheckErrorCode(err, "Unable to read simple convolution output");
+		err = queue.enqueueReadImage(tiledOutput, CL_TRUE, origin, region, 0, 0, &tiledPixels[0]);
+		CheckErrorCode(err, "Unable to read tiled convolution output");
+
+		int maxDifference = 0;
+		for (size_t i = 0; i < simplePixels.size(); ++i)
+		{
+			maxDifference = std::max(maxDifference, std::abs(simplePixels[i] - tiledPixels[i]));
+		}
+
+		float simpleMs = simpleTime / 1000000.0f / TILED_RUNS;
+		float tiledMs = tiledTime / 1000000.0f / TILED_RUNS;
+		outfile << filterSize << " " << simpleMs << " " << tiledMs << " " << simpleMs / tiledMs << " " << maxDifference << std::endl;
+		std::cout << "  " << filterSize << "x" << filterSize << ": simple " << simpleMs << " ms, tiled " << tiledMs
+		          << " ms, " << simpleMs / tiledMs << "x, max difference " << maxDifference << std::endl;
+	}
+
+	outfile.close();
+}
+
+// Both passes of the recursive Gaussian, inputImage -> intermediateImage -> outputImage.
+// scratch holds w * h float4s and intermediateImage is a CL_RGBA, CL_FLOAT image.
+void EnqueueRecursiveGaussian(const cl::CommandQueue& queue, RecursiveGaussianKernel& columns, RecursiveGaussianKernel& rows,
+                              const cl::Image2D& inputImage, const cl::Buffer& scratch, const cl::Image2D& intermediateImage,
+                              const cl::Image2D& outputImage, const cl::Sampler& sampler, float sigma, int w, int h,
+                              const std::vector<cl::Event>* events, cl::Event* startEvent, cl::Event* finishEvent)
+{
+	std::vector<float> recursive = MakeRecursiveGaussianCoefficients(sigma);
+	cl_float4 coefficients = {{recursive[0], recursive[1], recursive[2], recursive[3]}};
+
+	cl::Event columnsEvent;
+	columns.Enqueue(queue, cl::NDRange(w), cl::NullRange, events, &columnsEvent,
+	                inputImage, scratch, intermediateImage, sampler, coefficients, w, h);
+
+	std::vector<cl::Event> columnsDone(1, columnsEvent);
+	rows.Enqueue(queue, cl::NDRange(h), cl::NullRange, &columnsDone, finishEvent,
+	             intermediateImage, scratch, outputImage, sampler, coefficients, w, h);
+
+	if (startEvent != nullptr)
+	{
+		*startEvent = columnsEvent;
+	}
+}
+
+// Times the recursive Gaussian against the two pass convolution over a range of
+// sigmas and measures how far it strays from it. Past a few pixels of radius the
+// convolution's time keeps growing while the recursive one stays flat.
+void CompareRecursiveGaussian(const cl::Context& context, const cl::CommandQueue& queue,
+                              ProgramVariants& convolutionVariants, const cl::Image2D& inputImage, const cl::Sampler& sampler,
+                              int w, int h)
+{
+	cl_int err;
+	cl::ImageFormat imageFormat(CL_RGBA, CL_UNORM_INT8);
+	cl::Image2D convolutionImage = MakeImage2D(context, CL_MEM_READ_WRITE, imageFormat, w, h);
+	cl::Image2D convolutionOutput = MakeImage2D(context, CL_MEM_READ_WRITE, imageFormat, w, h);
+	cl::Image2D recursiveImage = MakeImage2D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), w, h);
+	cl::Image2D recursiveOutput = MakeImage2D(context, CL_MEM_READ_WRITE, imageFormat, w, h);
+	cl::Buffer scratch = MakeBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * w * h);
+	std::vector<unsigned char> convolutionPixels(w * h * 4);
+	std::vector<unsigned char> recursivePixels(w * h * 4);
+	cl::size_t<3> origin;
+	cl::size_t<3> region;
+	region[0] = w;
+	region[1] = h;
+	region[2] = 1;
+
+	RecursiveGaussianKernel recursiveColumns(convolutionVariants.GetKernel(RECURSIVE_GAUSSIAN_COLUMNS_KERNEL,
+	                                         std::map<std::string, std::string>()));
+	RecursiveGaussianKernel recursiveRows(convolutionVariants.GetKernel(RECURSIVE_GAUSSIAN_ROWS_KERNEL,
+	                                      std::map<std::string, std::string>()));
+
+	std::ofstream outfile("Profiling/RecursiveGaussian.txt");
+	outfile << "Sigma Radius TwoPass(ms) Recursive(ms) Speedup MaxDifference MeanDifference" << std::endl;
+	std::cout << "Two pass convolution against the recursive Gaussian, switching above radius "
+	          << GetRecursiveGaussianRadius() << std::endl;
+
+	for (float sigma : {1.0f, 2.0f, 4.0f, 8.0f, 16.0f, 32.0f, MAX_GAUSSIAN_SIGMA})
+	{
+		int radius = GetGaussianRadius(sigma);
+		int filterSize = 2 * radius + 1;
+		std::vector<float> filter = MakeGaussianFilter(sigma, radius);
+		cl::Buffer filterBuffer = MakeBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		                                     sizeof(float) * filter.size(), &filter[0]);
+
+		OnePassConvolutionKernel horizontalConvolution(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                               MakeOnePassConvolutionDefines(filterSize, &filter[0], 1)));
+		OnePassConvolutionKernel verticalConvolution(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                             MakeOnePassConvolutionDefines(filterSize, &filter[0], 0)));
+
+		cl_ulong convolutionTime = 0;
+		cl_ulong recursiveTime = 0;
+		for (auto run = 0; run < RECURSIVE_RUNS; ++run)
+		{
+			cl::Event convolutionStart, convolutionFinish, recursiveStart, recursiveFinish;
+			horizontalConvolution.Enqueue(queue, cl::NDRange(w, h), cl::NullRange, nullptr, &convolutionStart,
+			                              inputImage, convolutionImage, sampler, filterBuffer, filterSize, 1);
+			verticalConvolution.Enqueue(queue, cl::NDRange(w, h), cl::NullRange, nullptr, &convolutionFinish,
+			                            convolutionImage, convolutionOutput, sampler, filterBuffer, filterSize, 0);
+			EnqueueRecursiveGaussian(queue, recursiveColumns, recursiveRows, inputImage, scratch, recursiveImage,
+			                         recursiveOutput, sampler, sigma, w, h, nullptr, &recursiveStart, &recursiveFinish);
+
+			err = queue.finish();
+			CheckErrorCode(err, "Unable to finish queue");
+			convolutionTime += convolutionFinish.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+			                   convolutionStart.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			recursiveTime += recursiveFinish.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+			                 recursiveStart.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		}
+
+		err = queue.enqueueReadImage(convolutionOutput, CL_TRUE, origin, region, 0, 0, &convolutionPixels[0]);
+		CheckErrorCode(err, "Unable to read two pass convolution output");
+		err = queue.enqueueReadImage(recursiveOutput, CL_TRUE, origin, region, 0, 0, &recursivePixels[0]);
+		CheckErrorCode(err, "Unable to read recursive Gaussian output");
+
+		int maxDifference = 0;
+		double totalDifference = 0.0;
+		for (size_t i = 0; i < convolutionPixels.size(); ++i)
+		{
+			int difference = std::abs(convolutionPixels[i] - recursivePixels[i]);
+			maxDifference = std::max(maxDifference, difference);
+			totalDifference += difference;
+		}
+
+		float convolutionMs = convolutionTime / 1000000.0f / RECURSIVE_RUNS;
+		float recursiveMs = recursiveTime / 1000000.0f / RECURSIVE_RUNS;
+		float meanDifference = static_cast<float>(totalDifference / convolutionPixels.size());
+		outfile << sigma << " " << radius << " " << convolutionMs << " " << recursiveMs << " " << convolutionMs / recursiveMs
+		        << " " << maxDifference << " " << meanDifference << std::endl;
+		std::cout << "  sigma " << sigma << " (" << filterSize << " taps): two pass " << convolutionMs << " ms, recursive "
+		          << recursiveMs << " ms, " << convolutionMs / recursiveMs << "x, max difference " << maxDifference
+		          << ", mean difference " << meanDifference << std::endl;
+	}
+
+	outfile.close();
+}
+
+void BlurBatch(const cl::Context& context, const cl::Device& device, MemoryPool& pool,
+               ProgramVariants& convolutionVariants, ConvolutionPath path, float sigma, int filterSize, const float* filter)
+{
+	cl::Sampler sampler = MakeSampler(context, CL_FALSE, CL_ADDRESS_CLAMP, CL_FILTER_NEAREST);
+	cl::Buffer filterBuffer = MakeBuffer(pool, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+	                                     sizeof(float) * filterSize, const_cast<float*>(filter));
+
+	// Both passes in one launch, so frames need no intermediate image.
+	// Filters too wide for the separable tile go through the two pass kernels,
+	// and radii above the recursive radius through the recursive Gaussian.
+	// Devices where buffers measured faster copy each frame through the buffer kernels.
+	cl::NDRange tileSize = GetTileSize(device);
+	bool recursive = UseRecursiveGaussian(sigma);
+	bool buffers = !recursive && path == ConvolutionPath::Buffer;
+	bool separable = !recursive && !buffers && FitsSeparableConvolution(device, filterSize, tileSize);
+	SimpleConvolutionKernel separableConvolution;
+	OnePassConvolutionKernel horizontalConvolution;
+	OnePassConvolutionKernel verticalConvolution;
+	BufferOnePassConvolutionKernel bufferHorizontalConvolution;
+	BufferOnePassConvolutionKernel bufferVerticalConvolution;
+	RecursiveGaussianKernel recursiveColumns;
+	RecursiveGaussianKernel recursiveRows;
+
+	// Float intermediates of the recursive Gaussian, or the pixel buffers of the
+	// buffer path, per image size. The compute queue runs one frame at a time,
+	// so frames of the same size share them.
+	std::map<std::pair<int, int>, std::pair<cl::Buffer, cl::Image2D> > intermediates;
+	std::map<std::pair<int, int>, std::pair<cl::Buffer, cl::Buffer> > pixelBuffers;
+
+	if (recursive)
+	{
+		recursiveColumns = RecursiveGaussianKernel(convolutionVariants.GetKernel(RECURSIVE_GAUSSIAN_COLUMNS_KERNEL,
+		                                           std::map<std::string, std::string>()));
+		recursiveRows = RecursiveGaussianKernel(convolutionVariants.GetKernel(RECURSIVE_GAUSSIAN_ROWS_KERNEL,
+		                                        std::map<std::string, std::string>()));
+	}
+	else if (buffers)
+	{
+		bufferHorizontalConvolution = BufferOnePassConvolutionKernel(convolutionVariants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+		                                                             MakeOnePassConvolutionDefines(filterSize, filter, 1)));
+		bufferVerticalConvolution = BufferOnePassConvolutionKernel(convolutionVariants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+		                                                           MakeOnePassConvolutionDefines(filterSize, filter, 0)));
+	}
+	else if (separable)
+	{
+		separableConvolution = SimpleConvolutionKernel(convolutionVariants.GetKernel(SEPARABLE_CONVOLUTION_KERNEL,
+		                                               MakeSeparableConvolutionDefines(filterSize, filter, tileSize)));
+	}
+	else
+	{
+		horizontalConvolution = OnePassConvolutionKernel(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                                 MakeOnePassConvolutionDefines(filterSize, filter, 1)));
+		verticalConvolution = OnePassConvolutionKernel(convolutionVariants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+		                                               MakeOnePassConvolutionDefines(filterSize, filter, 0)));
+	}
+
+	// input -> output, or input -> scratch[0] -> output for two passes,
+	// the pipeline moves the images on and off the device
+	auto compute = [&](const cl::CommandQueue& queue, StreamSlot& slot, const std::vector<cl::Event>& waitList)
+	{
+		cl::Event event;
+
+		if (recursive)
+		{
+			auto& intermediate = intermediates[std::make_pair(slot.width, slot.height)];
+			if (intermediate.first() == nullptr)
+			{
+				intermediate.first = MakeBuffer(pool, CL_MEM_READ_WRITE, sizeof(cl_float4) * slot.width * slot.height);
+				intermediate.second = MakeImage2D(pool, CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT),
+				                                  slot.width, slot.height);
+			}
+
+			EnqueueRecursiveGaussian(queue, recursiveColumns, recursiveRows, slot.input, intermediate.first, intermediate.second,
+			                         slot.output, sampler, sigma, slot.width, slot.height, &waitList, nullptr, &event);
+		}
+		else if (buffers)
+		{
+			auto& pixels = pixelBuffers[std::make_pair(slot.width, slot.height)];
+			if (pixels.first() == nullptr)
+			{
+				pixels.first = MakeBuffer(pool, CL_MEM_READ_WRITE, slot.width * slot.height * 4);
+				pixels.second = MakeBuffer(pool, CL_MEM_READ_WRITE, slot.width * slot.height * 4);
+			}
+
+			// The compute queue is in order, so only the first command waits
+			cl::size_t<3> origin;
+			cl::size_t<3> region;
+			region[0] = slot.width;
+			region[1] = slot.height;
+			region[2] = 1;
+			cl_int err = queue.enqueueCopyImageToBuffer(slot.input, pixels.first, origin, region, 0, &waitList);
+			CheckErrorCode(err, "Unable to copy image to pixel buffer");
+
+			bufferHorizontalConvolution(queue, GetBufferRange(slot.width, slot.height), cl::NullRange,
+			                            pixels.first, pixels.second, filterBuffer, filterSize, 1, slot.width, slot.height);
+			bufferVerticalConvolution(queue, GetBufferRange(slot.width, slot.height), cl::NullRange,
+			                          pixels.second, pixels.first, filterBuffer, filterSize, 0, slot.width, slot.height);
+
+			err = queue.enqueueCopyBufferToImage(pixels.first, slot.output, 0, origin, region, nullptr, &event);
+			CheckErrorCode(err, "Unable to copy pixel buffer to image");
+		}
+		else if (separable)
+		{
+			separableConvolution.Enqueue(queue, RoundUpToTile(slot.width, slot.height, tileSize), tileSize, &waitList, &event,
+			                             slot.input, slot.output, sampler, filterBuffer, filterSize);
+		}
+		else
+		{
+			cl::Event horizontalEvent;
+			horizontalConvolution.Enqueue(queue, cl::NDRange(slot.width, slot.height), cl::NullRange, &waitList, &horizontalEvent,
+			                              slot.input, slot.scratch[0], sampler, filterBuffer, filterSize, 1);
+
+			std::vector<cl::Event> horizontalDone(1, horizontalEvent);
+			verticalConvolution.Enqueue(queue, cl::NDRange(slot.width, slot.height), cl::NullRange, &horizontalDone, &event,
+			                            slot.scratch[0], slot.output, sampler, filterBuffer, filterSize, 0);
+		}
+
+		return event;
+	};
+
+	auto complete = [](StreamSlot& slot)
+	{
+		std::string outputFilename = OUTPUT_DIRECTORY "/Blurred_" + slot.name;
+		stbi_write_bmp(outputFilename.c_str(), slot.width, slot.height, 4, &slot.hostOutput[0]);
+		stbi_image_free(slot.hostInput);
+		std::cout << "Wrote " << outputFilename << std::endl;
+	};
+
+	std::vector<std::string> fileNames = ListFiles(INPUT_DIRECTORY, ".bmp");
+	auto startTime = std::chrono::steady_clock::now();
+
+	{
+		StreamingPipeline pipeline(context, device, pool, compute, complete, recursive || buffers || separable ? 0 : 1);
+
+		// Decoding the next image on the host overlaps the device work already in flight
+		for (auto& fileName : fileNames)
+		{
+			int w, h, n;
+			unsigned char* inputImage = stbi_load((INPUT_DIRECTORY "/" + fileName).c_str(), &w, &h, &n, 4);
+			if (inputImage == nullptr)
+			{
+				std::cout << "Skipping " << fileName << ", unable to decode" << std::endl;
+				continue;
+			}
+
+			pipeline.Push(fileName, inputImage, w, h);
+		}
+
+		pipeline.Flush();
+	}
+
+	for (auto& intermediate : intermediates)
+	{
+		pool.Release(intermediate.second.first);
+		pool.Release(intermediate.second.second);
+	}
+	for (auto& pixels : pixelBuffers)
+	{
+		pool.Release(pixels.second.first);
+		pool.Release(pixels.second.second);
+	}
+	pool.Release(filterBuffer);
+
+	std::cout << "Blurred " << fileNames.size() << " image(s) in "
+	          << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count()
+	          << " ms" << std::endl;
+}
+
+// Each device blurs a band of rows plus the halo the vertical pass reads, and
+// the shares are rebalanced from the measured time of every run
+void BlurAcrossDevices(const std::vector<cl::Device>& devices, const unsigned char* inputImage, int w, int h,
+                       int filterSize, const float* filter)
+{
+	cl_int err;
+	cl::Context context = MakeContext(devices);
+	cl::ImageFormat imageFormat(CL_RGBA, CL_UNORM_INT8);
+	cl::Sampler sampler = MakeSampler(context, CL_FALSE, CL_ADDRESS_CLAMP, CL_FILTER_NEAREST);
+	cl::Buffer filterBuffer = MakeBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+	                                     sizeof(float) * filterSize, const_cast<float*>(filter));
+	std::vector<unsigned char> outputImage(w * h * 4);
+	int radius = filterSize / 2;
+
+	std::vector<cl::CommandQueue> queues;
+	std::vector<ConvolutionPath> paths;
+	std::vector<OnePassConvolutionKernel> horizontalConvolutions;
+	std::vector<OnePassConvolutionKernel> verticalConvolutions;
+	std::vector<BufferOnePassConvolutionKernel> bufferHorizontalConvolutions;
+	std::vector<BufferOnePassConvolutionKernel> bufferVerticalConvolutions;
+	for (auto& device : devices)
+	{
+		// Kernels are built per device, the images are shared through the context.
+		// Every device runs the path that measured faster on it.
+		std::vector<const char*> sourceFileNames(1, CL_FILENAME);
+		ProgramVariants variants(sourceFileNames, context, device);
+		queues.push_back(MakeCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE));
+		paths.push_back(ChooseConvolutionPath(context, device, variants, filterSize, filter));
+
+		if (paths.back() == ConvolutionPath::Image)
+		{
+			horizontalConvolutions.push_back(OnePassConvolutionKernel(variants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+			                                 MakeOnePassConvolutionDefines(filterSize, filter, 1))));
+			verticalConvolutions.push_back(OnePassConvolutionKernel(variants.GetKernel(ONE_PASS_CONVOLUTION_KERNEL,
+			                               MakeOnePassConvolutionDefines(filterSize, filter, 0))));
+			bufferHorizontalConvolutions.push_back(BufferOnePassConvolutionKernel());
+			bufferVerticalConvolutions.push_back(BufferOnePassConvolutionKernel());
+		}
+		else
+		{
+			horizontalConvolutions.push_back(OnePassConvolutionKernel());
+			verticalConvolutions.push_back(OnePassConvolutionKernel());
+			bufferHorizontalConvolutions.push_back(BufferOnePassConvolutionKernel(variants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+			                                       MakeOnePassConvolutionDefines(filterSize, filter, 1))));
+			bufferVerticalConvolutions.push_back(BufferOnePassConvolutionKernel(variants.GetKernel(BUFFER_ONE_PASS_CONVOLUTION_KERNEL,
+			                                     MakeOnePassConvolutionDefines(filterSize, filter, 0))));
+		}
+	}
+
+	WorkSplitter splitter(devices);
+	std::vector<std::pair<size_t, size_t> > shares;
+
+	for (auto run = 0; run < SPLIT_RUNS; ++run)
+	{
+		shares = splitter.Split(h);
+		std::vector<cl::Event> writeEvents(devices.size());
+		std::vector<cl::Event> readEvents(devices.size());
+		std::vector<cl::Image2D> bands;
+		std::vector<cl::Buffer> bufferBands;
+
+		for (size_t i = 0; i < devices.size(); ++i)
+		{
+			int begin = static_cast<int>(shares[i].first);
+			int end = static_cast<int>(shares[i].second);
+			if (begin == end)
+			{
+				continue;
+			}
+
+			int bandBegin = std::max(begin - radius, 0);
+			int bandEnd = std::min(end + radius, h);
+			int bandRows = bandEnd - bandBegin;
+			const unsigned char* bandInput = inputImage + bandBegin * w * 4;
+
+			if (paths[i] == ConvolutionPath::Buffer)
+			{
+				cl::Buffer bandA = MakeBuffer(context, CL_MEM_READ_WRITE, w * bandRows * 4);
+				cl::Buffer bandB = MakeBuffer(context, CL_MEM_READ_WRITE, w * bandRows * 4);
+				bufferBands.push_back(bandA);
+				bufferBands.push_back(bandB);
+
+				err = queues[i].enqueueWriteBuffer(bandA, CL_FALSE, 0, w * bandRows * 4, bandInput, nullptr, &writeEvents[i]);
+				CheckErrorCode(err, "Unable to write buffer band");
+
+				bufferHorizontalConvolutions[i](queues[i], GetBufferRange(w, bandRows), cl::NullRange,
+				                                bandA, bandB, filterBuffer, filterSize, 1, w, bandRows);
+				bufferVerticalConvolutions[i](queues[i], GetBufferRange(w, bandRows), cl::NullRange,
+				                              bandB, bandA, filterBuffer, filterSize, 0, w, bandRows);
+
+				// Only the rows this device owns, rows are contiguous in the buffer
+				err = queues[i].enqueueReadBuffer(bandA, CL_FALSE, (begin - bandBegin) * w * 4, (end - begin) * w * 4,
+				                                  &outputImage[begin * w * 4], nullptr, &readEvents[i]);
+				CheckErrorCode(err, "Unable to read buffer band");
+			}
+			else
+			{
+				cl::Image2D bandA = MakeImage2D(context, CL_MEM_READ_WRITE, imageFormat, w, bandRows);
+				cl::Image2D bandB = MakeImage2D(context, CL_MEM_READ_WRITE, imageFormat, w, bandRows);
+				bands.push_back(bandA);
+				bands.push_back(bandB);
+
+				cl::size_t<3> origin;
+				cl::size_t<3> region;
+				region[0] = w;
+				region[1] = bandRows;
+				region[2] = 1;
+				err = queues[i].enqueueWriteImage(bandA, CL_FALSE, origin, region, 0, 0,
+				                                  const_cast<unsigned char*>(bandInput), nullptr, &writeEvents[i]);
+				CheckErrorCode(err, "Unable to write image band");
+
+				horizontalConvolutions[i](queues[i], cl::NDRange(w, bandRows), cl::NullRange,
+				                          bandA, bandB, sampler, filterBuffer, filterSize, 1);
+				verticalConvolutions[i](queues[i], cl::NDRange(w, bandRows), cl::NullRange,
+				                        bandB, bandA, sampler, filterBuffer, filterSize, 0);
+
+				// Only the rows this device owns, the halo rows are clamped at the band's edge
+				origin[1] = begin - bandBegin;
+				region[1] = end - begin;
+				err = queues[i].enqueueReadImage(bandA, CL_FALSE, origin, region, 0, 0, &outputImage[begin * w * 4],
+				                                 nullptr, &readEvents[i]);
+				CheckErrorCode(err, "Unable to read image band");
+			}
+
+			err = queues[i].flush();
+			CheckErrorCode(err, "Unable to flush queue");
+		}
+
+		for (size_t i = 0; i < devices.size(); ++i)
+		{
+			if (shares[i].first == shares[i].second)
+			{
+				continue;
+			}
+
+			err = queues[i].finish();
+			CheckErrorCode(err, "Unable to finish queue");
+
+			cl_ulong time = readEvents[i].getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+			                writeEvents[i].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			splitter.Record(i, shares[i].second - shares[i].first, time / 1e9);
+		}
+	}
+
+	for (size_t i = 0; i < devices.size(); ++i)
+	{
+		std::cout << "  " << GetDeviceProfile(devices[i])->name << ": rows " << shares[i].first << "-" << shares[i].second
+		          << ", " << splitter.GetThroughput(i) / 1000.0 << " rows/ms through "
+		          << (paths[i] == ConvolutionPath::Image ? "images" : "buffers") << std::endl;
+	}
+
+	stbi_write_bmp(OUTPUT_DIRECTORY "/SplitBlurredImage.bmp", w, h, 4, &outputImage[0]);
+}
+
+void SaveImage(const cl::CommandQueue& queue, const cl::Image2D& image, int w, int h,
+               const char* filename, bool zeroCopy, unsigned char* outputImage)
+{
+	if (zeroCopy)
+	{
+		// The encoder reads the device's memory in place unless rows are padded
+		std::vector<unsigned char> packed;
+		MappedMemory mapped(queue, image, CL_MAP_READ);
+		stbi_write_bmp(filename, w, h, 4, mapped.GetPackedRows(w * 4, h, packed));
+		return;
+	}
+
+	cl::size_t<3> origin;
+	cl::size_t<3> region;
+	region[0] = w;
+	region[1] = h;
+	region[2] = 1;
+
+	cl_int err = queue.enqueueReadImage(image, CL_TRUE, origin, region, 0, 0, outputImage);
+	CheckErrorCode(err, "Unable to read output image buffer");
+
+	stbi_write_bmp(filename, w, h, 4, outputImage);
+}
+
+void SaveBuffer(const cl::CommandQueue& queue, const cl::Buffer& buffer, int w, int h, const char* filename)
+{
+	std::vector<unsigned char> pixels(w * h * 4);
+	cl_int err = queue.enqueueReadBuffer(buffer, CL_TRUE, 0, pixels.size(), &pixels[0]);
+	CheckErrorCode(err, "Unable to read output pixel buffer");
+
+	stbi_write_bmp(filename, w, h, 4, &pixels[0]);
+}
@@ -9,6 +9,9 @@
 
 #include "OCLUtils.h"
 
+// Kernel sources embedded at build time by EmbedKernel.ps1
+#include "Reduction.cl.h"
+
 #define CL_FILENAME "Reduction.cl"
 
 #define INPUT_IMAGE_FILENAME "Input/bunnycity1.bmp"
@@ -22,6 +25,13 @@
 #define VENDOR_NVIDIA "NVIDIA"
 #define SELECTED_VENDOR VENDOR_INTEL
 
+// inputImage, sampler, outputLuminance
+typedef KernelFunctor<cl::Image2D, cl::Sampler, cl::Buffer> LuminanceKernel;
+// data, partialSums
+typedef KernelFunctor<cl::Buffer, cl::LocalSpaceArg> ReductionStepKernel;
+// data, partialSums, sum
+typedef KernelFunctor<cl::Buffer, cl::LocalSpaceArg, cl::Buffer> ReductionCompleteKernel;
+
 int main()
 {
 	cl_int err;
@@ -40,6 +50,9 @@ int main()
 	cl::Program program = MakeAndBuildProgram(sourceFileNames, context, device);
 
 	std::unordered_map<std::string, cl::Kernel> kernels = MakeKernels(program);
+	LuminanceKernel luminance(kernels, LUMINANCE_KERNEL);
+	ReductionStepKernel reductionStep(kernels, REDUCTION_STEP_KERNEL);
+	ReductionCompleteKernel reductionComplete(kernels, REDUCTION_COMPLETE_KERNEL);
 
 	// ==============================================================
 	//
@@ -58,8 +71,16 @@ int main()
 	//
 	// ==============================================================
 	float sum = 0.0f;
-	size_t localSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+	size_t localSize = GetDeviceProfile(device)->maxWorkGroupSize;
 	size_t globalSize = (w * h) / 4;
+
+	// The reductions' __local partial sums are 4 floats per work-item
+	KernelReport report;
+	report.Add(luminance.GetKernel(), device);
+	report.Add(reductionStep.GetKernel(), device, sizeof(float) * 4 * localSize);
+	report.Add(reductionComplete.GetKernel(), device, sizeof(float) * 4 * localSize);
+	report.Print();
+	report.WriteJson("Output/KernelResources.json");
 	cl::Buffer luminanceBuffer = MakeBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * w * h);
 	cl::Buffer sumBuffer = MakeBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float));
 
@@ -68,13 +89,7 @@ int main()
 	// Get luminance values
 	//
 	// ==============================================================
-	err = kernels[LUMINANCE_KERNEL].setArg(0, inputImageBuffer);
-	err |= kernels[LUMINANCE_KERNEL].setArg(1, sampler);
-	err |= kernels[LUMINANCE_KERNEL].setArg(2, luminanceBuffer);
-	CheckErrorCode(err, "Unablet to set luminance kernel arguments");
-
-	err = queue.enqueueNDRangeKernel(kernels[LUMINANCE_KERNEL], cl::NullRange, cl::NDRange(w, h));
-	CheckErrorCode(err, "Unablet to enqueue luminance kernel");
+	luminance(queue, cl::NDRange(w, h), cl::NullRange, inputImageBuffer, sampler, luminanceBuffer);
 
 	stbi_image_free(inputImage);
 
@@ -83,30 +98,19 @@ int main()
 	// Start reduction
 	//
 	// ==============================================================
-	err = kernels[REDUCTION_STEP_KERNEL].setArg(0, luminanceBuffer);
-	err |= kernels[REDUCTION_STEP_KERNEL].setArg(1, sizeof(float) * 4 * localSize, nullptr);
-	CheckErrorCode(err, "Unablet to set reduction step kernel arguments");
-
-	err = kernels[REDUCTION_COMPLETE_KERNEL].setArg(0, luminanceBuffer);
-	err |= kernels[REDUCTION_COMPLETE_KERNEL].setArg(1, sizeof(float) * 4 * localSize, nullptr);
-	err |= kernels[REDUCTION_COMPLETE_KERNEL].setArg(2, sumBuffer);
-	CheckErrorCode(err, "Unablet to set reduction complete kernel arguments");
-
-	err = queue.enqueueNDRangeKernel(kernels[REDUCTION_STEP_KERNEL], cl::NullRange,
-	                                 cl::NDRange(globalSize), cl::NDRange(localSize));
-	CheckErrorCode(err, "Unablet to enqueue reduction step kernel");
+	reductionStep(queue, cl::NDRange(globalSize), cl::NDRange(localSize),
+	              luminanceBuffer, cl::Local(sizeof(float) * 4 * localSize));
 
 	while (globalSize / localSize > localSize)
 	{
 		globalSize = globalSize / localSize;
-		err = queue.enqueueNDRangeKernel(kernels[REDUCTION_STEP_KERNEL], cl::NullRange,
-		                                 cl::NDRange(globalSize), cl::NDRange(localSize));
-		CheckErrorCode(err, "Unablet to enqueue reduction step kernel");
+		reductionStep(queue, cl::NDRange(globalSize), cl::NDRange(localSize),
+		              luminanceBuffer, cl::Local(sizeof(float) * 4 * localSize));
 	}
 
 	globalSize = globalSize / localSize;
-	err = queue.enqueueNDRangeKernel(kernels[REDUCTION_COMPLETE_KERNEL], cl::NullRange, cl::NDRange(globalSize));
-	CheckErrorCode(err, "Unablet to enqueue reduction complete kernel");
+	reductionComplete(queue, cl::NDRange(globalSize), cl::NullRange,
+	                  luminanceBuffer, cl::Local(sizeof(float) * 4 * localSize), sumBuffer);
 
 	err = queue.enqueueReadBuffer(sumBuffer, CL_TRUE, 0, sizeof(float), &sum);
 	CheckErrorCode(err, "Unablet to read sum buffer");
@@ -2,29 +2,268 @@
 #ifndef __OCL_UTILS_H__
 #define __OCL_UTILS_H__
 
+#include <algorithm>
 #include <unordered_map>
+#include <map>
+#include <memory>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
 #include <CL/cl.hpp>
 
 void
 CheckErrorCode(const cl_int& err, const std::string& errMsg);
 
+// Device limits and properties, queried from the driver once per device.
+// Launch configuration code reads these instead of calling getInfo.
+struct DeviceProfile
+{
+	std::string name;
+	std::string vendor;
+	std::string driverVersion;
+	std::string platformName;
+	std::string platformVendor;
+	std::string platformVersion;
+	cl_device_type type;
+	cl_uint computeUnits;
+	cl_uint clockFrequency;
+	cl_ulong globalMemSize;
+	cl_ulong maxMemAllocSize;
+	cl_ulong localMemSize;
+	cl_ulong maxConstantBufferSize;
+	size_t maxWorkGroupSize;
+	std::vector<size_t> maxWorkItemSizes;
+	bool imageSupport;
+	size_t image2DMaxWidth;
+	size_t image2DMaxHeight;
+	bool hostUnifiedMemory;
+	cl_command_queue_properties queueProperties;
+	cl_uint preferredVectorWidthChar;
+	cl_uint preferredVectorWidthShort;
+	cl_uint preferredVectorWidthInt;
+	cl_uint preferredVectorWidthLong;
+	cl_uint preferredVectorWidthFloat;
+	cl_uint preferredVectorWidthDouble;
+	std::string extensions;
+	// Measured results by name, only present in profiles saved with them (benchmark.<name>=<value>)
+	std::map<std::string, double> benchmarks;
+
+	bool HasExtension(const std::string& extension) const;
+
+	// One name=value line per field, Read accepts what Write produces
+	void Write(std::ostream& out) const;
+	static DeviceProfile Read(std::istream& in);
+};
+
+// The profile of device, queried on first use and shared by every later caller
+std::shared_ptr<const DeviceProfile>
+GetDeviceProfile(const cl::Device& device);
+
+struct DeviceScore
+{
+	cl::Device device;
+	double score;
+};
+
+// Heuristic throughput score from compute units, clock, memory sizes and image support
+double
+ScoreDevice(const cl::Device& device);
+
+// Every available device of the given type on every platform, best first
+std::vector<DeviceScore>
+RankDevices(cl_device_type deviceType = CL_DEVICE_TYPE_ALL);
+
+// Picks the highest ranked device, preferring platforms whose vendor contains
+// vendorName. OCL_PLATFORM, OCL_DEVICE_TYPE and OCL_DEVICE_NAME override the choice.
 cl::Device
 GetDevice(const std::string& vendorName = "");
 
 cl::Context
 MakeContext(const cl::Device& device);
 
+// All devices must belong to one platform
+cl::Context
+MakeContext(const std::vector<cl::Device>& devices);
+
+// One sub-device per affinity domain, e.g. per NUMA node of a multi-socket
+// CPU, falling back to the next partitionable cache level. A device that
+// cannot be partitioned is returned on its own.
+std::vector<cl::Device>
+MakeSubDevices(const cl::Device& device,
+               cl_device_affinity_domain domain = CL_DEVICE_AFFINITY_DOMAIN_NUMA);
+
+// The devices to spread work over, chosen by OCL_MULTI_DEVICE: "subdevices"
+// partitions device, "platform" takes every available device on its platform,
+// and anything else keeps device alone.
+std::vector<cl::Device>
+GetDevices(const cl::Device& device);
+
+// Shares work between devices in proportion to their throughput. Shares
+// start from ScoreDevice and follow the measured rates once every device has
+// reported one, so later splits balance out.
+class WorkSplitter
+{
+public:
+	explicit WorkSplitter(const std::vector<cl::Device>& devices);
+
+	// One [begin, end) range per device covering [0, total), with every
+	// boundary a multiple of granularity. Ranges may be empty.
+	std::vector<std::pair<size_t, size_t> > Split(size_t total, size_t granularity = 1) const;
+
+	// Device index processed items in seconds
+	void Record(size_t index, size_t items, double seconds);
+
+	// Items per second, or the device score before a rate has been measured
+	double GetThroughput(size_t index) const;
+
+private:
+	bool IsMeasured() const;
+
+	std::vector<double> scores;
+	std::vector<double> rates;
+};
+
 cl::CommandQueue
 MakeCommandQueue(const cl::Context& context, const cl::Device& device,
                  cl_command_queue_properties properties = 0);
 
+// Registers a kernel source compiled into the executable. The headers that
+// EmbedKernel.ps1 generates from .cl files at build time call this.
+bool
+RegisterEmbeddedSource(const std::string& fileName, const char* source);
+
+// The embedded source of fileName, or the file read relative to the working directory
+std::string
+LoadKernelSource(const std::string& fileName);
+
+// Builds a program from the given source files. Compiled binaries are cached
+// on disk (see OCL_PROGRAM_CACHE_DIR) keyed on the source text, device name,
+// driver version and build options, so later runs skip the compiler.
 cl::Program
 MakeAndBuildProgram(const std::vector<const char*>& sourceFileNames,
-                    const cl::Context& context, const cl::Device& device);
+                    const cl::Context& context, const cl::Device& device,
+                    const std::string& buildOptions = "");
+
+cl::Program
+MakeAndBuildProgramFromSource(const std::string& source,
+                              const cl::Context& context, const cl::Device& device,
+                              const std::string& buildOptions = "");
 
 std::unordered_map<std::string, cl::Kernel>
 MakeKernels(cl::Program& program);
 
+// Formats -D name=value options for each define, followed by extra compiler flags
+std::string
+MakeBuildOptions(const std::map<std::string, std::string>& defines,
+                 const std::string& flags = "");
+
+// Formats floats as an OpenCL C initializer list, e.g. to bake filter weights into a kernel
+std::string
+MakeFloatList(const float* values, size_t count);
+
+// Builds specialised variants of one program on demand. Each distinct set of
+// defines is compiled once and its kernels are reused on later requests.
+class ProgramVariants
+{
+public:
+	ProgramVariants(const std::vector<const char*>& sourceFileNames,
+	                const cl::Context& context, const cl::Device& device,
+	                const std::string& flags = "");
+
+	cl::Kernel GetKernel(const std::string& kernelName,
+	                     const std::map<std::string, std::string>& defines);
+
+private:
+	std::vector<const char*> sourceFileNames;
+	cl::Context context;
+	cl::Device device;
+	std::string flags;
+	std::unordered_map<std::string, std::unordered_map<std::string, cl::Kernel> > variants;
+};
+
+// Builds each program the first time one of its kernels is requested, so
+// programs that are never used are never compiled. Kernel names come from
+// scanning the sources. Prefetch starts a build on a background thread, and
+// independent programs prefetched together build in parallel.
+class ProgramLibrary
+{
+public:
+	ProgramLibrary(const cl::Context& context, const cl::Device& device);
+	~ProgramLibrary();
+
+	void Add(const std::vector<const char*>& sourceFileNames, const std::string& buildOptions = "");
+
+	void Prefetch(const std::string& kernelName);
+	void PrefetchAll();
+
+	// A new kernel object, waiting for its program to finish building
+	cl::Kernel GetKernel(const std::string& kernelName);
+
+private:
+	struct Entry
+	{
+		std::vector<const char*> sourceFileNames;
+		std::string buildOptions;
+		std::shared_future<cl::Program> program;
+	};
+
+	Entry& FindEntry(const std::string& kernelName);
+	void Start(Entry& entry);
+
+	cl::Context context;
+	cl::Device device;
+	std::deque<Entry> entries;
+	std::unordered_map<std::string, size_t> owners;
+};
+
+struct MemoryUsage
+{
+	size_t liveBytes;
+	size_t peakBytes;
+	size_t allocations;
+};
+
+// Attributes the device memory allocated on this thread while it is alive to
+// name. Tags nest and the innermost one wins, untagged memory is "Other".
+class MemoryTag
+{
+public:
+	explicit MemoryTag(const std::string& name);
+	~MemoryTag();
+
+	MemoryTag(const MemoryTag&) = delete;
+	MemoryTag& operator=(const MemoryTag&) = delete;
+};
+
+// Buffers and images made through MakeBuffer and MakeImage2D count against
+// their context until the runtime destroys them. Memory wrapping a host
+// pointer is not counted.
+MemoryUsage
+GetMemoryUsage(const cl::Context& context);
+
+std::map<std::string, MemoryUsage>
+GetMemoryUsageByTag(const cl::Context& context);
+
+void
+PrintMemoryReport(const cl::Context& context, std::ostream& out = std::cout);
+
+// Bytes the context may still allocate on device: OCL_MEMORY_BUDGET (in MB)
+// or 90% of the device's global memory, minus what is already live
+size_t
+GetMemoryBudget(const cl::Context& context, const cl::Device& device);
+
+// Whether allocations of these sizes fit in the remaining budget and each is
+// within the device's largest single allocation. Pipelines check this to pick
+// a strategy before the runtime fails with CL_MEM_OBJECT_ALLOCATION_FAILURE.
+bool
+FitsInMemoryBudget(const cl::Context& context, const cl::Device& device,
+                   const std::vector<size_t>& sizes);
+
 cl::Image2D
 MakeImage2D(const cl::Context& context,
             cl_mem_flags flags,
@@ -39,10 +278,583 @@ MakeBuffer(const cl::Context& context,
            size_t size,
            void* hostPtr = nullptr);
 
+struct ProfiledCommand
+{
+	std::string name;
+	cl_command_type type;
+	cl_command_queue queue;
+	cl_ulong queued;
+	cl_ulong submit;
+	cl_ulong start;
+	cl_ulong end;
+};
+
+// Collects QUEUED/SUBMIT/START/END timestamps of enqueued commands and exports
+// them as summary statistics or a Chrome/Perfetto trace. Pass Record(name) as
+// the event argument of any enqueue call, or Track an event that already exists.
+// The command queue needs CL_QUEUE_PROFILING_ENABLE.
+class EventProfiler
+{
+public:
+	cl::Event* Record(const std::string& name);
+	void Track(const std::string& name, const cl::Event& event);
+
+	// Waits for and resolves every recorded event
+	const std::vector<ProfiledCommand>& Collect();
+	void Clear();
+
+	void PrintSummary(std::ostream& out = std::cout);
+	void WriteChromeTrace(const std::string& fileName);
+
+private:
+	std::deque<std::pair<std::string, cl::Event> > pending;
+	std::vector<ProfiledCommand> commands;
+};
+
+// A future fulfilled from the event's completion callback, or failed if the
+// command terminates abnormally. Flushes the event's queue so it can complete.
+std::shared_future<void>
+MakeEventFuture(const cl::Event& event);
+
+// Runs work on a host thread once event completes, so encoding, decoding or
+// parsing overlaps the device work still queued. Like any std::async future,
+// the result blocks in its destructor, so keep it until the work is needed.
+template <typename Function>
+auto ThenOnHost(const cl::Event& event, Function work) -> std::future<decltype(work())>
+{
+	std::shared_future<void> completed = MakeEventFuture(event);
+	return std::async(std::launch::async, [completed, work]() mutable
+	{
+		completed.get();
+		return work();
+	});
+}
+
+// Non-blocking reads whose futures complete when the data is on the host
+std::shared_future<void>
+EnqueueReadBufferAsync(const cl::CommandQueue& queue, const cl::Buffer& buffer,
+                       size_t offset, size_t size, void* ptr,
+                       const std::vector<cl::Event>* events = nullptr, cl::Event* event = nullptr);
+
+std::shared_future<void>
+EnqueueReadImageAsync(const cl::CommandQueue& queue, const cl::Image2D& image,
+                      size_t w, size_t h, void* ptr,
+                      const std::vector<cl::Event>* events = nullptr, cl::Event* event = nullptr);
+
+// Derives event wait lists from the memory objects each command reads and
+// writes, so independent commands overlap on an out-of-order queue. A command
+// waits for the last writer of everything it touches and, when it writes, for
+// the readers since. Falls back to an in-order queue, where no wait lists are
+// needed, if the device doesn't support out-of-order execution.
+class CommandScheduler
+{
+public:
+	CommandScheduler(const cl::Context& context, const cl::Device& device, cl_command_queue_properties properties = 0);
+
+	const cl::CommandQueue& GetQueue() const;
+	bool IsOutOfOrder() const;
+
+	// The enqueue callback receives the wait list (null when empty) and the event to signal
+	template <typename Enqueue>
+	cl::Event Submit(const std::vector<cl::Memory>& reads, const std::vector<cl::Memory>& writes, Enqueue enqueue)
+	{
+		std::vector<cl::Event> waitList = GetWaitList(reads, writes);
+		cl::Event event;
+
+		enqueue(waitList.empty() ? nullptr : &waitList, &event);
+		Commit(reads, writes, event);
+
+		return event;
+	}
+
+	// Waits for everything submitted so far and forgets the tracked events
+	void Finish();
+
+private:
+	struct MemoryState
+	{
+		cl::Event lastWrite;
+		std::vector<cl::Event> reads;
+	};
+
+	std::vector<cl::Event> GetWaitList(const std::vector<cl::Memory>& reads, const std::vector<cl::Memory>& writes);
+	void Commit(const std::vector<cl::Memory>& reads, const std::vector<cl::Memory>& writes, const cl::Event& event);
+
+	cl::CommandQueue queue;
+	bool outOfOrder;
+	std::unordered_map<cl_mem, MemoryState> states;
+};
+
+// Recycles device allocations, buffers by size class and images by flags, format
+// and size. Allocations stay in use until handed back with Release. Host data is
+// uploaded through the pool's queue, so on an in-order queue a released object is
+// only overwritten after the commands already using it.
+class MemoryPool
+{
+public:
+	MemoryPool(const cl::Context& context, const cl::CommandQueue& queue);
+
+	cl::Buffer AcquireBuffer(cl_mem_flags flags, size_t size, void* hostPtr = nullptr);
+	cl::Image2D AcquireImage2D(cl_mem_flags flags, cl::ImageFormat imageFormat,
+	                           size_t w, size_t h, void* hostPtr = nullptr);
+
+	void Release(const cl::Buffer& buffer);
+	void Release(const cl::Image2D& image);
+
+	size_t GetHits() const;
+	size_t GetMisses() const;
+	void PrintStats() const;
+
+	// Records the pool's uploads
+	void SetProfiler(EventProfiler* profiler);
+
+private:
+	cl::Context context;
+	cl::CommandQueue queue;
+	EventProfiler* profiler;
+	std::unordered_map<std::string, std::vector<cl::Buffer> > freeBuffers;
+	std::unordered_map<std::string, std::vector<cl::Image2D> > freeImages;
+	std::unordered_map<cl_mem, std::string> liveKeys;
+	size_t hits;
+	size_t misses;
+	size_t bytesAllocated;
+};
+
+// Pooled variants of MakeImage2D and MakeBuffer
+cl::Image2D
+MakeImage2D(MemoryPool& pool,
+            cl_mem_flags flags,
+            cl::ImageFormat imageFormat,
+            size_t w, size_t h,
+            void* hostPtr = nullptr);
+
+cl::Buffer
+MakeBuffer(MemoryPool& pool,
+           cl_mem_flags flags,
+           size_t size,
+           void* hostPtr = nullptr);
+
 cl::Sampler
 MakeSampler(const cl::Context& context,
             cl_bool normalizedCoords,
             cl_addressing_mode addressingMode,
             cl_filter_mode filterMode);
 
+// Zero-copy host memory: OCL_ZERO_COPY=on/off, by default on for devices that
+// share physical memory with the host, such as CPUs and integrated GPUs
+bool
+UseZeroCopy(const cl::Device& device);
+
+// Page-aligned allocation suitable for CL_MEM_USE_HOST_PTR, size is rounded up to whole pages
+void*
+AllocateAligned(size_t size, size_t alignment = 4096);
+
+void
+FreeAligned(void* ptr);
+
+// Frees aligned host memory once the runtime destroys the object created on it.
+// Kernel argument caches keep their own references, so dropping the handle is not enough.
+void
+FreeAlignedOnRelease(const cl::Memory& memory, void* ptr);
+
+// Blocking map of an image or buffer, unmapped when destroyed
+class MappedMemory
+{
+public:
+	MappedMemory(const cl::CommandQueue& queue, const cl::Image2D& image, cl_map_flags flags);
+	MappedMemory(const cl::CommandQueue& queue, const cl::Buffer& buffer, cl_map_flags flags, size_t size, size_t offset = 0);
+	~MappedMemory();
+
+	MappedMemory(const MappedMemory&) = delete;
+	MappedMemory& operator=(const MappedMemory&) = delete;
+
+	void* GetData() const;
+	size_t GetRowPitch() const;
+
+	// Rows of rowSize bytes without padding, in place when the row pitch allows it
+	const unsigned char* GetPackedRows(size_t rowSize, size_t rows, std::vector<unsigned char>& packed) const;
+
+private:
+	cl::CommandQueue queue;
+	cl::Memory memory;
+	void* data;
+	size_t rowPitch;
+};
+
+// Every file in directory with the given extension, sorted by name
+std::vector<std::string>
+ListFiles(const std::string& directory, const std::string& extension);
+
+// Device images and host buffers of one in-flight frame
+struct StreamSlot
+{
+	std::string name;
+	int width;
+	int height;
+	unsigned char* hostInput;
+	std::vector<unsigned char> hostOutput;
+	cl::Image2D input;
+	cl::Image2D output;
+	std::vector<cl::Image2D> scratch;
+	cl::Event downloaded;
+	bool busy;
+};
+
+// Streams RGBA8 frames through separate upload, compute and download queues.
+// Every in-flight frame owns a slot with an input/output image pair, so with
+// three slots the upload of frame N+1 and the download of frame N-1 overlap
+// the kernels of frame N. Push only blocks when it has to recycle a slot.
+class StreamingPipeline
+{
+public:
+	// Enqueues a frame's kernels after the wait list, returning the last event
+	typedef std::function<cl::Event(const cl::CommandQueue& queue, StreamSlot& slot,
+	                                const std::vector<cl::Event>& waitList)> ComputeStage;
+	// Receives a frame once its output is on the host, and owns hostInput from then on
+	typedef std::function<void(StreamSlot& slot)> CompleteStage;
+
+	StreamingPipeline(const cl::Context& context, const cl::Device& device, MemoryPool& pool,
+	                  ComputeStage compute, CompleteStage complete, size_t scratchImages = 0,
+	                  size_t depth = 3, cl_command_queue_properties properties = 0);
+	~StreamingPipeline();
+
+	void Push(const std::string& name, unsigned char* hostInput, int width, int height);
+	// Waits for every frame still in flight
+	void Flush();
+
+	// Records uploads and downloads, the queues need CL_QUEUE_PROFILING_ENABLE
+	void SetProfiler(EventProfiler* profiler);
+
+private:
+	void Reserve(StreamSlot& slot, int width, int height);
+	void Complete(StreamSlot& slot);
+
+	cl::CommandQueue uploadQueue;
+	cl::CommandQueue computeQueue;
+	cl::CommandQueue downloadQueue;
+	MemoryPool& pool;
+	ComputeStage compute;
+	CompleteStage complete;
+	size_t scratchImages;
+	std::vector<StreamSlot> slots;
+	size_t next;
+	EventProfiler* profiler;
+};
+
+// What a kernel build costs per work-item and work-group on one device
+struct KernelResources
+{
+	std::string name;
+	std::string buildOptions;
+	size_t workGroupSize;
+	size_t preferredWorkGroupSizeMultiple;
+	cl_ulong localMemSize;
+	cl_ulong privateMemSize;
+	// Work-groups one compute unit's local memory holds, 0 if local memory isn't the limit
+	cl_ulong groupsPerComputeUnit;
+};
+
+// localMemArgsSize adds __local arguments not set on the kernel yet, since
+// CL_KERNEL_LOCAL_MEM_SIZE only counts the ones already set
+KernelResources
+GetKernelResources(const cl::Kernel& kernel, const cl::Device& device, cl_ulong localMemArgsSize = 0);
+
+// Collects the resources of built kernels for a table on the console and a
+// JSON file, to show which kernels local or private memory holds back
+class KernelReport
+{
+public:
+	void Add(const cl::Kernel& kernel, const cl::Device& device, cl_ulong localMemArgsSize = 0);
+	void Add(const std::unordered_map<std::string, cl::Kernel>& kernels, const cl::Device& device);
+
+	const std::vector<KernelResources>& GetKernels() const;
+
+	void Print(std::ostream& out = std::cout) const;
+	void WriteJson(const std::string& fileName) const;
+
+private:
+	std::vector<KernelResources> kernels;
+};
+
+// Picks local work sizes by timing candidates per device, kernel build and
+// global size, keeping the winners in a text database (OCL_TUNING_DB, default
+// WorkGroupTuning.txt, empty to keep them in memory only). Candidates start at
+// CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE and must divide the global size.
+// The kernel runs several times with its current arguments, so only tune
+// kernels that don't update their inputs in place.
+class WorkGroupTuner
+{
+public:
+	WorkGroupTuner();
+	explicit WorkGroupTuner(const std::string& fileName);
+
+	// Benchmarks the first time a shape is seen, after the wait list and the queue have drained
+	cl::NDRange GetLocalSize(const cl::CommandQueue& queue, const cl::Kernel& kernel, const cl::NDRange& global,
+	                         const std::vector<cl::Event>* events = nullptr);
+
+private:
+	std::vector<size_t> Tune(const cl::CommandQueue& queue, const cl::Device& device, const cl::Kernel& kernel,
+	                         const cl::NDRange& global, const std::vector<cl::Event>* events);
+	void Load();
+	void Save(const std::string& key, const std::vector<size_t>& localSize);
+
+	std::string fileName;
+	std::map<std::string, std::vector<size_t> > results;
+};
+
+// Stands for a memory object that is bound when a CommandGraph is replayed
+struct GraphBinding
+{
+	size_t id;
+};
+
+struct CommandBufferFunctions;
+
+// A kernel sequence recorded once and replayed per frame. Arguments given as
+// GraphBinding are bound at replay, everything else is fixed at record time.
+// Every launch gets its own copy of the kernel, so replaying only sets the bound
+// arguments that changed. With cl_khr_command_buffer each distinct set of
+// bindings is finalised into a command buffer once and enqueued in one call.
+// Graphs are replayed on an in-order queue.
+class CommandGraph
+{
+public:
+	explicit CommandGraph(const cl::CommandQueue& queue);
+	~CommandGraph();
+
+	CommandGraph(const CommandGraph&) = delete;
+	CommandGraph& operator=(const CommandGraph&) = delete;
+
+	GraphBinding AddBinding();
+
+	template <typename... Args>
+	void Record(const cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local, const Args&... args)
+	{
+		Node node = MakeNode(kernel, global, local);
+		cl_uint index = 0;
+
+		int expand[] = { 0, (SetRecordedArg(node, index++, args), 0)... };
+		(void)expand;
+
+		nodes.push_back(node);
+	}
+
+	// Binds the memory objects in AddBinding order and enqueues the graph
+	void Replay(const std::vector<cl::Memory>& bindings, const std::vector<cl::Event>* events = nullptr,
+	            cl::Event* event = nullptr);
+
+	bool UsesCommandBuffers() const;
+	size_t GetSize() const;
+
+private:
+	struct Node
+	{
+		cl::Kernel kernel;
+		std::vector<size_t> global;
+		std::vector<size_t> local;
+		std::vector<std::pair<cl_uint, size_t> > bindings;
+		std::vector<cl_mem> bound;
+	};
+
+	// A recorded command buffer holds the bound handles, which stay retained here
+	// so a released object's handle can't be reused by a new one and hit its entry
+	struct RecordedCommandBuffer
+	{
+		void* commandBuffer;
+		std::vector<cl::Memory> bindings;
+	};
+
+	Node MakeNode(const cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local);
+	void Bind(const std::vector<cl_mem>& handles);
+	void* MakeCommandBuffer();
+
+	template <typename T>
+	void SetRecordedArg(Node& node, cl_uint index, const T& value)
+	{
+		cl_int err = node.kernel.setArg(index, value);
+		CheckErrorCode(err, "Unable to record kernel argument " + std::to_string(index));
+	}
+
+	void SetRecordedArg(Node& node, cl_uint index, const GraphBinding& binding)
+	{
+		node.bindings.push_back(std::make_pair(index, binding.id));
+		node.bound.push_back(nullptr);
+	}
+
+	cl::CommandQueue queue;
+	std::vector<Node> nodes;
+	size_t bindingCount;
+	std::unique_ptr<CommandBufferFunctions> functions;
+	std::map<std::vector<cl_mem>, RecordedCommandBuffer> commandBuffers;
+};
+
+namespace detail
+{
+	// Argument comparison used to skip redundant setArg calls. OpenCL objects
+	// compare by handle, everything else by value.
+	template <typename T>
+	bool ArgEquals(const T& a, const T& b)
+	{
+		return a == b;
+	}
+
+	inline bool ArgEquals(const cl::Buffer& a, const cl::Buffer& b)
+	{
+		return a() == b();
+	}
+
+	inline bool ArgEquals(const cl::Image2D& a, const cl::Image2D& b)
+	{
+		return a() == b();
+	}
+
+	inline bool ArgEquals(const cl::Sampler& a, const cl::Sampler& b)
+	{
+		return a() == b();
+	}
+
+	inline bool ArgEquals(const cl::LocalSpaceArg& a, const cl::LocalSpaceArg& b)
+	{
+		return a.size_ == b.size_;
+	}
+
+	inline bool ArgEquals(const cl_float4& a, const cl_float4& b)
+	{
+		return std::equal(a.s, a.s + 4, b.s);
+	}
+}
+
+// Kernel handle resolved once at startup. The argument list is part of the
+// type, so call sites are checked at compile time, and each argument is only
+// sent to the driver when it differs from the previous launch. Use one functor
+// per kernel object, since the cached state assumes nothing else sets its arguments.
+template <typename... Args>
+class KernelFunctor
+{
+public:
+	KernelFunctor()
+	{
+	}
+
+	explicit KernelFunctor(const cl::Kernel& kernel)
+		: kernel(kernel), name(kernel.getInfo<CL_KERNEL_FUNCTION_NAME>())
+	{
+		CheckArity();
+	}
+
+	KernelFunctor(const std::unordered_map<std::string, cl::Kernel>& kernels, const std::string& name)
+		: name(name)
+	{
+		auto entry = kernels.find(name);
+		if (entry == kernels.end())
+		{
+			throw std::runtime_error("Kernel " + name + " not found");
+		}
+
+		kernel = entry->second;
+		CheckArity();
+	}
+
+	void SetArgs(const Args&... args)
+	{
+		SetArgsFrom<0>(args...);
+	}
+
+	void Enqueue(const cl::CommandQueue& queue,
+	             const cl::NDRange& global, const cl::NDRange& local,
+	             const std::vector<cl::Event>* events, cl::Event* event,
+	             const Args&... args)
+	{
+		SetArgs(args...);
+
+		cl::NDRange launchLocal = local;
+		if (tuner != nullptr && local.dimensions() == 0)
+		{
+			launchLocal = tuner->GetLocalSize(queue, kernel, global, events);
+		}
+
+		cl::Event* launchEvent = event;
+		if (profiler != nullptr && event == nullptr)
+		{
+			launchEvent = profiler->Record(profileName);
+		}
+
+		cl_int err = queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, launchLocal, events, launchEvent);
+		CheckErrorCode(err, "Unable to enqueue " + name + " kernel");
+
+		if (profiler != nullptr && event != nullptr)
+		{
+			profiler->Track(profileName, *event);
+		}
+	}
+
+	void operator()(const cl::CommandQueue& queue,
+	                const cl::NDRange& global, const cl::NDRange& local,
+	                const Args&... args)
+	{
+		Enqueue(queue, global, local, nullptr, nullptr, args...);
+	}
+
+	const cl::Kernel& GetKernel() const
+	{
+		return kernel;
+	}
+
+	const std::string& GetName() const
+	{
+		return name;
+	}
+
+	// Records every launch under the given label, or the kernel's name
+	void SetProfiler(EventProfiler* profiler, const std::string& label = "")
+	{
+		this->profiler = profiler;
+		profileName = label.empty() ? name : label;
+	}
+
+	// Launches given cl::NullRange as their local size use the tuned size instead
+	void SetTuner(WorkGroupTuner* tuner)
+	{
+		this->tuner = tuner;
+	}
+
+private:
+	void CheckArity() const
+	{
+		if (kernel.getInfo<CL_KERNEL_NUM_ARGS>() != sizeof...(Args))
+		{
+			throw std::runtime_error("Kernel " + name + " takes " + std::to_string(kernel.getInfo<CL_KERNEL_NUM_ARGS>()) +
+			                         " arguments, functor declares " + std::to_string(sizeof...(Args)));
+		}
+	}
+
+	template <size_t Index>
+	void SetArgsFrom()
+	{
+	}
+
+	template <size_t Index, typename T, typename... Rest>
+	void SetArgsFrom(const T& value, const Rest&... rest)
+	{
+		if (!argSet[Index] || !detail::ArgEquals(std::get<Index>(values), value))
+		{
+			cl_int err = kernel.setArg(Index, value);
+			CheckErrorCode(err, "Unable to set argument " + std::to_string(Index) + " of " + name + " kernel");
+
+			std::get<Index>(values) = value;
+			argSet[Index] = true;
+		}
+
+		SetArgsFrom<Index + 1>(rest...);
+	}
+
+	cl::Kernel kernel;
+	std::string name;
+	std::tuple<Args...> values;
+	bool argSet[sizeof...(Args) + 1] = {};
+	EventProfiler* profiler = nullptr;
+	std::string profileName;
+	WorkGroupTuner* tuner = nullptr;
+};
+
 #endif // __OCL_UTILS_H__
@@ -8,6 +8,9 @@
 
 #include "OCLUtils.h"
 
+// Kernel sources embedded at build time by EmbedKernel.ps1
+#include "PatternMatching.cl.h"
+
 #define CL_FILENAME "PatternMatching.cl"
 #define INPUT_FILENAME "DNA_sequence.txt"
 #define EOF_SYMBOL "//"
@@ -63,8 +66,9 @@ int main()
      * Get device information
      *
      */
-    auto numberOfWorkGroups = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
-    auto maxWorkGroupSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    auto profile = GetDeviceProfile(device);
+    auto numberOfWorkGroups = profile->computeUnits;
+    auto maxWorkGroupSize = profile->maxWorkGroupSize;
     auto globalSize = numberOfWorkGroups * maxWorkGroupSize;
     auto charsPerItem = size / globalSize + 1;
 
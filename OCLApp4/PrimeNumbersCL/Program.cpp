@@ -6,6 +6,9 @@
 
 #include "OCLUtils.h"
 
+// Kernel sources embedded at build time by EmbedKernel.ps1
+#include "PrimeNumbers.cl.h"
+
 #define CL_FILENAME "PrimeNumbers.cl"
 
 #define PRIME_NUMBERS_KERNEL "PrimeNumbers"
@@ -63,8 +66,9 @@ int main()
      * Get device information
      *
      */
-    auto numberOfWorkGroups = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
-    auto maxWorkGroupSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    auto profile = GetDeviceProfile(device);
+    auto numberOfWorkGroups = profile->computeUnits;
+    auto maxWorkGroupSize = profile->maxWorkGroupSize;
 
     /*
      *